@@ -3,7 +3,7 @@
 *   Assignment: Archive
 *   Due Date: 2022/05/09
 *   Description: Create a zip folding with directories and text files
-*   To compile use: gcc -std=c99 -Wall -Wextra -Wpedantic -Werror -o smallsh smallsh.c
+*   To compile use: gcc -std=c99 -Wall -Wextra -Wpedantic -Werror -pthread -o smallsh smallsh.c
 *   Last Edited: 2022/05/03
 */
 
@@ -70,17 +70,38 @@
 
 
 // ----------------------------------------------------------- LIBRARIES ------------------------------------------------------------ //
-#define _POSIX_C_SOURCE 200809L // signals, getline()
+#define _GNU_SOURCE             // signals, getline(), dup3()
 
+#include <ctype.h>       // isalpha(), isalnum() for variable names
+#include <dirent.h>      // getdents64() for globbing
+#include <errno.h>       // errno, EINTR
 #include <fcntl.h>       // fcntl - allows the changing of properties of a file currently in use
+#include <linux/fs.h>    // FICLONE
 #include <signal.h>      // kill()
 #include <stdbool.h>     // boolean data type, for convenience and familiarity
+#include <limits.h>      // IOV_MAX
+#include <poll.h>        // poll() in the PATH index thread
+#include <pthread.h>     // threads walking directories for **
+#include <sched.h>       // sched_yield() while a history record is written
+#include <stdarg.h>      // va_list for format_piece()
+#include <stddef.h>      // offsetof()
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h> // eventfd() to wake the PATH index thread
+#include <sys/file.h>    // flock() on the command index
+#include <sys/inotify.h> // watches on the PATH directories
+#include <sys/ioctl.h>   // ioctl() for FICLONE
+#include <sys/mman.h>    // memfd_create() for here-documents
+#include <sys/sendfile.h> // sendfile()
+#include <sys/stat.h>    // stat() for test
+#include <sys/syscall.h> // SYS_pidfd_open for xargs
 #include <sys/types.h>   // pid_t
+#include <sys/uio.h>     // writev()
 #include <sys/wait.h>    // wait
+#include <termios.h>     // raw mode for the line editor
+#include <time.h>        // clock_gettime() for the directory listing cache
 #include <unistd.h>      // fork
 
 
@@ -90,550 +111,11871 @@ int max_line_length = 2048;   // maximum number of chars per input line
 
 int exit_status = 0;          // exit status of the parent
 int status = -1;              // the child exit status to return
+int shell_pid = 0;            // $$, taken as the shell starts so subshells expand it the same
 
-int bchildren[500];           // array to hold all children running in the background
+int * bchildren = NULL;       // array to hold all children running in the background, grown as needed
 int num_bchildren = 0;        // number of children in the bchildren array
+int max_bchildren = 0;        // capacity of the bchildren array
+int max_xargs_procs = 500;    // most batches xargs -P runs at once
 
 bool tstp = false;            // TSTP controls whether or not background processes are currently allowed
 
+/* Memory for one input line. Chunks are bump-allocated and thrown away together once the line has run. */
+struct arena_chunk
+{
+    struct arena_chunk * next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct arena_chunk * line_arena = NULL;
+
+/* A point in the line arena to go back to. */
+struct arena_mark
+{
+    struct arena_chunk * chunk;
+    size_t used;
+};
+
+/* A shell variable. entry holds "NAME=value", so an exported variable's envp slot can point straight at it. */
+struct variable
+{
+    char * entry;                // NAME=value
+    size_t name_len;             // length of NAME within entry
+    uint32_t hash;               // hash of NAME
+    int env_index;               // slot in shell_envp, or -1 if the variable is not exported
+    int64_t int_value;           // value as a number, for arithmetic
+    bool int_valid;              // whether int_value is up to date with entry
+    struct variable * next;      // next variable in the same bucket
+};
+
+struct variable ** var_table = NULL;  // hash table of variables, var_buckets is always a power of two
+size_t var_buckets = 0;
+size_t num_vars = 0;
+
+/* Token types from the lexer. Redirections and list operators are kept as these types. */
+enum token_type
+{
+    TOK_END,       // end of a redirection list
+    TOK_SEMI,      // ;  or the end of the line
+    TOK_AND,       // &&
+    TOK_OR,        // ||
+    TOK_AMP,       // &
+    TOK_LESS,      // <
+    TOK_GREAT,     // >
+    TOK_HEREDOC,   // << or <<-, with a body that is expanded
+    TOK_HEREDOC_LITERAL,  // << or <<- with a quoted delimiter, or a body with nothing to expand
+    TOK_HERESTRING // <<<
+};
+
+/* A redirection of a command. For a here-document the target is the body, and for a here-string the word. dest is
+   the descriptor it replaces, worked out by the lexer. In a parsed line fd is only used by a literal here-document,
+   which keeps its memfd once it is made. In a plan from plan_redirections() every redirection has fd open, ready to
+   be dup'd onto dest. */
+struct redirection
+{
+    int type;
+    char * target;
+    int dest;
+    int fd;
+};
+
+/* Kinds of command in a list. */
+enum command_type
+{
+    CMD_SIMPLE,
+    CMD_WHILE,
+    CMD_UNTIL,
+    CMD_FOR
+};
+
+/* One command in a list: a run of the list's words and redirections, and the operator joining it to the next command.
+   A loop's condition is the commands from just after it up to body, and its body runs from body up to end. A for
+   loop has no condition; its words are its variable's name and then the words it goes through. */
+struct command
+{
+    int type;
+    int first_word;
+    int num_words;
+    int first_redir;
+    int num_redirs;
+    int connector;     // TOK_SEMI, TOK_AND, TOK_OR or TOK_AMP
+    int body;          // first command of a loop's body
+    int end;           // index of the command after this one and everything nested in it
+};
+
+/* A parsed line. All commands share the flat words and redirs arrays, which live in the line arena. */
+struct command_list
+{
+    char ** words;
+    struct redirection * redirs;
+    struct command * commands;
+    int num_commands;
+    int num_redirs;
+};
+
+/* Where lex_list() is in the line, and how much of the list's flat arrays it has filled. */
+struct parser
+{
+    char * p;
+    struct command_list * list;
+    int num_words;
+    int num_redirs;
+    int * heredocs;       // redirections whose bodies follow the line, in order
+    bool * strip_tabs;    // whether each of those was <<-
+    int num_heredocs;
+    bool error;
+};
+
+/* A built in command, run in the shell process by run_builtin(). It reports its result through status. A built in that
+   changes nothing in the shell is subshell_safe, and runs without a fork in a command substitution. */
+struct builtin
+{
+    const char * name;
+    void (*run)(char ** arguments, int argc);
+    bool subshell_safe;
+};
+
+/* A descriptor replaced by a built in's redirection and the copy that puts it back. An fd of -1 marks an extra output
+   file of a fan out, with copy holding the open file. */
+struct saved_fd
+{
+    int fd;
+    int copy;
+};
+
+/* Output queued by the built ins and the messages of the shell, written with one writev() by out_flush(). */
+struct outbuf
+{
+    struct iovec * iov;
+    int count;
+    int cap;
+    size_t bytes;
+    char * text;               // the messages, which pieces with a NULL address take their bytes from in order
+    size_t text_len;
+    size_t text_cap;
+};
+
+struct outbuf shell_out = { NULL, 0, 0, 0, NULL, 0, 0 };
+
+/* Tracing, on when SMALLSH_TRACE names a file. Each phase of a command becomes Chrome trace events, which Perfetto
+   and chrome://tracing load. Events are buffered and appended with O_APPEND, so the shell and its children can all
+   write to one file. The JSON array is never closed, since the viewers accept that, and a shell that dies still
+   leaves a trace that loads. With tracing off, each phase costs a test of trace_fd. */
+int trace_fd = -1;
+char * trace_buf = NULL;
+size_t trace_len = 0;
+size_t trace_cap = 0;
+int trace_pid = 0;
+long long trace_forked_at = 0;   // CLOCK_MONOTONIC ns a child was forked at, until its setup event is out
+
+/* Metrics, on when SMALLSH_METRICS names a file. The shell counts what it runs and times its forks, execs and reaps,
+   and every metrics_interval_ms, at a prompt, writes them out in the OpenMetrics text format for node_exporter's
+   textfile collector. The file is written beside its final name and renamed over it, so a scrape never reads half
+   of one. Children note when they exec, and the SIGCHLD handler when they exit, in child_slots, a table shared with
+   every child and looked up by pid, which the shell reads when it waits on them. */
+#define METRIC_BUCKETS 20
+#define CHILD_SLOTS 1024    // a power of two
+#define CHILD_PROBES 64     // slots from the one its pid maps to a child may take
+
+struct histogram_metric
+{
+    unsigned long long counts[METRIC_BUCKETS];   // per bucket, the last one for anything over every bound
+    unsigned long long count;
+    double sum;
+};
+
+struct child_slot
+{
+    int pid;                   // the child's, 0 when free, -1 while a child is taking it
+    int parent;                // the shell that forked the child, which alone waits on it
+    int failed;                // the child could not exec its command
+    long long forked_at;       // CLOCK_MONOTONIC ns, all three
+    long long exec_at;         // of its last execve() attempt, or 0
+    long long exited_at;       // when the SIGCHLD for it came in, or 0
+    char command[48];          // name of the command it exec'd, for its run time histogram
+};
+
+struct metrics
+{
+    unsigned long long builtins;
+    unsigned long long externals;
+    unsigned long long exec_failures;
+    unsigned long long jobs_started;
+    unsigned long long jobs_finished;
+    unsigned long long jobs_killed;
+    struct histogram_metric fork;     // time the shell spends in fork()
+    struct histogram_metric exec;     // from fork() to the child's exec
+    struct histogram_metric reap;     // from a background job's exit to the shell reaping it
+};
+
+const double metric_bounds[METRIC_BUCKETS - 1] = { 0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+                                                   0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+struct metrics metrics;
+char * metrics_file = NULL;
+struct child_slot * child_slots = NULL;   // CHILD_SLOTS slots in memory shared with the children
+struct child_slot * own_slot = NULL;      // in a child, the slot it took, if it found one
+long metrics_interval_ms = 10000;
+long long metrics_written_at = 0;
+int metrics_pid = 0;                      // the shell's own, which alone writes the file
+
+/* Run times of the external commands, kept by command name in log bucketed histograms the way HdrHistogram keeps
+   them: below 64us every microsecond has a bucket, and every doubling above that has 32, so a bucket is never wider
+   than a 32nd of the times in it. hist reports percentiles from them. They are kept when SMALLSH_HISTOGRAMS is set,
+   and if it names a file, loaded from it as the shell starts and merged back into it as it exits. */
+#define HIST_BUCKETS 1216         // 64 exact buckets, then 32 for each power of two up to 2^42us, some 50 days
+#define HIST_FILE_VERSION 1
+
+struct command_hist
+{
+    char * name;
+    uint32_t hash;
+    uint32_t counts[HIST_BUCKETS];   // every run known, from the file and from this session
+    uint32_t * fresh;                // runs from this session not yet saved, or NULL if there are none
+    unsigned long long total;
+    unsigned long long max;          // us
+};
+
+struct command_hist ** hists = NULL;   // open addressed by hash_name() of the name
+size_t hists_cap = 0;
+size_t num_hists = 0;
+bool hists_on = false;
+char * hist_file = NULL;
+int hist_pid = 0;                      // the shell's own, which alone saves the file
+
+bool test_error = false;      // set when test hits an expression it cannot evaluate
+
+/* Input the read built in has taken from a seekable file but not used yet. buf holds the file's bytes from start. */
+struct read_buffer
+{
+    char * buf;
+    size_t len;
+    off_t start;
+    int fd;
+    int generation;            // fd_generation when the buffer was filled
+};
+
+struct read_buffer read_cache = { NULL, 0, 0, -1, 0 };
+size_t read_block_size = 65536;
+int fd_generation = 0;        // changed whenever the shell's own descriptors are redirected
+
+size_t copy_buffer_size = 1048576;  // buffer for cat and cp when no kernel copy call fits the descriptors
+
+/* Pipes to the jobs of <(...) and >(...), reached by the commands that expanded them through /dev/fd. The shell keeps
+   its ends close on exec, so only the command the pipes were made for gets them. */
+int procsubst_fds[64];
+int procsubst_pids[64];
+int num_procsubst = 0;
+int max_procsubst = 64;
+int procsubst_start = 0;      // first of the entries made for the command being run
+
+bool substituted = false;     // a command substitution ran while the current command was expanded
+bool expansion_failed = false;  // an expansion of the current command hit an error, so it is not run
+
+/* A {first..last..step} range of brace expansion, as count values from first on, step apart. */
+struct brace_range
+{
+    long long first;
+    long long step;
+    unsigned long long count;
+    int width;             // zero padded width when an end was written with leading zeros, otherwise 0
+    bool chars;            // whether the values are letters rather than numbers
+};
+
+/* One step of a compiled glob pattern: a run of literal text, any one character, any run of characters, or one
+   character out of a bracket set. */
+enum glob_op
+{
+    GOP_TEXT, GOP_ANY, GOP_STAR, GOP_SET
+};
+
+struct glob_step
+{
+    int op;
+    const char * text;     // the literal text of GOP_TEXT, with its backslashes removed
+    size_t len;
+    uint8_t * set;         // bitmap of the bytes GOP_SET accepts, already inverted for [!...]
+};
+
+/* A pattern for one path component, compiled once and then matched against every name in a directory. */
+struct glob_matcher
+{
+    struct glob_step * steps;
+    int num_steps;
+    size_t min_len;        // shortest name the pattern can match
+    bool dot;              // the pattern starts with a literal '.', so it may match hidden names
+};
+
+/* The names in a directory as read by getdents64(), each a type byte followed by the NUL terminated name. Listings
+   are kept in dir_cache so that a glob run again soon after does not read a directory that has not changed. */
+struct dir_listing
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;     // the directory's mtime when it was read
+    struct timespec read_at;   // CLOCK_MONOTONIC time it was read
+    char * entries;            // from private_map(), so children do not get them
+    size_t size;
+    size_t cap;
+    int count;
+    bool cached;               // whether dir_cache owns it; otherwise whoever read it frees it
+};
+
+struct dir_listing ** dir_cache = NULL;  // 64 listings direct mapped by device and inode, which a child finds empty
+long dir_cache_ttl_ms = 2000;         // how long a cached listing is trusted before the directory is read again
+size_t dir_cache_max = 4194304;       // listings bigger than this are not kept
+size_t dirent_batch_size = 262144;    // bytes of entries asked of each getdents64() call
+char * dirent_batch = NULL;           // zeroed in a child, like dir_cache, so fork() does not copy it
+
+/* A ** walk shared by the threads doing it. Each thread has a deque of directories still to read: it takes from its
+   own end and, when that is empty, steals from the far end of another's. The walk is done when no directory is queued
+   or being read. */
+struct glob_walk
+{
+    struct glob_worker * workers;
+    int num_workers;
+    struct glob_matcher * tail;  // pattern for names below the **, or NULL to take every name
+    bool dirs;                   // take the directories themselves, for more components after the **
+    const char * prefix;         // path the walk starts from, "" or ending in '/'
+    size_t prefix_len;
+    int base_fd;
+    long pending;                // directories queued or being read, changed atomically
+    size_t bytes;                // memory held by results and queued directories, changed atomically
+    bool overflow;               // bytes went over glob_max_bytes and the walk is being abandoned
+};
+
+struct glob_worker
+{
+    struct glob_walk * walk;
+    pthread_t thread;
+    pthread_mutex_t lock;        // guards the deque against thieves
+    char ** tasks;               // directories to read, relative to the walk's start and ending in '/'
+    int head;                    // where thieves take from
+    int tail;                    // where the owner pushes and pops
+    int cap;
+    char ** results;
+    size_t num_results;
+    size_t results_cap;
+    size_t merged;               // results already merged into the walk's output
+    char * chunk;                // strings are bump allocated here; each chunk begins with a link to the one before
+    size_t chunk_used;
+    char * batch;                // getdents64() buffer of this thread
+    int index;
+};
+
+int glob_max_threads = 8;             // threads a ** walk may use, the shell's own included
+size_t glob_max_bytes = 268435456;    // memory a ** walk may hold before it is abandoned
+size_t glob_chunk_size = 65536;
+
+/* The executables on PATH, kept in a file that every shell of the user maps, so a new shell starts with them known.
+   The file is named after a hash of PATH and laid out, in native byte order, as a header, a stamp per PATH directory,
+   an entry per command sorted by name, then the PATH string and the names. The stamps tell whether a directory has
+   changed since the file was written. A new file is written beside the old one and renamed over it, so a shell never
+   maps one half written. An interactive shell keeps it up to date from a background thread that watches the PATH
+   directories with inotify; readers hold path_index_lock while they look, and the thread swaps in a new index under
+   it. */
+#define COMMAND_INDEX_VERSION 1
+
+struct command_index_header
+{
+    char magic[8];             // "smallsh\n"
+    uint32_t version;
+    uint32_t num_dirs;
+    uint32_t num_commands;
+    uint32_t path;             // offset of the PATH string the index was built from
+    uint64_t size;             // of the whole file, so a short one is never trusted
+};
+
+struct dir_stamp
+{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t name;             // offset of the directory's name
+    uint32_t padding;
+};
+
+struct command_entry
+{
+    uint32_t name;             // offset of the command's name
+    uint32_t dir;              // the PATH directory it was found in first
+    uint32_t mode;
+};
+
+struct path_index
+{
+    char * image;              // the bytes of the file, mapped or built in memory
+    size_t size;
+    bool mapped;
+    struct command_index_header * header;
+    struct dir_stamp * dirs;
+    struct command_entry * entries;
+    int count;
+    bool exact;                // PATH had only absolute directories, so the index says where commands are
+    struct timespec checked;   // CLOCK_MONOTONIC time the stamps were last found to hold
+};
+
+struct path_index * path_index = NULL;
+pthread_mutex_t path_index_lock = PTHREAD_MUTEX_INITIALIZER;
+char * path_index_want = NULL;    // PATH the index should be built from, under path_index_lock
+int path_index_wake = -1;         // eventfd the shell writes to when it changes path_index_want
+char * command_index_dir = NULL;  // directory of the index files, under the user's cache directory
+long command_index_recheck_ms = 1000;  // how long the directory stamps are trusted before they are checked again
+
+/* The line being edited at an interactive prompt. What the terminal shows is kept as well, one attribute byte per
+   character, so a change only rewrites the cells that differ. */
+struct line_editor
+{
+    char * buf;
+    size_t len;
+    size_t cap;
+    size_t pos;            // cursor position in buf
+    const char * prompt;
+    bool tabbed;           // the last key was Tab, so another one lists the choices
+    char * shown;          // the terminal line as drawn, prompt included
+    char * shown_attr;     // 0 for plain text, 1 for a dimmed suggestion
+    size_t shown_len;
+    size_t shown_cap;
+    size_t cursor;         // where in shown the terminal cursor is
+    const char * suggestion;  // the rest of a past command that starts with the line, shown after it
+    uint32_t browse;       // history entry shown by Up and Down, or history.count for the line being typed
+    char * typed;          // the line being typed, kept while Up and Down show others
+    bool searching;        // Ctrl-R is in progress
+    char search[256];
+    size_t search_len;
+    int match;             // history entry the search is showing, or -1
+    bool finished;         // Enter was pressed, so the line is drawn for the last time, without a suggestion
+};
+
+struct termios saved_termios;     // terminal settings to go back to after editing a line
+
+/* Command lines entered at the prompt. Each distinct text is kept once with the newest entry that used it, and is
+   indexed twice: by its trigrams, so Ctrl-R only looks at texts that can hold what is searched for, and in a radix
+   trie whose nodes know the newest text below them, so the suggestion for a line is one walk down the trie. All of it
+   lives in memory from private_map(), so however long the history gets, fork() has no more to copy. */
+struct trigram_list
+{
+    uint32_t key;          // the three bytes, or 0 for an empty slot
+    uint32_t count;
+    uint32_t cap;
+    uint32_t * texts;      // texts holding the trigram, in the order they were first entered
+};
+
+struct trie_node
+{
+    uint32_t text;         // a text the node's label is taken from
+    uint32_t start;        // where the label starts in it
+    uint32_t len;
+    uint32_t child;        // first child, or 0 for none, since node 0 is the root
+    uint32_t sibling;
+    uint32_t newest;       // the text below the node that was entered last
+};
+
+struct history
+{
+    char ** texts;
+    uint32_t * last;       // newest entry of each text
+    uint32_t num_texts;
+    uint32_t texts_cap;
+    uint32_t * entries;    // text of each entry, oldest first
+    uint32_t count;
+    uint32_t cap;
+    uint32_t * by_hash;    // text + 1 by the hash of its contents, open addressed, with 0 for an empty slot
+    uint32_t hash_cap;
+    struct trigram_list * trigrams;
+    uint32_t num_trigrams;
+    uint32_t trigrams_cap;
+    struct trie_node * nodes;
+    uint32_t num_nodes;
+    uint32_t nodes_cap;
+    char * pool;           // texts and trigram lists are carved from here; lists that grow leave their old copy
+    size_t pool_left;
+};
+
+struct history history;
+
+/* The history is kept on disk in a fixed-size ring that every interactive shell of the user maps and appends to.
+   A writer claims the bytes for its record by moving head forward with a compare-and-swap, so shells never wait for
+   each other. A record that would run past the end of the ring is put at its start, and the bytes it skips become
+   filler. Each record is a header, the text and a trailer. The header holds the record's position, which is
+   absolute and never wraps, and a CRC of the text. The trailer holds the record's size and is written last. Readers
+   start at head and follow the trailers back, so a shell reads only records it has not seen. A record that is torn,
+   overwritten or was never finished fails its checks and is passed over. */
+#define HISTORY_FILE_VERSION 1
+#define HISTORY_RECORD 0x52454331u  // trailer of a record
+#define HISTORY_FILLER 0x46494c4cu  // trailer of the bytes skipped at the end of the ring
+
+struct history_file_header
+{
+    char magic[8];             // "smallsh\001"
+    uint32_t version;
+    uint32_t padding;
+    uint64_t capacity;         // bytes in the ring, a multiple of 8
+    uint64_t head;             // position after the last record claimed, only ever moved by compare-and-swap
+};
+
+struct history_record
+{
+    uint64_t position;         // where the record starts, counted from the first byte ever written
+    uint32_t len;              // bytes of text, which follow without a terminating null
+    uint32_t crc;              // CRC-32 of the text
+};
+
+/* A trailer is one uint64_t, so it is written and read in one go: the size of the whole record, or of the filler,
+   trailer included, in the low half, and in the high half a check of the kind, mixed with the size and the position
+   where the record ends. */
+#define TRAILER(size, check) ((uint64_t) (size) | (uint64_t) (check) << 32)
+
+struct history_file_header * history_file = NULL;   // the mapped file, or NULL if the history is not kept
+char * history_ring;             // the bytes after the header
+uint64_t history_seen;           // position up to which the file's records are in history
+size_t history_file_size = 1048576;   // bytes in the ring of a new history file
+uint32_t crc_table[256];
+
+/* The history, indexes and all, is also kept as a snapshot beside the history file, in the same file name with
+   .index after it. The snapshot says how far into the ring it goes, so a shell starting up copies it in and reads
+   only the records written since, rather than every record in the ring. Each shell writes it as it exits. It is
+   built again from the ring when it is missing, was made from another ring, or holds over twice the ring's worth of
+   text, so old entries the ring has let go of do not pile up in it forever. */
+#define HISTORY_INDEX_VERSION 1
+
+struct history_index_header
+{
+    char magic[8];             // "smallshI"
+    uint32_t version;
+    uint32_t num_texts;
+    uint64_t ring_dev;         // the history file the snapshot was taken from
+    uint64_t ring_ino;
+    uint64_t capacity;
+    uint64_t seen;             // position up to which the ring's records are in the snapshot
+    uint64_t text_bytes;       // of the texts, each with its null, padded to a multiple of 8
+    uint64_t list_words;       // text numbers in all the trigram lists
+    uint32_t texts_cap;        // the capacities are kept, so the arrays can grow as they would have
+    uint32_t count;
+    uint32_t cap;
+    uint32_t hash_cap;
+    uint32_t num_trigrams;
+    uint32_t trigrams_cap;
+    uint32_t num_nodes;
+    uint32_t nodes_cap;
+};
+
+char * history_index_path = NULL;   // the snapshot
+struct stat history_ring_stat;      // of the history file
+int history_pid = 0;                // the shell's own, which alone writes the snapshot
+
+/* Operators of $(( )) in the order of arith_ops[], where longer ones come before their prefixes so the first match is
+   the longest. Numbers, variables and the end of an expression are tokens too. */
+enum arith_op
+{
+    AOP_SHL_ASSIGN, AOP_SHR_ASSIGN, AOP_INC, AOP_DEC, AOP_SHL, AOP_SHR, AOP_LE, AOP_GE, AOP_EQ, AOP_NE, AOP_AND, AOP_OR,
+    AOP_ADD_ASSIGN, AOP_SUB_ASSIGN, AOP_MUL_ASSIGN, AOP_DIV_ASSIGN, AOP_MOD_ASSIGN, AOP_AND_ASSIGN, AOP_XOR_ASSIGN,
+    AOP_OR_ASSIGN, AOP_ADD, AOP_SUB, AOP_MUL, AOP_DIV, AOP_MOD, AOP_LT, AOP_GT, AOP_BITAND, AOP_XOR, AOP_BITOR, AOP_NOT,
+    AOP_BITNOT, AOP_QUESTION, AOP_COLON, AOP_ASSIGN, AOP_COMMA, AOP_LPAREN, AOP_RPAREN,
+    ATOK_NUM, ATOK_VAR, ATOK_END
+};
+
+const char * arith_ops[] =
+{
+    "<<=", ">>=", "++", "--", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+    "+=", "-=", "*=", "/=", "%=", "&=", "^=",
+    "|=", "+", "-", "*", "/", "%", "<", ">", "&", "^", "|", "!",
+    "~", "?", ":", "=", ",", "(", ")",
+    NULL
+};
+
+/* One token of a compiled $(( )) expression. */
+struct arith_token
+{
+    int op;                // an arith_op
+    int64_t value;         // value of an ATOK_NUM
+    char * name;           // name of an ATOK_VAR
+    size_t name_len;
+    uint32_t hash;         // hash_name() of the name, so looking it up does not hash it again
+};
+
+/* An expression compiled into tokens, ended by ATOK_END. */
+struct arith_expr
+{
+    char * text;
+    struct arith_token * tokens;
+};
+
+struct arith_expr * arith_cache[256];  // compiled expressions, direct mapped by the hash of their text
+
+/* Where the evaluator is in a token stream, and the first error it hit. */
+struct arith_state
+{
+    struct arith_token * t;
+    const char * error;
+};
+
+/* A NULL terminated, growable vector of words in the line arena. */
+struct wordvec
+{
+    char ** words;
+    int count;
+    int cap;
+};
+
+char ** shell_envp = NULL;    // NULL terminated environment handed to execve(), kept in step with exported variables
+int envp_count = 0;
+int envp_cap = 0;
+
 
 // ----------------------------------------------------------- FUNCTIONS ------------------------------------------------------------ //
 
 /**
- * @brief reap() checks on the background children and collects them if they've finished
+ * @brief out_add() queues len bytes at data for the next out_flush(). The bytes are not copied, so they must stay put
+ *        until the flush: string literals, arguments in the line arena, or text from out_copy(). Messages of the shell
+ *        itself go through shell_printf(), which keeps its own copy.
  * 
+ * @param data 
+ * @param len 
  */
-void reap()
+void out_add(const char * data, size_t len)
 {
-    /* reap all ongoing child processes */
-    int wstatus;
-    int w;
+    struct iovec * grown;
+
+    if (len == 0)
+    {
+        return;
+    }
+
+    /* Pieces that sit right after the previous one just lengthen it. */
+    if ((shell_out.count > 0) && (shell_out.iov[shell_out.count - 1].iov_base != NULL) &&
+        ((char *)shell_out.iov[shell_out.count - 1].iov_base + shell_out.iov[shell_out.count - 1].iov_len == data))
+    {
+        shell_out.iov[shell_out.count - 1].iov_len += len;
+        shell_out.bytes += len;
+        return;
+    }
+
+    if (shell_out.count == shell_out.cap)
+    {
+        shell_out.cap = (shell_out.cap == 0) ? 64 : shell_out.cap * 2;
+        grown = realloc(shell_out.iov, sizeof(struct iovec) * shell_out.cap);
+        shell_out.iov = grown;
+    }
+
+    shell_out.iov[shell_out.count].iov_base = (void *)data;
+    shell_out.iov[shell_out.count].iov_len = len;
+    shell_out.count++;
+    shell_out.bytes += len;
+
+    return;
+}
+
+
+/**
+ * @brief out_flush() writes everything queued since the last flush to fd with as few writev() calls as it takes,
+ *        normally one. Returns false if the write failed.
+ * 
+ * @param fd 
+ * @return true 
+ * @return false 
+ */
+bool out_flush(int fd)
+{
+    struct iovec * iov = shell_out.iov;
+    int count = shell_out.count;
+    ssize_t written;
+    size_t text = 0;
+    bool ok = true;
     int i;
 
-    for(i = 0; i < num_bchildren; i++)
+    /* The shell's own messages were queued without an address, since their buffer may have moved since. */
+    for (i = 0; i < count; i++)
     {
-        if(bchildren[i] != -1)
+        if (iov[i].iov_base == NULL)
         {
-            w = waitpid(bchildren[i], &wstatus, WNOHANG);
+            iov[i].iov_base = shell_out.text + text;
+            text += iov[i].iov_len;
+        }
+    }
 
-            /* If the process exited, we want to get the child's exit status and cast it to our status variable. */
-            if (WIFEXITED(wstatus))
+    while (count > 0)
+    {
+        written = writev(fd, iov, (count > IOV_MAX) ? IOV_MAX : count);
+
+        if (written == -1)
+        {
+            if (errno == EINTR)
             {
-                status = WEXITSTATUS(wstatus);
-                bchildren[i] = -1;
+                continue;
             }
-        }  
+            ok = false;
+            break;
+        }
+
+        /* Step past what was written, which may end partway through an entry. */
+        while ((count > 0) && ((size_t)written >= iov->iov_len))
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    shell_out.count = 0;
+    shell_out.bytes = 0;
+    shell_out.text_len = 0;
+    return ok;
+}
+
+
+/**
+ * @brief shell_printf() queues a message of the shell, formatted the way printf() would, for the next out_flush().
+ *        Messages are not written as they are made but gathered, so the notices of a command and the prompt after it
+ *        go out in one writev(). The queue is flushed before the shell reads input, forks, changes its descriptors or
+ *        exits.
+ * 
+ * @param format 
+ * @param ... 
+ */
+void shell_printf(const char * format, ...)
+{
+    va_list args;
+    size_t room = shell_out.text_cap - shell_out.text_len;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(shell_out.text + shell_out.text_len, room, format, args);
+    va_end(args);
+    if (len <= 0)
+    {
+        return;
+    }
+
+    if ((size_t) len >= room)
+    {
+        shell_out.text_cap = (shell_out.text_len + len + 1) * 2;
+        shell_out.text = realloc(shell_out.text, shell_out.text_cap);
+        va_start(args, format);
+        vsnprintf(shell_out.text + shell_out.text_len, len + 1, format, args);
+        va_end(args);
+    }
+    shell_out.text_len += len;
+
+    /* Consecutive messages share one piece. */
+    if ((shell_out.count > 0) && (shell_out.iov[shell_out.count - 1].iov_base == NULL))
+    {
+        shell_out.iov[shell_out.count - 1].iov_len += len;
+        shell_out.bytes += len;
+        return;
+    }
+    if (shell_out.count == shell_out.cap)
+    {
+        shell_out.cap = (shell_out.cap == 0) ? 64 : shell_out.cap * 2;
+        shell_out.iov = realloc(shell_out.iov, sizeof(struct iovec) * shell_out.cap);
     }
+    shell_out.iov[shell_out.count].iov_base = NULL;
+    shell_out.iov[shell_out.count].iov_len = len;
+    shell_out.count++;
+    shell_out.bytes += len;
 
     return;
 }
 
 
 /**
- * @brief exit_process() handles the SIGINT and exit commands, killing all child processes and then terminating the parent process
+ * @brief out_flush_at_exit() writes what is still queued when the shell, or a child of it, exits.
  * 
- *  
  */
-void exit_process()
+void out_flush_at_exit()
 {
-    int shellpid = getpid();
-    int i;
-    /* Loop through all currently running child processes and kill them. */
+    out_flush(STDOUT_FILENO);
 
-    for(i = 0; i < num_bchildren; i++)
+    return;
+}
+
+
+/**
+ * @brief trace_now() returns CLOCK_MONOTONIC in nanoseconds, the clock every process of a trace shares.
+ * 
+ * @return long long 
+ */
+long long trace_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/**
+ * @brief trace_flush() appends the buffered trace events to the trace file.
+ * 
+ */
+void trace_flush()
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while ((trace_fd != -1) && (done < trace_len))
     {
-        if(bchildren[i] != -1)
+        if ((n = write(trace_fd, trace_buf + done, trace_len - done)) == -1)
         {
-            if(waitpid(shellpid = -1, &status, WNOHANG) == -1)
+            if (errno == EINTR)
             {
-                kill(bchildren[i], SIGINT);
+                continue;
             }
-        }  
+            break;
+        }
+        done += n;
     }
+    trace_len = 0;
 
-    /* Exit out of the program */
-    exit(0);
+    return;
 }
 
 
 /**
- * @brief handle_SIGTSTP() turns on and off the tstp flag to enable and disable background processes.
+ * @brief trace_emit() buffers one trace event. Times are nanoseconds and come out as the microseconds the format
+ *        uses. A non-NULL detail becomes the event's only argument, escaped for JSON.
  * 
+ * @param name 
+ * @param phase B, E, X, i or M
+ * @param ts 
+ * @param dur for X events
+ * @param detail 
  */
-void handle_SIGTSTP()
+void trace_emit(const char * name, char phase, long long ts, long long dur, const char * detail)
 {
-    /* Using write because printf is non-reentrant */
-    if (!tstp)
+    size_t need = strlen(name) + ((detail != NULL) ? strlen(detail) * 6 : 0) + 160;
+    char * p;
+
+    if (trace_len + need > trace_cap)
     {
-        write(1, "Caught SIGTSTP. Turning background processes off...\n", 52);
-        tstp = true;
+        trace_flush();
+        if (need > trace_cap)
+        {
+            trace_cap = (need > 65536) ? need : 65536;
+            trace_buf = realloc(trace_buf, trace_cap);
+        }
     }
 
-    else 
+    p = trace_buf + trace_len;
+    p += sprintf(p, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld.%03d,\"pid\":%d,\"tid\":%d", name, phase,
+                 ts / 1000, (int) (ts % 1000), trace_pid, trace_pid);
+    if (phase == 'X')
     {
-        write(1, "Caught SIGTSTP. Turning background processes back on!\n", 54);
-        tstp = false;
+        p += sprintf(p, ",\"dur\":%lld.%03d", dur / 1000, (int) (dur % 1000));
     }
-    
+    if (detail != NULL)
+    {
+        p += sprintf(p, ",\"args\":{\"%s\":\"", (phase == 'M') ? "name" : "detail");
+        for (; *detail != '\0'; detail++)
+        {
+            if ((*detail == '"') || (*detail == '\\'))
+            {
+                *p++ = '\\';
+                *p++ = *detail;
+            }
+            else if ((unsigned char) *detail < 0x20)
+            {
+                p += sprintf(p, "\\u%04x", (unsigned char) *detail);
+            }
+            else
+            {
+                *p++ = *detail;
+            }
+        }
+        p += sprintf(p, "\"}");
+    }
+    p += sprintf(p, "},\n");
+    trace_len = p - trace_buf;
+
     return;
 }
 
 
 /**
- * @brief check_status() prints the current value of status if no children have finished, or the current exit_value of the parent
+ * @brief trace_begin() starts a phase, with an optional detail such as the command line.
  * 
+ * @param name 
+ * @param detail 
  */
-void check_status()
+void trace_begin(const char * name, const char * detail)
 {
-    if(status != -1)
+    if (trace_fd != -1)
     {
-        printf("exit status %d\n", status);
-        fflush(stdout);
+        trace_emit(name, 'B', trace_now(), 0, detail);
     }
-    else
+
+    return;
+}
+
+
+/**
+ * @brief trace_end() ends the phase trace_begin() started last.
+ * 
+ * @param name 
+ */
+void trace_end(const char * name)
+{
+    if (trace_fd != -1)
     {
-        printf("exit status %d\n", exit_status);
-        fflush(stdout);
+        trace_emit(name, 'E', trace_now(), 0, NULL);
     }
+
+    return;
 }
 
 
 /**
- * @brief change_directory() changes the current working directory to that specified. If no directory is specified the cwd is 
- * changed to the user's HOME.
+ * @brief trace_exec() records a child's execve() of path for the command in arguments, just before it is made. The
+ *        first one also records how long the child spent being set up after the fork, and names the child's track
+ *        after the command. The events are written out at once, since a successful exec takes the buffer with it.
  * 
- * @param dir 
+ * @param arguments 
+ * @param path 
+ * @param entered when exec_command() was called, which ends the setup
  */
-void change_directory(char * dir)
+void trace_exec(char ** arguments, const char * path, long long entered)
 {
-    int cd_status = 0;
-    /* If no argument is specified, change the directory to the HOME directory, otherwise change the  */
+    if (trace_fd == -1)
+    {
+        return;
+    }
 
-    cd_status = chdir(dir);
+    if (trace_forked_at != 0)
+    {
+        trace_emit("process_name", 'M', entered, 0, arguments[0]);
+        trace_emit("setup", 'X', trace_forked_at, entered - trace_forked_at, NULL);
+        trace_forked_at = 0;
+    }
+    trace_emit("execve", 'i', trace_now(), 0, path);
+    trace_flush();
+
+    return;
+}
+
+
+/**
+ * @brief trace_forked() runs in every new child. The events it inherited are the parent's to write, so they are
+ *        dropped, and its own are stamped with its pid.
+ * 
+ */
+void trace_forked()
+{
+    if (trace_fd != -1)
+    {
+        trace_len = 0;
+        trace_pid = getpid();
+        trace_forked_at = trace_now();
+    }
+
+    return;
+}
+
+
+/**
+ * @brief trace_open() starts a trace into the file SMALLSH_TRACE names, if it is set, replacing what was there.
+ * 
+ */
+void trace_open()
+{
+    const char * file = getenv("SMALLSH_TRACE");
+
+    if ((file == NULL) || (file[0] == '\0'))
+    {
+        return;
+    }
+    if ((trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) == -1)
+    {
+        shell_printf("Cannot open trace file %s!\n", file);
+        return;
+    }
+
+    trace_pid = getpid();
+    if (write(trace_fd, "[\n", 2) != 2)
+    {
+        close(trace_fd);
+        trace_fd = -1;
+        return;
+    }
+    trace_emit("process_name", 'M', trace_now(), 0, "smallsh");
+    pthread_atfork(NULL, NULL, trace_forked);
+    atexit(trace_flush);
+
+    return;
+}
+
+
+/**
+ * @brief child_exit() ends a forked child that has not exec'd with code. exit() would also clean up stdio, which seeks
+ *        the stdin the child shares with the shell back over what its buffer had read ahead, so the shell would read
+ *        those lines of a script again. The child's queued output and trace events are written out, then _exit().
+ * 
+ * @param code 
+ */
+void child_exit(int code)
+{
+    out_flush(STDOUT_FILENO);
+    trace_flush();
+    _exit(code);
+}
+
+
+/* Histograms are found by the hash variables are. */
+uint32_t hash_name(const char * name, size_t len);
+
+
+/**
+ * @brief hist_bucket() returns the histogram bucket a run time of us microseconds falls in.
+ * 
+ * @param us 
+ * @return int 
+ */
+int hist_bucket(unsigned long long us)
+{
+    int e = 6;
+
+    if (us < 64)
+    {
+        return us;
+    }
+    while ((e < 41) && (us >> (e + 1)) != 0)
+    {
+        e++;
+    }
+    if ((us >> (e + 1)) != 0)
+    {
+        return HIST_BUCKETS - 1;
+    }
+
+    return 64 + (e - 6) * 32 + (int) ((us >> (e - 5)) & 31);
+}
+
+
+/**
+ * @brief hist_bucket_top() returns the longest run time, in microseconds, that falls in bucket.
+ * 
+ * @param bucket 
+ * @return unsigned long long 
+ */
+unsigned long long hist_bucket_top(int bucket)
+{
+    int e = 6 + (bucket - 64) / 32;
+
+    if (bucket < 64)
+    {
+        return bucket;
+    }
+
+    return ((32ULL + (bucket - 64) % 32 + 1) << (e - 5)) - 1;
+}
+
+
+/**
+ * @brief find_hist() returns the histogram of the command name, or NULL if there is none and create is not set.
+ * 
+ * @param name 
+ * @param create 
+ * @return struct command_hist* 
+ */
+struct command_hist * find_hist(const char * name, bool create)
+{
+    struct command_hist ** old = hists;
+    size_t old_cap = hists_cap;
+    uint32_t hash = hash_name(name, strlen(name));
+    size_t i;
+    size_t j;
+
+    for (i = hash & (hists_cap - 1); (hists_cap != 0) && (hists[i] != NULL); i = (i + 1) & (hists_cap - 1))
+    {
+        if ((hists[i]->hash == hash) && (strcmp(hists[i]->name, name) == 0))
+        {
+            return hists[i];
+        }
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+
+    /* Keep the table at most half full, so probes stay short. */
+    if (2 * (num_hists + 1) > hists_cap)
+    {
+        hists_cap = (hists_cap == 0) ? 64 : hists_cap * 2;
+        hists = calloc(hists_cap, sizeof(struct command_hist *));
+        for (j = 0; j < old_cap; j++)
+        {
+            if (old[j] != NULL)
+            {
+                for (i = old[j]->hash & (hists_cap - 1); hists[i] != NULL; i = (i + 1) & (hists_cap - 1))
+                {
+                }
+                hists[i] = old[j];
+            }
+        }
+        free(old);
+        for (i = hash & (hists_cap - 1); hists[i] != NULL; i = (i + 1) & (hists_cap - 1))
+        {
+        }
+    }
+
+    hists[i] = calloc(1, sizeof(struct command_hist));
+    hists[i]->name = strdup(name);
+    hists[i]->hash = hash;
+    num_hists++;
+
+    return hists[i];
+}
+
+
+/**
+ * @brief hist_record() adds a run of the command name that took ns nanoseconds to its histogram.
+ * 
+ * @param name 
+ * @param ns 
+ */
+void hist_record(const char * name, long long ns)
+{
+    struct command_hist * h;
+    unsigned long long us = (ns > 0) ? ns / 1000 : 0;
+    int bucket = hist_bucket(us);
+
+    if (!hists_on)
+    {
+        return;
+    }
+
+    h = find_hist(name, true);
+    if (h->fresh == NULL)
+    {
+        h->fresh = calloc(HIST_BUCKETS, sizeof(uint32_t));
+    }
+    h->counts[bucket]++;
+    h->fresh[bucket]++;
+    h->total++;
+    h->max = (us > h->max) ? us : h->max;
+
+    return;
+}
+
+
+/**
+ * @brief child_slot() returns the slot of the shell's child pid, looking through the CHILD_PROBES slots from the one
+ *        its pid maps to, or NULL if it did not get one. Slots are freed in any order, so a free one does not end the
+ *        search.
+ * 
+ * @param pid 
+ * @return struct child_slot* 
+ */
+struct child_slot * child_slot(int pid)
+{
+    struct child_slot * slot;
+    int self = getpid();
+    int i;
+
+    for (i = 0; i < CHILD_PROBES; i++)
+    {
+        slot = &child_slots[(pid + i) & (CHILD_SLOTS - 1)];
+        if ((__atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE) == pid) && (slot->parent == self))
+        {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief metric_observe() adds a time in nanoseconds to a histogram.
+ * 
+ * @param h 
+ * @param ns 
+ */
+void metric_observe(struct histogram_metric * h, long long ns)
+{
+    double seconds = ns / 1e9;
+    int i;
+
+    for (i = 0; (i < METRIC_BUCKETS - 1) && (seconds > metric_bounds[i]); i++)
+    {
+    }
+    h->counts[i]++;
+    h->count++;
+    h->sum += seconds;
+
+    return;
+}
+
+
+/**
+ * @brief handle_SIGCHLD() notes when children exited, for the reap latency. Signals that arrive together are merged
+ *        into one, so every child of this shell with a slot is checked, without reaping it. One the shell has just
+ *        waited on counts as exited now. waitid(), getpid() and clock_gettime() are async-signal-safe.
+ * 
+ * @param sig 
+ */
+void handle_SIGCHLD(int sig)
+{
+    struct child_slot * slot;
+    siginfo_t info;
+    int saved_errno = errno;
+    int self = getpid();
+    int pid;
+    int i;
+
+    (void) sig;
+    for (i = 0; i < CHILD_SLOTS; i++)
+    {
+        slot = &child_slots[i];
+        pid = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+        if ((pid <= 0) || (slot->parent != self) || (slot->exited_at != 0))
+        {
+            continue;
+        }
+
+        info.si_pid = 0;
+        if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0)
+        {
+            slot->exited_at = (info.si_pid == pid) ? trace_now() : 0;
+        }
+        else if (errno == ECHILD)
+        {
+            slot->exited_at = trace_now();
+        }
+    }
+    errno = saved_errno;
+
+    return;
+}
+
+
+/**
+ * @brief metrics_forked() runs in every new child and takes the first slot it can of the CHILD_PROBES from the one its
+ *        pid maps to: a free one, or one left by a process that is gone, which a process with its own pid must be.
+ *        The slot is held at -1 while it is filled in, so the shell never reads it half done. If none is left, the
+ *        child goes uncounted.
+ * 
+ */
+void metrics_forked()
+{
+    struct child_slot * slot;
+    int saved_errno = errno;
+    int pid = getpid();
+    int owner;
+    int i;
+
+    own_slot = NULL;
+    for (i = 0; (child_slots != NULL) && (i < CHILD_PROBES); i++)
+    {
+        slot = &child_slots[(pid + i) & (CHILD_SLOTS - 1)];
+        owner = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+        if (((owner == 0) || (owner == pid) || ((owner > 0) && (kill(owner, 0) == -1) && (errno == ESRCH))) &&
+            __atomic_compare_exchange_n(&slot->pid, &owner, -1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            slot->parent = getppid();
+            slot->failed = 0;
+            slot->forked_at = trace_now();
+            slot->exec_at = 0;
+            slot->exited_at = 0;
+            slot->command[0] = '\0';
+            __atomic_store_n(&slot->pid, pid, __ATOMIC_RELEASE);
+            own_slot = slot;
+            break;
+        }
+    }
+    errno = saved_errno;
+
+    return;
+}
+
+
+/**
+ * @brief metrics_exec() notes in a child's slot that it is about to exec command, by the last part of its path.
+ * 
+ * @param command 
+ */
+void metrics_exec(const char * command)
+{
+    const char * slash = strrchr(command, '/');
+
+    if (own_slot != NULL)
+    {
+        own_slot->exec_at = trace_now();
+        snprintf(own_slot->command, sizeof(own_slot->command), "%s", (slash != NULL) ? slash + 1 : command);
+    }
+
+    return;
+}
+
+
+/**
+ * @brief metrics_exec_failed() notes in a child's slot that it could not exec its command.
+ * 
+ */
+void metrics_exec_failed()
+{
+    if (own_slot != NULL)
+    {
+        own_slot->failed = 1;
+    }
+
+    return;
+}
+
+
+/**
+ * @brief metrics_fork() adds the time since started, which the shell takes just before fork() when metrics are on and
+ *        leaves 0 otherwise, to the fork histogram.
+ * 
+ * @param started 
+ */
+void metrics_fork(long long started)
+{
+    if (started != 0)
+    {
+        metric_observe(&metrics.fork, trace_now() - started);
+    }
+
+    return;
+}
+
+
+/**
+ * @brief metrics_collect() counts what a child that has just been waited on did: its exec or its failure to, and for
+ *        a background job whether it finished or was killed and how long it waited to be reaped. The run time of a
+ *        command it exec'd, from fork to exit, goes into the command's histogram.
+ * 
+ * @param pid 
+ * @param wstatus 
+ */
+void metrics_collect(int pid, int wstatus)
+{
+    struct child_slot * slot;
+    int i;
+
+    if (child_slots == NULL)
+    {
+        return;
+    }
+
+    slot = child_slot(pid);
+    if (slot != NULL)
+    {
+        if (slot->failed)
+        {
+            metrics.exec_failures++;
+        }
+        else if (slot->exec_at != 0)
+        {
+            metric_observe(&metrics.exec, slot->exec_at - slot->forked_at);
+            hist_record(slot->command, ((slot->exited_at != 0) ? slot->exited_at : trace_now()) - slot->forked_at);
+        }
+    }
+
+    for (i = 0; i < num_bchildren; i++)
+    {
+        if (bchildren[i] == pid)
+        {
+            metrics.jobs_finished += WIFEXITED(wstatus);
+            metrics.jobs_killed += WIFSIGNALED(wstatus);
+            if ((slot != NULL) && (slot->exited_at != 0))
+            {
+                metric_observe(&metrics.reap, trace_now() - slot->exited_at);
+            }
+            break;
+        }
+    }
+    if (slot != NULL)
+    {
+        __atomic_store_n(&slot->pid, 0, __ATOMIC_RELEASE);
+    }
+
+    return;
+}
+
+
+/**
+ * @brief metrics_histogram() formats a histogram in OpenMetrics text at out, returning the bytes written.
+ * 
+ * @param out 
+ * @param name 
+ * @param help 
+ * @param h 
+ * @return int 
+ */
+int metrics_histogram(char * out, const char * name, const char * help, struct histogram_metric * h)
+{
+    unsigned long long cumulative = 0;
+    int n;
+    int i;
+
+    n = sprintf(out, "# TYPE %s histogram\n# UNIT %s seconds\n# HELP %s %s\n", name, name, name, help);
+    for (i = 0; i < METRIC_BUCKETS; i++)
+    {
+        cumulative += h->counts[i];
+        if (i < METRIC_BUCKETS - 1)
+        {
+            n += sprintf(out + n, "%s_bucket{le=\"%g\"} %llu\n", name, metric_bounds[i], cumulative);
+        }
+        else
+        {
+            n += sprintf(out + n, "%s_bucket{le=\"+Inf\"} %llu\n", name, cumulative);
+        }
+    }
+    n += sprintf(out + n, "%s_sum %.9f\n%s_count %llu\n", name, h->sum, name, h->count);
+
+    return n;
+}
+
+
+/**
+ * @brief metrics_write() writes the metrics file if metrics are on and metrics_interval_ms has passed since it was
+ *        last written, or whenever force is set.
+ * 
+ * @param force 
+ */
+void metrics_write(bool force)
+{
+    long long now = trace_now();
+    char * out;
+    char * tmp;
+    bool written;
+    int running = 0;
+    int n = 0;
+    int fd;
+    int i;
+
+    if ((metrics_file == NULL) || (!force && (now - metrics_written_at < metrics_interval_ms * 1000000LL)))
+    {
+        return;
+    }
+    metrics_written_at = now;
+
+    for (i = 0; i < num_bchildren; i++)
+    {
+        running += (bchildren[i] != -1);
+    }
+
+    out = malloc(16384);
+    n += sprintf(out + n, "# TYPE smallsh_commands counter\n# HELP smallsh_commands Commands run.\n"
+                          "smallsh_commands_total{kind=\"builtin\"} %llu\nsmallsh_commands_total{kind=\"external\"} %llu\n",
+                 metrics.builtins, metrics.externals);
+    n += sprintf(out + n, "# TYPE smallsh_exec_failures counter\n# HELP smallsh_exec_failures Commands that could not "
+                          "be executed.\nsmallsh_exec_failures_total %llu\n", metrics.exec_failures);
+    n += sprintf(out + n, "# TYPE smallsh_background_jobs counter\n# HELP smallsh_background_jobs Background jobs by "
+                          "what became of them.\nsmallsh_background_jobs_total{event=\"started\"} %llu\n"
+                          "smallsh_background_jobs_total{event=\"finished\"} %llu\n"
+                          "smallsh_background_jobs_total{event=\"killed\"} %llu\n",
+                 metrics.jobs_started, metrics.jobs_finished, metrics.jobs_killed);
+    n += sprintf(out + n, "# TYPE smallsh_background_jobs_running gauge\n# HELP smallsh_background_jobs_running "
+                          "Background jobs not yet reaped.\nsmallsh_background_jobs_running %d\n", running);
+    n += metrics_histogram(out + n, "smallsh_fork_seconds", "Time the shell spent in fork().", &metrics.fork);
+    n += metrics_histogram(out + n, "smallsh_exec_seconds", "Time from fork() to the child's exec.", &metrics.exec);
+    n += metrics_histogram(out + n, "smallsh_reap_seconds", "Time from a background job's exit to its reaping.",
+                           &metrics.reap);
+    n += sprintf(out + n, "# EOF\n");
+
+    tmp = malloc(strlen(metrics_file) + 32);
+    sprintf(tmp, "%s.%d.tmp", metrics_file, getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) != -1)
+    {
+        written = (write(fd, out, n) == n);
+        written = (close(fd) == 0) && written;
+        if (!written || (rename(tmp, metrics_file) == -1))
+        {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(out);
+
+    return;
+}
+
+
+/**
+ * @brief metrics_write_at_exit() writes the metrics one last time as the shell exits.
+ * 
+ */
+void metrics_write_at_exit()
+{
+    if (getpid() == metrics_pid)
+    {
+        metrics_write(true);
+    }
+
+    return;
+}
+
+
+/**
+ * @brief watch_children() maps the table shared with children and installs the SIGCHLD handler that stamps their
+ *        exits. Without it, children are neither counted nor timed.
+ * 
+ */
+void watch_children()
+{
+    struct sigaction sa;
+
+    child_slots = mmap(NULL, sizeof(struct child_slot) * CHILD_SLOTS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (child_slots == MAP_FAILED)
+    {
+        child_slots = NULL;
+        return;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_SIGCHLD;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    pthread_atfork(NULL, NULL, metrics_forked);
+
+    return;
+}
+
+
+/**
+ * @brief metrics_open() turns metrics on if SMALLSH_METRICS names a file.
+ * 
+ */
+void metrics_open()
+{
+    const char * file = getenv("SMALLSH_METRICS");
+
+    if ((file == NULL) || (file[0] == '\0'))
+    {
+        return;
+    }
+
+    metrics_file = strdup(file);
+    metrics_pid = getpid();
+    atexit(metrics_write_at_exit);
+    metrics_write(true);
+
+    return;
+}
+
+
+/**
+ * @brief arena_alloc() hands out memory from the line arena. Everything allocated while a line is being parsed and run
+ *        (expanded words, argument vectors) lives here and is released in one go by arena_reset() when the line is done.
+ * 
+ * @param size 
+ * @return void* 
+ */
+void * arena_alloc(size_t size)
+{
+    struct arena_chunk * chunk = line_arena;
+
+    /* Keep every allocation pointer aligned. */
+    size = (size + 15) & ~(size_t)15;
+
+    if ((chunk == NULL) || (chunk->used + size > chunk->size))
+    {
+        size_t chunk_size = (size > 65536) ? size : 65536;
+
+        chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+        if (chunk == NULL)
+        {
+            shell_printf("Out of memory!\n");
+            exit(1);
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = line_arena;
+        line_arena = chunk;
+    }
+
+    chunk->used += size;
+    return chunk->data + chunk->used - size;
+}
+
+
+/**
+ * @brief arena_strndup() copies len bytes of str into the line arena and null terminates the copy.
+ * 
+ * @param str 
+ * @param len 
+ * @return char* 
+ */
+char * arena_strndup(const char * str, size_t len)
+{
+    char * copy = arena_alloc(len + 1);
+
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+
+/**
+ * @brief arena_mark() records how far the line arena has been used, so arena_release() can hand back everything
+ *        allocated after this point. Loops use it to keep each iteration from growing the arena.
+ * 
+ * @return struct arena_mark 
+ */
+struct arena_mark arena_mark()
+{
+    struct arena_mark mark;
+
+    mark.chunk = line_arena;
+    mark.used = (line_arena != NULL) ? line_arena->used : 0;
+    return mark;
+}
+
+
+/**
+ * @brief arena_release() frees what the line arena handed out since mark was taken.
+ * 
+ * @param mark 
+ */
+void arena_release(struct arena_mark mark)
+{
+    struct arena_chunk * chunk;
+
+    while ((line_arena != NULL) && (line_arena != mark.chunk))
+    {
+        chunk = line_arena;
+        line_arena = line_arena->next;
+        free(chunk);
+    }
+
+    if (line_arena != NULL)
+    {
+        line_arena->used = mark.used;
+    }
+
+    return;
+}
+
+
+/**
+ * @brief arena_reset() frees everything the last line allocated, keeping one chunk around for the next line.
+ * 
+ */
+void arena_reset()
+{
+    struct arena_chunk * chunk;
+
+    while ((line_arena != NULL) && (line_arena->next != NULL))
+    {
+        chunk = line_arena;
+        line_arena = line_arena->next;
+        free(chunk);
+    }
+
+    if (line_arena != NULL)
+    {
+        line_arena->used = 0;
+    }
+
+    return;
+}
+
+
+/**
+ * @brief private_map() maps zeroed memory, in whole pages, for caches only the shell itself uses, and keeps fork()
+ *        from copying their page tables into children. With wipe a child gets the pages zeroed, which suits memory a
+ *        child may still use, as a cache it finds empty; without it a child gets no pages at all.
+ * 
+ * @param size 
+ * @param wipe 
+ * @return void* 
+ */
+void * private_map(size_t size, bool wipe)
+{
+    void * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+    {
+        shell_printf("Out of memory!\n");
+        exit(1);
+    }
+    madvise(p, size, wipe ? MADV_WIPEONFORK : MADV_DONTFORK);
+
+    return p;
+}
+
+
+/**
+ * @brief private_remap() grows memory from private_map() from old_size to size bytes, moving it if it must. The
+ *        new pages keep the advice of the old ones. A NULL p maps new memory left out of children.
+ * 
+ * @param p 
+ * @param old_size 
+ * @param size 
+ * @return void* 
+ */
+void * private_remap(void * p, size_t old_size, size_t size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (p == NULL)
+    {
+        return private_map(size, false);
+    }
+    old_size = (old_size + page - 1) & ~(size_t) (page - 1);
+    if (size <= old_size)
+    {
+        return p;
+    }
+    if ((p = mremap(p, old_size, size, MREMAP_MAYMOVE)) == MAP_FAILED)
+    {
+        shell_printf("Out of memory!\n");
+        exit(1);
+    }
+
+    return p;
+}
+
+
+/**
+ * @brief private_unmap() gives back memory from private_map().
+ * 
+ * @param p 
+ * @param size 
+ */
+void private_unmap(void * p, size_t size)
+{
+    if (p != NULL)
+    {
+        munmap(p, size);
+    }
+
+    return;
+}
+
+
+/**
+ * @brief hash_name() is the FNV-1a hash used to place variables in var_table.
+ * 
+ * @param name 
+ * @param len 
+ * @return uint32_t 
+ */
+uint32_t hash_name(const char * name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+/**
+ * @brief valid_name() checks that the first len characters of name form a variable name: a letter or underscore
+ *        followed by letters, digits and underscores.
+ * 
+ * @param name 
+ * @param len 
+ * @return true 
+ * @return false 
+ */
+bool valid_name(const char * name, size_t len)
+{
+    size_t i;
+
+    if ((len == 0) || (!isalpha((unsigned char)name[0]) && (name[0] != '_')))
+    {
+        return false;
+    }
+
+    for (i = 1; i < len; i++)
+    {
+        if (!isalnum((unsigned char)name[i]) && (name[i] != '_'))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief find_var_hashed() looks up the variable whose name is the first len characters of name, given the name's
+ *        hash_name(), for callers that keep the hash of names they look up often.
+ * 
+ * @param name 
+ * @param len 
+ * @param hash 
+ * @return struct variable* 
+ */
+struct variable * find_var_hashed(const char * name, size_t len, uint32_t hash)
+{
+    struct variable * var;
+
+    if (var_buckets == 0)
+    {
+        return NULL;
+    }
+
+    for (var = var_table[hash & (var_buckets - 1)]; var != NULL; var = var->next)
+    {
+        if ((var->hash == hash) && (var->name_len == len) && (memcmp(var->entry, name, len) == 0))
+        {
+            return var;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief find_var() looks up the variable whose name is the first len characters of name.
+ * 
+ * @param name 
+ * @param len 
+ * @return struct variable* 
+ */
+struct variable * find_var(const char * name, size_t len)
+{
+    return find_var_hashed(name, len, hash_name(name, len));
+}
+
+
+/**
+ * @brief get_var() returns the value of a variable, or NULL if it is not set.
+ * 
+ * @param name 
+ * @return char* 
+ */
+char * get_var(const char * name)
+{
+    struct variable * var = find_var(name, strlen(name));
+
+    return (var != NULL) ? var->entry + var->name_len + 1 : NULL;
+}
+
+
+/**
+ * @brief env_add() puts an exported variable's NAME=value entry on the end of shell_envp.
+ * 
+ * @param var 
+ */
+void env_add(struct variable * var)
+{
+    if (envp_count + 1 >= envp_cap)
+    {
+        envp_cap = (envp_cap == 0) ? 64 : envp_cap * 2;
+        shell_envp = realloc(shell_envp, sizeof(char *) * envp_cap);
+    }
+
+    var->env_index = envp_count;
+    shell_envp[envp_count++] = var->entry;
+    shell_envp[envp_count] = NULL;
+
+    return;
+}
+
+
+/**
+ * @brief env_remove() takes a variable out of shell_envp by moving the last entry into its slot, so removal does not
+ *        shift the rest of the array.
+ * 
+ * @param var 
+ */
+void env_remove(struct variable * var)
+{
+    struct variable * last;
+    char * entry;
+
+    if (var->env_index == -1)
+    {
+        return;
+    }
+
+    envp_count--;
+
+    if (var->env_index != envp_count)
+    {
+        /* The moved entry's variable has to learn its new index. */
+        entry = shell_envp[envp_count];
+        last = find_var(entry, strcspn(entry, "="));
+        shell_envp[var->env_index] = entry;
+        last->env_index = var->env_index;
+    }
+
+    shell_envp[envp_count] = NULL;
+    var->env_index = -1;
+
+    return;
+}
+
+
+/**
+ * @brief set_var() sets a variable, creating it if needed. When export is true the variable is also exported; an
+ *        exported variable's envp slot is updated in place so the next exec sees the new value.
+ * 
+ * @param name 
+ * @param value 
+ * @param export 
+ * @return struct variable* 
+ */
+struct variable * set_var(const char * name, const char * value, bool export)
+{
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    struct variable * var = find_var(name, name_len);
+    struct variable ** old_table;
+    size_t old_buckets;
+    size_t i;
+    char * entry;
+
+    /* Build the NAME=value string once; it is both the stored value and the envp entry. */
+    entry = malloc(name_len + value_len + 2);
+    memcpy(entry, name, name_len);
+    entry[name_len] = '=';
+    memcpy(entry + name_len + 1, value, value_len + 1);
+
+    if (var != NULL)
+    {
+        free(var->entry);
+        var->entry = entry;
+        var->int_valid = false;
+
+        if (var->env_index != -1)
+        {
+            shell_envp[var->env_index] = entry;
+        }
+        else if (export)
+        {
+            env_add(var);
+        }
+        return var;
+    }
+
+    /* Grow the table once it gets three quarters full, rehashing into twice as many buckets. */
+    if (num_vars + 1 > var_buckets * 3 / 4)
+    {
+        old_table = var_table;
+        old_buckets = var_buckets;
+        var_buckets = (var_buckets == 0) ? 64 : var_buckets * 2;
+        var_table = calloc(var_buckets, sizeof(struct variable *));
+
+        for (i = 0; i < old_buckets; i++)
+        {
+            while (old_table[i] != NULL)
+            {
+                var = old_table[i];
+                old_table[i] = var->next;
+                var->next = var_table[var->hash & (var_buckets - 1)];
+                var_table[var->hash & (var_buckets - 1)] = var;
+            }
+        }
+        free(old_table);
+    }
+
+    var = malloc(sizeof(struct variable));
+    var->entry = entry;
+    var->name_len = name_len;
+    var->hash = hash_name(name, name_len);
+    var->env_index = -1;
+    var->int_valid = false;
+    var->next = var_table[var->hash & (var_buckets - 1)];
+    var_table[var->hash & (var_buckets - 1)] = var;
+    num_vars++;
+
+    if (export)
+    {
+        env_add(var);
+    }
+
+    return var;
+}
+
+
+/**
+ * @brief set_int_var() sets a variable to a number, keeping the number so arithmetic can read it back without parsing.
+ * 
+ * @param name 
+ * @param value 
+ */
+void set_int_var(const char * name, int64_t value)
+{
+    struct variable * var;
+    char numbuf[24];
+
+    sprintf(numbuf, "%lld", (long long)value);
+    var = set_var(name, numbuf, false);
+    var->int_value = value;
+    var->int_valid = true;
+
+    return;
+}
+
+
+/**
+ * @brief unset_var() removes a variable from the table and from shell_envp.
+ * 
+ * @param name 
+ */
+void unset_var(const char * name)
+{
+    size_t len = strlen(name);
+    uint32_t hash = hash_name(name, len);
+    struct variable ** link;
+    struct variable * var;
+
+    if (var_buckets == 0)
+    {
+        return;
+    }
+
+    for (link = &var_table[hash & (var_buckets - 1)]; *link != NULL; link = &(*link)->next)
+    {
+        var = *link;
+
+        if ((var->hash == hash) && (var->name_len == len) && (memcmp(var->entry, name, len) == 0))
+        {
+            env_remove(var);
+            *link = var->next;
+            free(var->entry);
+            free(var);
+            num_vars--;
+            return;
+        }
+    }
+
+    return;
+}
+
+
+/**
+ * @brief assign_var() handles a NAME=value word. Returns false if the word is not an assignment.
+ * 
+ * @param word 
+ * @param export 
+ * @return true 
+ * @return false 
+ */
+bool assign_var(char * word, bool export)
+{
+    char * equals = strchr(word, '=');
+
+    if ((equals == NULL) || !valid_name(word, equals - word))
+    {
+        return false;
+    }
+
+    *equals = '\0';
+    set_var(word, equals + 1, export);
+    *equals = '=';
+
+    return true;
+}
+
+
+/**
+ * @brief init_variables() loads the inherited environment into the variable table, all marked exported.
+ * 
+ */
+void init_variables()
+{
+    extern char ** environ;
+    int i;
+
+    for (i = 0; environ[i] != NULL; i++)
+    {
+        assign_var(environ[i], true);
+    }
+
+    /* Make sure children get an environment array even if we inherited an empty one. */
+    if (shell_envp == NULL)
+    {
+        envp_cap = 64;
+        shell_envp = calloc(envp_cap, sizeof(char *));
+    }
+
+    return;
+}
+
+
+/**
+ * @brief last_status() returns the exit status $? reports: the last foreground child's if there has been one, otherwise
+ *        the parent's.
+ * 
+ * @return int 
+ */
+int last_status()
+{
+    return (status != -1) ? status : exit_status;
+}
+
+
+/**
+ * @brief arith_free() frees a compiled expression.
+ * 
+ * @param expr 
+ */
+void arith_free(struct arith_expr * expr)
+{
+    struct arith_token * tok;
+
+    for (tok = expr->tokens; tok->op != ATOK_END; tok++)
+    {
+        free(tok->name);
+    }
+    free(expr->tokens);
+    free(expr->text);
+    free(expr);
+
+    return;
+}
+
+
+/**
+ * @brief arith_compile() splits the text of a $(( )) into tokens. Numbers are read the way C reads them, with 0x for
+ *        hex and a leading 0 for octal. Returns NULL with the reason in error if the text has something that is not
+ *        a number, a name or an operator.
+ * 
+ * @param text 
+ * @param error 
+ * @return struct arith_expr* 
+ */
+struct arith_expr * arith_compile(const char * text, const char ** error)
+{
+    struct arith_expr * expr = malloc(sizeof(struct arith_expr));
+    struct arith_token * tok;
+    const char * p = text;
+    char * end;
+    size_t len;
+    int op;
+
+    expr->text = strdup(text);
+    expr->tokens = malloc(sizeof(struct arith_token) * (strlen(text) + 1));   // never more tokens than characters
+    tok = expr->tokens;
+
+    while (1)
+    {
+        while (isspace((unsigned char)*p))
+        {
+            p++;
+        }
+        if (*p == '\0')
+        {
+            break;
+        }
+
+        memset(tok, 0, sizeof(struct arith_token));
+
+        if (isdigit((unsigned char)*p))
+        {
+            tok->op = ATOK_NUM;
+            tok->value = (int64_t)strtoull(p, &end, 0);
+            if (isalnum((unsigned char)*end) || (*end == '_'))
+            {
+                *error = "invalid number";
+                break;
+            }
+            p = end;
+        }
+        else if (isalpha((unsigned char)*p) || (*p == '_'))
+        {
+            for (len = 1; isalnum((unsigned char)p[len]) || (p[len] == '_'); len++)
+            {
+            }
+            tok->op = ATOK_VAR;
+            tok->name = strndup(p, len);
+            tok->name_len = len;
+            tok->hash = hash_name(p, len);
+            p += len;
+        }
+        else
+        {
+            for (op = 0; (arith_ops[op] != NULL) && (strncmp(p, arith_ops[op], strlen(arith_ops[op])) != 0); op++)
+            {
+            }
+            if (arith_ops[op] == NULL)
+            {
+                *error = "unexpected character";
+                break;
+            }
+            tok->op = op;
+            p += strlen(arith_ops[op]);
+        }
+        tok++;
+    }
+
+    tok->op = ATOK_END;
+    tok->name = NULL;
+    if (*p != '\0')
+    {
+        arith_free(expr);
+        return NULL;
+    }
+
+    return expr;
+}
+
+
+/**
+ * @brief arith_get() reads a variable as a number. Unset and empty variables are 0. A value that is not a number is an
+ *        error. The number is cached in the variable until its value changes.
+ * 
+ * @param tok 
+ * @param st 
+ * @return int64_t 
+ */
+int64_t arith_get(struct arith_token * tok, struct arith_state * st)
+{
+    struct variable * var = find_var_hashed(tok->name, tok->name_len, tok->hash);
+    char * value;
+    char * end;
+
+    if (var == NULL)
+    {
+        return 0;
+    }
+    if (var->int_valid)
+    {
+        return var->int_value;
+    }
+
+    value = var->entry + var->name_len + 1;
+    while (isspace((unsigned char)*value))
+    {
+        value++;
+    }
+    var->int_value = (*value == '\0') ? 0 : (int64_t)strtoull(value, &end, 0);
+    if (*value != '\0')
+    {
+        while (isspace((unsigned char)*end))
+        {
+            end++;
+        }
+        if (*end != '\0')
+        {
+            st->error = "variable is not a number";
+            return 0;
+        }
+    }
+    var->int_valid = true;
+
+    return var->int_value;
+}
+
+
+/**
+ * @brief arith_precedence() returns how tightly a binary operator binds, from 1 for || up to 10 for *, / and %, or 0 if
+ *        op is not a binary operator.
+ * 
+ * @param op 
+ * @return int 
+ */
+int arith_precedence(int op)
+{
+    switch (op)
+    {
+        case AOP_OR:     return 1;
+        case AOP_AND:    return 2;
+        case AOP_BITOR:  return 3;
+        case AOP_XOR:    return 4;
+        case AOP_BITAND: return 5;
+        case AOP_EQ:
+        case AOP_NE:     return 6;
+        case AOP_LT:
+        case AOP_LE:
+        case AOP_GT:
+        case AOP_GE:     return 7;
+        case AOP_SHL:
+        case AOP_SHR:    return 8;
+        case AOP_ADD:
+        case AOP_SUB:    return 9;
+        case AOP_MUL:
+        case AOP_DIV:
+        case AOP_MOD:    return 10;
+        default:         return 0;
+    }
+}
+
+
+/**
+ * @brief arith_apply() applies a binary operator other than && and ||. Arithmetic wraps around on overflow as it does
+ *        in two's complement, shift counts are taken modulo 64, and dividing by zero is an error.
+ * 
+ * @param op 
+ * @param a 
+ * @param b 
+ * @param st 
+ * @return int64_t 
+ */
+int64_t arith_apply(int op, int64_t a, int64_t b, struct arith_state * st)
+{
+    switch (op)
+    {
+        case AOP_ADD:    return (int64_t)((uint64_t)a + (uint64_t)b);
+        case AOP_SUB:    return (int64_t)((uint64_t)a - (uint64_t)b);
+        case AOP_MUL:    return (int64_t)((uint64_t)a * (uint64_t)b);
+        case AOP_SHL:    return (int64_t)((uint64_t)a << (b & 63));
+        case AOP_SHR:    return a >> (b & 63);
+        case AOP_LT:     return a < b;
+        case AOP_LE:     return a <= b;
+        case AOP_GT:     return a > b;
+        case AOP_GE:     return a >= b;
+        case AOP_EQ:     return a == b;
+        case AOP_NE:     return a != b;
+        case AOP_BITAND: return a & b;
+        case AOP_XOR:    return a ^ b;
+        case AOP_BITOR:  return a | b;
+        case AOP_DIV:
+        case AOP_MOD:
+            if (b == 0)
+            {
+                st->error = "division by zero";
+                return 0;
+            }
+            if ((b == -1) && (a == INT64_MIN))
+            {
+                return (op == AOP_DIV) ? a : 0;
+            }
+            return (op == AOP_DIV) ? a / b : a % b;
+        default:
+            return 0;
+    }
+}
+
+
+/* The evaluator's levels call each other for parenthesized and nested expressions. eval is false on the side of &&,
+   || and ?: that is skipped, where nothing may be assigned and no error reported. */
+int64_t arith_comma(struct arith_state * st, bool eval);
+
+
+/**
+ * @brief arith_unary() evaluates a number, a variable, a parenthesized expression, or one of those behind unary
+ *        operators, with ++ and -- before or after a variable.
+ * 
+ * @param st 
+ * @param eval 
+ * @return int64_t 
+ */
+int64_t arith_unary(struct arith_state * st, bool eval)
+{
+    struct arith_token * tok = st->t;
+    int64_t value;
+
+    switch (tok->op)
+    {
+        case AOP_ADD:
+            st->t++;
+            return arith_unary(st, eval);
+
+        case AOP_SUB:
+            st->t++;
+            return (int64_t)(0 - (uint64_t)arith_unary(st, eval));
+
+        case AOP_NOT:
+            st->t++;
+            return !arith_unary(st, eval);
+
+        case AOP_BITNOT:
+            st->t++;
+            return ~arith_unary(st, eval);
+
+        case AOP_INC:
+        case AOP_DEC:
+            if (tok[1].op != ATOK_VAR)
+            {
+                st->error = "++ or -- needs a variable";
+                return 0;
+            }
+            st->t += 2;
+            if (!eval)
+            {
+                return 0;
+            }
+            value = arith_apply((tok->op == AOP_INC) ? AOP_ADD : AOP_SUB, arith_get(&tok[1], st), 1, st);
+            if (st->error == NULL)
+            {
+                set_int_var(tok[1].name, value);
+            }
+            return value;
+
+        case AOP_LPAREN:
+            st->t++;
+            value = arith_comma(st, eval);
+            if (st->t->op != AOP_RPAREN)
+            {
+                st->error = "missing )";
+                return 0;
+            }
+            st->t++;
+            return value;
+
+        case ATOK_NUM:
+            st->t++;
+            return tok->value;
+
+        case ATOK_VAR:
+            st->t++;
+            value = eval ? arith_get(tok, st) : 0;
+            if ((st->t->op == AOP_INC) || (st->t->op == AOP_DEC))
+            {
+                if (eval && (st->error == NULL))
+                {
+                    set_int_var(tok->name, arith_apply((st->t->op == AOP_INC) ? AOP_ADD : AOP_SUB, value, 1, st));
+                }
+                st->t++;
+            }
+            return value;
+
+        default:
+            st->error = "syntax error";
+            return 0;
+    }
+}
+
+
+/**
+ * @brief arith_binary() evaluates binary operators binding at least as tightly as min_prec, by precedence climbing.
+ *        && and || only evaluate their right side when it decides the result.
+ * 
+ * @param st 
+ * @param min_prec 
+ * @param eval 
+ * @return int64_t 
+ */
+int64_t arith_binary(struct arith_state * st, int min_prec, bool eval)
+{
+    int64_t left = arith_unary(st, eval);
+    int64_t right;
+    int prec;
+    int op;
+
+    while (((prec = arith_precedence(st->t->op)) > 0) && (prec >= min_prec) && (st->error == NULL))
+    {
+        op = st->t->op;
+        st->t++;
+
+        if (op == AOP_AND)
+        {
+            right = arith_binary(st, prec + 1, eval && (left != 0));
+            left = (left != 0) && (right != 0);
+        }
+        else if (op == AOP_OR)
+        {
+            right = arith_binary(st, prec + 1, eval && (left == 0));
+            left = (left != 0) || (right != 0);
+        }
+        else
+        {
+            right = arith_binary(st, prec + 1, eval);
+            left = eval ? arith_apply(op, left, right, st) : 0;
+        }
+    }
+
+    return left;
+}
+
+
+/**
+ * @brief arith_assign() evaluates an assignment, plain or compound, or else a conditional expression with ?:.
+ * 
+ * @param st 
+ * @param eval 
+ * @return int64_t 
+ */
+int64_t arith_assign(struct arith_state * st, bool eval)
+{
+    struct arith_token * tok = st->t;
+    int64_t cond;
+    int64_t value;
+    int64_t other;
+    int op;
+
+    if ((tok->op == ATOK_VAR) && (((tok[1].op >= AOP_ADD_ASSIGN) && (tok[1].op <= AOP_OR_ASSIGN))
+                                  || (tok[1].op == AOP_ASSIGN) || (tok[1].op == AOP_SHL_ASSIGN) || (tok[1].op == AOP_SHR_ASSIGN)))
+    {
+        op = tok[1].op;
+        st->t += 2;
+        value = arith_assign(st, eval);
+        if (!eval || (st->error != NULL))
+        {
+            return 0;
+        }
+
+        /* A compound assignment is the binary operator of the same name, applied to the variable. */
+        switch (op)
+        {
+            case AOP_SHL_ASSIGN: op = AOP_SHL; break;
+            case AOP_SHR_ASSIGN: op = AOP_SHR; break;
+            case AOP_ADD_ASSIGN: op = AOP_ADD; break;
+            case AOP_SUB_ASSIGN: op = AOP_SUB; break;
+            case AOP_MUL_ASSIGN: op = AOP_MUL; break;
+            case AOP_DIV_ASSIGN: op = AOP_DIV; break;
+            case AOP_MOD_ASSIGN: op = AOP_MOD; break;
+            case AOP_AND_ASSIGN: op = AOP_BITAND; break;
+            case AOP_XOR_ASSIGN: op = AOP_XOR; break;
+            case AOP_OR_ASSIGN:  op = AOP_BITOR; break;
+        }
+        if (op != AOP_ASSIGN)
+        {
+            value = arith_apply(op, arith_get(tok, st), value, st);
+        }
+        if (st->error == NULL)
+        {
+            set_int_var(tok->name, value);
+        }
+        return value;
+    }
+
+    cond = arith_binary(st, 1, eval);
+    if (st->t->op != AOP_QUESTION)
+    {
+        return cond;
+    }
+
+    st->t++;
+    value = arith_comma(st, eval && (cond != 0));
+    if (st->t->op != AOP_COLON)
+    {
+        st->error = "missing : after ?";
+        return 0;
+    }
+    st->t++;
+    other = arith_assign(st, eval && (cond == 0));
+
+    return (cond != 0) ? value : other;
+}
+
+
+/**
+ * @brief arith_comma() evaluates expressions separated by commas, giving the value of the last one.
+ * 
+ * @param st 
+ * @param eval 
+ * @return int64_t 
+ */
+int64_t arith_comma(struct arith_state * st, bool eval)
+{
+    int64_t value = arith_assign(st, eval);
+
+    while ((st->t->op == AOP_COMMA) && (st->error == NULL))
+    {
+        st->t++;
+        value = arith_assign(st, eval);
+    }
+
+    return value;
+}
+
+
+/**
+ * @brief arithmetic() evaluates the text of a $(( )) and writes the result into numbuf. Expressions are compiled into
+ *        tokens once and kept in arith_cache by their text, so one in a loop is only split up the first time it runs.
+ *        An empty expression is 0. Returns NULL after printing the error if the expression is bad.
+ * 
+ * @param text 
+ * @param numbuf 
+ * @return const char* 
+ */
+const char * arithmetic(const char * text, char * numbuf)
+{
+    struct arith_expr ** slot = &arith_cache[hash_name(text, strlen(text)) & 255];
+    struct arith_expr * expr;
+    struct arith_state st;
+    const char * error = NULL;
+    int64_t value;
+
+    if ((*slot == NULL) || (strcmp((*slot)->text, text) != 0))
+    {
+        if ((expr = arith_compile(text, &error)) == NULL)
+        {
+            shell_printf("Arithmetic error: %s in \"%s\"\n", error, text);
+            return NULL;
+        }
+        if (*slot != NULL)
+        {
+            arith_free(*slot);
+        }
+        *slot = expr;
+    }
+
+    st.t = (*slot)->tokens;
+    st.error = NULL;
+    value = (st.t->op == ATOK_END) ? 0 : arith_comma(&st, true);
+    if ((st.error == NULL) && (st.t->op != ATOK_END))
+    {
+        st.error = "syntax error";
+    }
+    if (st.error != NULL)
+    {
+        shell_printf("Arithmetic error: %s in \"%s\"\n", st.error, text);
+        return NULL;
+    }
+
+    sprintf(numbuf, "%lld", (long long)value);
+    return numbuf;
+}
+
+
+/**
+ * @brief compare_words() orders words for qsort() by their bytes, the same in every locale.
+ * 
+ * @param a 
+ * @param b 
+ * @return int 
+ */
+int compare_words(const void * a, const void * b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/**
+ * @brief index_string() returns the string at offset in a command index.
+ * 
+ * @param index 
+ * @param offset 
+ * @return const char* 
+ */
+const char * index_string(struct path_index * index, uint32_t offset)
+{
+    return index->image + offset;
+}
+
+
+/**
+ * @brief free_path_index() unmaps or frees an index.
+ * 
+ * @param index 
+ */
+void free_path_index(struct path_index * index)
+{
+    if (index == NULL)
+    {
+        return;
+    }
+    if (index->mapped)
+    {
+        munmap(index->image, index->size);
+    }
+    else
+    {
+        free(index->image);
+    }
+    free(index);
+
+    return;
+}
+
+
+/**
+ * @brief command_index_file() puts the name of the index file for path in file. Returns false if the shell has no
+ *        cache directory to keep one in.
+ * 
+ * @param path 
+ * @param file 
+ * @param size 
+ * @return true 
+ * @return false 
+ */
+bool command_index_file(const char * path, char * file, size_t size)
+{
+    if (command_index_dir == NULL)
+    {
+        return false;
+    }
+
+    return (size_t) snprintf(file, size, "%s/commands-%08x", command_index_dir, hash_name(path, strlen(path))) < size;
+}
+
+
+/**
+ * @brief stamp_dir() fills in the stamp of a directory. A directory changed in the last few milliseconds could change
+ *        again within the same timestamp tick, so it is reported as not settled.
+ * 
+ * @param dir 
+ * @param stamp 
+ * @param settled 
+ */
+void stamp_dir(const char * dir, struct dir_stamp * stamp, bool * settled)
+{
+    struct timespec now;
+    struct stat st;
+
+    memset(stamp, 0, offsetof(struct dir_stamp, name));
+    if (stat(dir, &st) == -1)
+    {
+        return;
+    }
+    stamp->dev = st.st_dev;
+    stamp->ino = st.st_ino;
+    stamp->mtime_sec = st.st_mtim.tv_sec;
+    stamp->mtime_nsec = st.st_mtim.tv_nsec;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if ((now.tv_sec - st.st_mtim.tv_sec) * 1000 + (now.tv_nsec - st.st_mtim.tv_nsec) / 1000000 < 20)
+    {
+        *settled = false;
+    }
+
+    return;
+}
+
+
+/**
+ * @brief path_index_fresh() checks that no PATH directory of an index has changed since it was built.
+ * 
+ * @param index 
+ * @return true 
+ * @return false 
+ */
+bool path_index_fresh(struct path_index * index)
+{
+    struct dir_stamp stamp;
+    bool settled = true;
+    uint32_t i;
+
+    for (i = 0; i < index->header->num_dirs; i++)
+    {
+        stamp_dir(index_string(index, index->dirs[i].name), &stamp, &settled);
+        if (memcmp(&stamp, &index->dirs[i], offsetof(struct dir_stamp, name)) != 0)
+        {
+            return false;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &index->checked);
+
+    return true;
+}
+
+
+/**
+ * @brief open_path_index() sets up the pointers into the bytes of an index, checking that every part of it lies
+ *        inside them. Returns NULL, having freed the bytes, if they are not an index for path.
+ * 
+ * @param image 
+ * @param size 
+ * @param mapped 
+ * @param path 
+ * @return struct path_index* 
+ */
+struct path_index * open_path_index(char * image, size_t size, bool mapped, const char * path)
+{
+    struct path_index * index = calloc(1, sizeof(struct path_index));
+    struct command_index_header * header = (struct command_index_header *) image;
+    size_t strings;
+    uint32_t i;
+
+    index->image = image;
+    index->size = size;
+    index->mapped = mapped;
+
+    if ((size < sizeof(*header)) || (memcmp(header->magic, "smallsh\n", 8) != 0) ||
+        (header->version != COMMAND_INDEX_VERSION) || (header->size != size))
+    {
+        free_path_index(index);
+        return NULL;
+    }
+
+    strings = sizeof(*header) + (size_t) header->num_dirs * sizeof(struct dir_stamp) +
+              (size_t) header->num_commands * sizeof(struct command_entry);
+    if ((strings > size) || (image[size - 1] != '\0') || (header->path < strings) || (header->path >= size) ||
+        (strcmp(image + header->path, path) != 0))
+    {
+        free_path_index(index);
+        return NULL;
+    }
+
+    index->header = header;
+    index->dirs = (struct dir_stamp *) (image + sizeof(*header));
+    index->entries = (struct command_entry *) (index->dirs + header->num_dirs);
+    index->count = header->num_commands;
+    index->exact = true;
+    for (i = 0; i < header->num_dirs; i++)
+    {
+        if ((index->dirs[i].name < strings) || (index->dirs[i].name >= size))
+        {
+            free_path_index(index);
+            return NULL;
+        }
+        index->exact = index->exact && (image[index->dirs[i].name] == '/');
+    }
+    for (i = 0; i < header->num_commands; i++)
+    {
+        if ((index->entries[i].name < strings) || (index->entries[i].name >= size) ||
+            (index->entries[i].dir >= header->num_dirs))
+        {
+            free_path_index(index);
+            return NULL;
+        }
+    }
+
+    return index;
+}
+
+
+/**
+ * @brief map_path_index() maps the index file for path, if there is one and it is for path. Mapping it costs a few
+ *        system calls however many commands it holds, and shells mapping the same file share its pages.
+ * 
+ * @param path 
+ * @return struct path_index* 
+ */
+struct path_index * map_path_index(const char * path)
+{
+    struct stat st;
+    char file[4096];
+    char * image;
+    int fd;
+
+    if (!command_index_file(path, file, sizeof(file)) || ((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1))
+    {
+        return NULL;
+    }
+    if ((fstat(fd, &st) == -1) || (st.st_size < (off_t) sizeof(struct command_index_header)) ||
+        ((image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED))
+    {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    return open_path_index(image, st.st_size, true, path);
+}
+
+
+/**
+ * @brief compare_entries() orders the commands of an index for qsort_r() by name, and then by the position of their
+ *        directory in PATH.
+ * 
+ * @param a 
+ * @param b 
+ * @param strings 
+ * @return int 
+ */
+int compare_entries(const void * a, const void * b, void * strings)
+{
+    const struct command_entry * x = a;
+    const struct command_entry * y = b;
+    int order = strcmp((char *) strings + x->name, (char *) strings + y->name);
+
+    return (order != 0) ? order : (x->dir > y->dir) - (x->dir < y->dir);
+}
+
+
+/**
+ * @brief build_path_index() reads every directory on path and builds an index of the regular files in them that
+ *        someone may execute, each under the first directory it was found in.
+ * 
+ * @param path 
+ * @param batch 
+ * @return struct path_index* 
+ */
+struct path_index * build_path_index(const char * path, char * batch)
+{
+    struct command_index_header header;
+    struct timespec pause = { 0, 25000000 };
+    struct dirent64 * d;
+    struct dir_stamp * stamps = NULL;
+    struct command_entry * entries = NULL;
+    struct stat st;
+    char * strings = NULL;     // directory names, the PATH string and command names, back to back
+    char * image;
+    const char * p;
+    size_t strings_size = 0;
+    size_t strings_cap = 0;
+    size_t base;
+    size_t len;
+    ssize_t got;
+    ssize_t at;
+    int num_dirs = 0;
+    int count = 0;
+    int cap = 0;
+    int fd;
+    int i;
+    int j;
+    bool settled;
+
+    /* The directories go first, each NUL terminated, then PATH; the offsets are fixed up once the size is known. */
+    for (p = path; 1; p += len + 1)
+    {
+        len = strcspn(p, ":");
+        stamps = realloc(stamps, sizeof(struct dir_stamp) * (num_dirs + 1));
+        strings = realloc(strings, strings_size + len + 2);
+        memcpy(strings + strings_size, (len == 0) ? "." : p, (len == 0) ? 1 : len);
+        strings[strings_size + ((len == 0) ? 1 : len)] = '\0';
+        stamps[num_dirs].name = strings_size;
+        strings_size += ((len == 0) ? 1 : len) + 1;
+        num_dirs++;
+        if (p[len] == '\0')
+        {
+            break;
+        }
+    }
+    len = strlen(path);
+    strings = realloc(strings, strings_size + len + 1);
+    memcpy(strings + strings_size, path, len + 1);
+    header.path = strings_size;
+    strings_size += len + 1;
+    strings_cap = strings_size;
+
+    /* Stamps are taken before the directories are read, and again a moment later if one had only just changed. */
+    do
+    {
+        settled = true;
+        for (i = 0; i < num_dirs; i++)
+        {
+            stamp_dir(strings + stamps[i].name, &stamps[i], &settled);
+        }
+    } while (!settled && (nanosleep(&pause, NULL) == 0));
+
+    for (i = 0; i < num_dirs; i++)
+    {
+        if ((fd = open(strings + stamps[i].name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        {
+            continue;
+        }
+        while ((got = getdents64(fd, batch, dirent_batch_size)) > 0)
+        {
+            for (at = 0; at < got; at += d->d_reclen)
+            {
+                d = (struct dirent64 *) (batch + at);
+                if ((d->d_name[0] == '.') || (d->d_type == DT_DIR) ||
+                    (fstatat(fd, d->d_name, &st, 0) == -1) || !S_ISREG(st.st_mode) || ((st.st_mode & 0111) == 0))
+                {
+                    continue;
+                }
+                len = strlen(d->d_name);
+                if (strings_size + len + 1 > strings_cap)
+                {
+                    strings_cap = (strings_size + len + 1) * 2;
+                    strings = realloc(strings, strings_cap);
+                }
+                if (count == cap)
+                {
+                    cap = (cap == 0) ? 1024 : cap * 2;
+                    entries = realloc(entries, sizeof(struct command_entry) * cap);
+                }
+                entries[count].name = strings_size;
+                entries[count].dir = i;
+                entries[count].mode = st.st_mode;
+                count++;
+                memcpy(strings + strings_size, d->d_name, len + 1);
+                strings_size += len + 1;
+            }
+        }
+        close(fd);
+    }
+
+    /* Sort by name and then by directory, and keep the first of each name, the one a PATH search would find. */
+    if (count > 1)
+    {
+        qsort_r(entries, count, sizeof(struct command_entry), compare_entries, strings);
+    }
+    for (i = 0, j = 0; i < count; i++)
+    {
+        if ((j == 0) || (strcmp(strings + entries[i].name, strings + entries[j - 1].name) != 0))
+        {
+            entries[j++] = entries[i];
+        }
+    }
+
+    /* The strings go behind the entries, so every offset into them moves up by what comes before. */
+    memcpy(header.magic, "smallsh\n", 8);
+    header.version = COMMAND_INDEX_VERSION;
+    header.num_dirs = num_dirs;
+    header.num_commands = j;
+    base = sizeof(header) + sizeof(struct dir_stamp) * num_dirs + sizeof(struct command_entry) * j;
+    header.path += base;
+    header.size = base + strings_size;
+    for (i = 0; i < num_dirs; i++)
+    {
+        stamps[i].name += base;
+        stamps[i].padding = 0;
+    }
+    for (i = 0; i < j; i++)
+    {
+        entries[i].name += base;
+    }
+
+    image = malloc(header.size);
+    memcpy(image, &header, sizeof(header));
+    memcpy(image + sizeof(header), stamps, sizeof(struct dir_stamp) * num_dirs);
+    memcpy(image + sizeof(header) + sizeof(struct dir_stamp) * num_dirs, entries, sizeof(struct command_entry) * j);
+    memcpy(image + base, strings, strings_size);
+
+    free(stamps);
+    free(entries);
+    free(strings);
+
+    return open_path_index(image, header.size, false, path);
+}
+
+/**
+ * @brief write_command_index() writes an index to its file for other shells to map. It goes to a file of its own
+ *        first and is renamed over the old one, so no shell ever sees it half written.
+ * 
+ * @param index 
+ * @param file 
+ * @return true 
+ * @return false 
+ */
+bool write_command_index(struct path_index * index, const char * file)
+{
+    char tmp[4200];
+    size_t done = 0;
+    ssize_t n;
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+    {
+        return false;
+    }
+    while (done < index->size)
+    {
+        if ((n = write(fd, index->image + done, index->size - done)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+
+    if ((done < index->size) || (rename(tmp, file) == -1))
+    {
+        unlink(tmp);
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief refresh_path_index() returns an index for path that is up to date. Shells sharing the index file take turns
+ *        under a lock on it, so when a change wakes them all, one reads the directories and the rest map what it
+ *        wrote.
+ * 
+ * @param path 
+ * @param batch 
+ * @return struct path_index* 
+ */
+struct path_index * refresh_path_index(const char * path, char * batch)
+{
+    struct path_index * index;
+    char file[4096];
+    char lock_file[4200];
+    char * slash;
+    int lock;
+
+    if (!command_index_file(path, file, sizeof(file)))
+    {
+        return build_path_index(path, batch);
+    }
+
+    /* The cache directory and the one it is in are made the first time they are needed. */
+    slash = strrchr(command_index_dir, '/');
+    if (slash != NULL)
+    {
+        *slash = '\0';
+        mkdir(command_index_dir, 0700);
+        *slash = '/';
+    }
+    mkdir(command_index_dir, 0700);
+
+    snprintf(lock_file, sizeof(lock_file), "%s.lock", file);
+    if ((lock = open(lock_file, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) != -1)
+    {
+        flock(lock, LOCK_EX);
+    }
+
+    if (((index = map_path_index(path)) != NULL) && !path_index_fresh(index))
+    {
+        free_path_index(index);
+        index = NULL;
+    }
+    if (index == NULL)
+    {
+        index = build_path_index(path, batch);
+        write_command_index(index, file);
+    }
+
+    if (lock != -1)
+    {
+        close(lock);
+    }
+
+    return index;
+}
+
+
+/**
+ * @brief path_index_thread() keeps path_index up to date. It watches the PATH directories with inotify before reading
+ *        them, so nothing changed while they are read is missed, then waits for a change or for the shell to ask for
+ *        another PATH. A burst of changes, like a package being installed, is let settle before reading again.
+ * 
+ * @param arg 
+ * @return void* 
+ */
+void * path_index_thread(void * arg)
+{
+    struct path_index * index;
+    struct pollfd fds[2];
+    char * batch = malloc(dirent_batch_size);
+    char events[4096];
+    char dir[4096];
+    char * path;
+    char * p;
+    size_t dir_len;
+    uint64_t count;
+    int notify = -1;
+    int timeout;
+
+    (void) arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&path_index_lock);
+        path = strdup(path_index_want);
+        pthread_mutex_unlock(&path_index_lock);
+
+        /* A fresh inotify instance drops the watches on the directories of an old PATH. */
+        if (notify != -1)
+        {
+            close(notify);
+        }
+        if ((notify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) != -1)
+        {
+            for (p = path; *p != '\0'; p += dir_len + (p[dir_len] == ':'))
+            {
+                dir_len = strcspn(p, ":");
+                if ((dir_len > 0) && (dir_len < sizeof(dir)))
+                {
+                    memcpy(dir, p, dir_len);
+                    dir[dir_len] = '\0';
+                    inotify_add_watch(notify, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                                                   IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+                }
+            }
+        }
+
+        index = refresh_path_index(path, batch);
+        free(path);
+        pthread_mutex_lock(&path_index_lock);
+        free_path_index(path_index);
+        path_index = index;
+        pthread_mutex_unlock(&path_index_lock);
+
+        fds[0].fd = path_index_wake;
+        fds[0].events = POLLIN;
+        fds[1].fd = notify;
+        fds[1].events = POLLIN;
+        for (timeout = -1; poll(fds, 2, timeout) != 0; timeout = 100)
+        {
+            if (fds[0].revents & POLLIN)
+            {
+                read(path_index_wake, &count, sizeof(count));
+                break;
+            }
+            while ((notify != -1) && (read(notify, events, sizeof(events)) > 0))
+            {
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief lock_path_index() and unlock_path_index() hold path_index_lock across fork(), so a child never starts with
+ *        it held by a thread that the child does not have.
+ * 
+ */
+void lock_path_index()
+{
+    pthread_mutex_lock(&path_index_lock);
+    return;
+}
+
+void unlock_path_index()
+{
+    pthread_mutex_unlock(&path_index_lock);
+    return;
+}
+
+
+/**
+ * @brief load_path_index() maps the command index file for the shell's PATH at startup, if there is one. Whether it
+ *        is still up to date is checked the first time it is used.
+ * 
+ */
+void load_path_index()
+{
+    const char * path = get_var("PATH");
+    const char * cache = get_var("XDG_CACHE_HOME");
+    const char * home = get_var("HOME");
+
+    if ((cache != NULL) && (cache[0] == '/'))
+    {
+        command_index_dir = malloc(strlen(cache) + 16);
+        sprintf(command_index_dir, "%s/smallsh", cache);
+    }
+    else if ((home != NULL) && (home[0] == '/'))
+    {
+        command_index_dir = malloc(strlen(home) + 24);
+        sprintf(command_index_dir, "%s/.cache/smallsh", home);
+    }
+
+    pthread_atfork(lock_path_index, unlock_path_index, unlock_path_index);
+    path_index = map_path_index((path != NULL) ? path : "");
+
+    return;
+}
+
+
+/**
+ * @brief start_path_index() starts the thread that keeps the command index up to date for an interactive shell. It
+ *        blocks all signals, so they are only ever handled by the shell.
+ * 
+ */
+void start_path_index()
+{
+    pthread_t thread;
+    sigset_t all;
+    sigset_t saved;
+    const char * path = get_var("PATH");
+
+    path_index_want = strdup((path != NULL) ? path : "");
+    if ((path_index_wake = eventfd(0, EFD_CLOEXEC)) == -1)
+    {
+        return;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    if (pthread_create(&thread, NULL, path_index_thread, NULL) == 0)
+    {
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    return;
+}
+
+
+/**
+ * @brief find_index() returns the position of the first command in an index whose name is not below name.
+ * 
+ * @param index 
+ * @param name 
+ * @return int 
+ */
+int find_index(struct path_index * index, const char * name)
+{
+    int low = 0;
+    int high = index->count;
+    int mid;
+
+    while (low < high)
+    {
+        mid = low + (high - low) / 2;
+        if (strcmp(index_string(index, index->entries[mid].name), name) < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+
+/**
+ * @brief find_indexed_command() puts where PATH would find a command in path, going by the command index. It answers
+ *        only while the index is for the current PATH and none of the directories has changed since it was built,
+ *        which is checked at most every command_index_recheck_ms.
+ * 
+ * @param name 
+ * @param path 
+ * @param size 
+ * @return true 
+ * @return false 
+ */
+bool find_indexed_command(const char * name, char * path, size_t size)
+{
+    const char * want = get_var("PATH");
+    struct path_index * index;
+    struct timespec now;
+    bool found = false;
+    long age_ms;
+    int i;
+
+    pthread_mutex_lock(&path_index_lock);
+    index = path_index;
+    if ((index != NULL) && index->exact && (strcmp(index_string(index, index->header->path), (want != NULL) ? want : "") == 0))
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        age_ms = (now.tv_sec - index->checked.tv_sec) * 1000 + (now.tv_nsec - index->checked.tv_nsec) / 1000000;
+        if ((age_ms < command_index_recheck_ms) || path_index_fresh(index))
+        {
+            i = find_index(index, name);
+            if ((i < index->count) && (strcmp(index_string(index, index->entries[i].name), name) == 0))
+            {
+                found = (size_t) snprintf(path, size, "%s/%s", index_string(index, index->dirs[index->entries[i].dir].name),
+                                          name) < size;
+            }
+        }
+    }
+    pthread_mutex_unlock(&path_index_lock);
+
+    return found;
+}
+
+
+/**
+ * @brief exec_script() runs path through /bin/sh if execve() has just refused it with ENOEXEC, the way execvp() does,
+ *        since an executable file without a #! line is taken to be a shell script. Returns if that fails too, or if
+ *        execve() failed for any other reason, with errno set.
+ * 
+ * @param path 
+ * @param arguments 
+ */
+void exec_script(const char * path, char ** arguments)
+{
+    char ** argv;
+    int n;
+
+    if (errno != ENOEXEC)
+    {
+        return;
+    }
+
+    for (n = 0; arguments[n] != NULL; n++)
+    {
+    }
+    argv = malloc(sizeof(char *) * (n + 2));
+    argv[0] = "/bin/sh";
+    argv[1] = (char *) path;
+    memcpy(argv + 2, arguments + 1, sizeof(char *) * n);
+    execve("/bin/sh", argv, shell_envp);
+
+    free(argv);
+    errno = ENOEXEC;
+    return;
+}
+
+
+/**
+ * @brief exec_command() replaces the current process with the command in arguments, searching PATH from the variable
+ *        table, or asking the command index, and handing the program shell_envp. It only returns if every candidate
+ *        failed.
+ * 
+ * @param arguments 
+ */
+void exec_command(char ** arguments)
+{
+    char * path = get_var("PATH");
+    char candidate[4096];
+    size_t cmd_len = strlen(arguments[0]);
+    size_t dir_len;
+    long long entered = (trace_fd != -1) ? trace_now() : 0;
+    int saved_errno = ENOENT;
+
+    /* A command with a slash in it is a path already. */
+    if ((strchr(arguments[0], '/') != NULL) || (path == NULL))
+    {
+        trace_exec(arguments, arguments[0], entered);
+        metrics_exec(arguments[0]);
+        execve(arguments[0], arguments, shell_envp);
+        exec_script(arguments[0], arguments);
+        return;
+    }
+
+    /* The command index knows where the command is, unless PATH has changed under it. Should the file have gone since
+       all the same, the search below finds wherever it went. */
+    if (find_indexed_command(arguments[0], candidate, sizeof(candidate)))
+    {
+        trace_exec(arguments, candidate, entered);
+        metrics_exec(arguments[0]);
+        execve(candidate, arguments, shell_envp);
+        exec_script(candidate, arguments);
+    }
+
+    /* Try each PATH directory in order, the way execvp() does. An empty entry means the current directory. */
+    while (1)
+    {
+        dir_len = strcspn(path, ":");
+
+        if (dir_len + cmd_len + 2 <= sizeof(candidate))
+        {
+            if (dir_len == 0)
+            {
+                memcpy(candidate, ".", 1);
+                dir_len = 1;
+            }
+            else
+            {
+                memcpy(candidate, path, dir_len);
+            }
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, arguments[0], cmd_len + 1);
+
+            trace_exec(arguments, candidate, entered);
+            metrics_exec(arguments[0]);
+            execve(candidate, arguments, shell_envp);
+            exec_script(candidate, arguments);
+
+            /* Keep looking only if this directory simply did not have it. */
+            if (errno == EACCES)
+            {
+                saved_errno = EACCES;
+            }
+            else if ((errno != ENOENT) && (errno != ENOTDIR))
+            {
+                return;
+            }
+        }
+
+        if (path[strcspn(path, ":")] == '\0')
+        {
+            break;
+        }
+        path += strcspn(path, ":") + 1;
+    }
+
+    errno = saved_errno;
+    return;
+}
+
+
+/**
+ * @brief apply_assignments() exports each NAME=value in assigns into this process's variables. Children call it just
+ *        before exec so a "VAR=value cmd" prefix only changes that command's environment.
+ * 
+ * @param assigns 
+ */
+void apply_assignments(char ** assigns)
+{
+    int i;
+
+    for (i = 0; (assigns != NULL) && (assigns[i] != NULL); i++)
+    {
+        assign_var(assigns[i], true);
+    }
+
+    return;
+}
+
+
+/**
+ * @brief export_vars() is the export builtin. With no arguments it lists the exported variables, otherwise each argument
+ *        is either NAME=value or the NAME of a variable to export.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void export_vars(char ** arguments, int argc)
+{
+    struct variable * var;
+    int i;
+
+    status = 0;
+
+    if (argc == 1)
+    {
+        for (i = 0; i < envp_count; i++)
+        {
+            var = find_var(shell_envp[i], strcspn(shell_envp[i], "="));
+            shell_printf("export %.*s=\"%s\"\n", (int)var->name_len, var->entry, var->entry + var->name_len + 1);
+        }
+        out_flush(STDOUT_FILENO);
+        return;
+    }
+
+    for (i = 1; i < argc; i++)
+    {
+        if (assign_var(arguments[i], true))
+        {
+            continue;
+        }
+
+        if (!valid_name(arguments[i], strlen(arguments[i])))
+        {
+            shell_printf("export: %s: not a valid name\n", arguments[i]);
+            status = 1;
+            continue;
+        }
+
+        /* Exporting a name that has no value yet creates it empty. */
+        var = find_var(arguments[i], strlen(arguments[i]));
+        if (var == NULL)
+        {
+            set_var(arguments[i], "", true);
+        }
+        else if (var->env_index == -1)
+        {
+            env_add(var);
+        }
+    }
+
+    return;
+}
+
+
+/**
+ * @brief unset_vars() is the unset builtin, removing each named variable.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void unset_vars(char ** arguments, int argc)
+{
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        unset_var(arguments[i]);
+    }
+
+    status = 0;
+    return;
+}
+
+
+/**
+ * @brief reap() checks on the background children and collects them if they've finished
+ * 
+ */
+void reap()
+{
+    /* reap all ongoing child processes */
+    int wstatus;
+    int w;
+    int i;
+
+    trace_begin("reap", NULL);
+    for(i = 0; i < num_bchildren; i++)
+    {
+        if(bchildren[i] != -1)
+        {
+            w = waitpid(bchildren[i], &wstatus, WNOHANG);
+            if (w != bchildren[i])
+            {
+                continue;
+            }
+
+            /* If the process exited, we want to get the child's exit status and cast it to our status variable. A
+               child killed by a signal is done with all the same. */
+            if (WIFEXITED(wstatus))
+            {
+                status = WEXITSTATUS(wstatus);
+            }
+            metrics_collect(w, wstatus);
+            bchildren[i] = -1;
+        }  
+    }
+    trace_end("reap");
+
+    return;
+}
+
+
+/**
+ * @brief add_bchild() records a child in the bchildren array, reusing slots that have already been reaped and doubling
+ *        the array when every slot holds a running job.
+ * 
+ * @param pid 
+ */
+void add_bchild(int pid)
+{
+    int i;
+
+    for(i = 0; i < num_bchildren; i++)
+    {
+        if(bchildren[i] == -1)
+        {
+            bchildren[i] = pid;
+            metrics.jobs_started++;
+            return;
+        }
+    }
+
+    if(num_bchildren == max_bchildren)
+    {
+        max_bchildren = (max_bchildren == 0) ? 64 : max_bchildren * 2;
+        bchildren = realloc(bchildren, sizeof(int) * max_bchildren);
+    }
+    bchildren[num_bchildren] = pid;
+    num_bchildren++;
+    metrics.jobs_started++;
+
+    return;
+}
+
+
+/**
+ * @brief remove_bchild() clears a child out of the bchildren array once it has been waited on.
+ * 
+ * @param pid 
+ */
+void remove_bchild(int pid)
+{
+    int i;
+
+    for(i = 0; i < num_bchildren; i++)
+    {
+        if(bchildren[i] == pid)
+        {
+            bchildren[i] = -1;
+            return;
+        }
+    }
+
+    return;
+}
+
+
+/**
+ * @brief exit_process() handles the SIGINT and exit commands, killing all child processes and then terminating the parent process
+ * 
+ *  
+ */
+void exit_process()
+{
+    int shellpid = getpid();
+    int i;
+    /* Loop through all currently running child processes and kill them. */
+
+    for(i = 0; i < num_bchildren; i++)
+    {
+        if(bchildren[i] != -1)
+        {
+            if(waitpid(shellpid = -1, &status, WNOHANG) == -1)
+            {
+                kill(bchildren[i], SIGINT);
+            }
+        }  
+    }
+
+    /* Exit out of the program, or out of the subshell it was called in. */
+    if (getpid() != shell_pid)
+    {
+        child_exit(0);
+    }
+    exit(0);
+}
+
+
+/**
+ * @brief handle_SIGTSTP() turns on and off the tstp flag to enable and disable background processes.
+ * 
+ */
+void handle_SIGTSTP()
+{
+    /* Using write because printf is non-reentrant */
+    if (!tstp)
+    {
+        write(1, "Caught SIGTSTP. Turning background processes off...\n", 52);
+        tstp = true;
+    }
+
+    else 
+    {
+        write(1, "Caught SIGTSTP. Turning background processes back on!\n", 54);
+        tstp = false;
+    }
+    
+    return;
+}
+
+
+/**
+ * @brief check_status() prints the current value of status if no children have finished, or the current exit_value of the parent
+ * 
+ */
+void check_status()
+{
+    if(status != -1)
+    {
+        shell_printf("exit status %d\n", status);
+    }
+    else
+    {
+        shell_printf("exit status %d\n", exit_status);
+    }
+}
+
+
+/**
+ * @brief change_directory() changes the current working directory to that specified. If no directory is specified the cwd is 
+ * changed to the user's HOME.
+ * 
+ * @param dir 
+ */
+void change_directory(char * dir)
+{
+    int cd_status = 0;
+    /* If no argument is specified, change the directory to the HOME directory, otherwise change the  */
+
+    cd_status = chdir(dir);
+
+    if(cd_status == -1)
+    {
+        shell_printf("Failed to change directory.\n");
+        status = 1;
+    }
+    else
+    {
+        status = 0;
+    }
+
+    return;
+}
+
+
+/**
+ * @brief redirect_child() dups the descriptors of a redirection plan onto the input and output of a child process. When
+ *        relayed is true its output goes to the fan out relay instead, so output redirections are skipped.
+ * 
+ * @param redirs 
+ * @param relayed 
+ */
+void redirect_child(struct redirection * redirs, bool relayed)
+{
+    int i;
+
+    for (i = 0; redirs[i].type != TOK_END; i++)
+    {
+        if (relayed && (redirs[i].dest == 1))
+        {
+            continue;
+        }
+
+        /* A plan descriptor that already is the destination only has to survive exec. */
+        if (redirs[i].fd == redirs[i].dest)
+        {
+            fcntl(redirs[i].fd, F_SETFD, 0);
+        }
+        else if (dup2(redirs[i].fd, redirs[i].dest) == -1)
+        {
+            shell_printf("Dup2 Error!\n");
+            child_exit(1);
+        }
+    }
+
+    return;
+}
+
+
+/**
+ * @brief close_shell_fds() closes every descriptor above stderr in a child about to exec, so nothing the shell has open
+ *        leaks into the command. The pipes of the command's process substitutions are the exception: they lose close
+ *        on exec instead, so the /dev/fd names it was given still work after exec. Without process substitutions this
+ *        is a single close_range(); without close_range() the shell's own descriptors still close on exec.
+ */
+void close_shell_fds()
+{
+    unsigned int keep[65];     // the process substitutions and the trace file
+    unsigned int low = 3;
+    unsigned int fd;
+    int num_keep = 0;
+    int i;
+    int j;
+
+    /* Insertion sort the few descriptors to keep, to close the gaps between them. */
+    for (i = procsubst_start; i < num_procsubst; i++)
+    {
+        fd = procsubst_fds[i];
+        fcntl(fd, F_SETFD, 0);
+        for (j = num_keep++; (j > 0) && (keep[j - 1] > fd); j--)
+        {
+            keep[j] = keep[j - 1];
+        }
+        keep[j] = fd;
+    }
+
+    /* The trace file stays open until exec, which closes it, so the child's events can still be written. */
+    if (trace_fd != -1)
+    {
+        for (j = num_keep++; (j > 0) && (keep[j - 1] > (unsigned int) trace_fd); j--)
+        {
+            keep[j] = keep[j - 1];
+        }
+        keep[j] = trace_fd;
+    }
+
+    for (i = 0; i < num_keep; i++)
+    {
+        if (keep[i] > low)
+        {
+            close_range(low, keep[i] - 1, 0);
+        }
+        low = (keep[i] >= low) ? keep[i] + 1 : low;
+    }
+    close_range(low, ~0U, 0);
+
+    return;
+}
+
+
+/**
+ * @brief count_outputs() counts the output redirections in a redirection list.
+ * 
+ * @param redirs 
+ * @return int 
+ */
+int count_outputs(struct redirection * redirs)
+{
+    int count = 0;
+    int i;
+
+    for (i = 0; redirs[i].type != TOK_END; i++)
+    {
+        if (redirs[i].type == TOK_GREAT)
+        {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+/**
+ * @brief devnull_fd() returns a descriptor for /dev/null, opened the first time it is needed.
+ * 
+ * @return int 
+ */
+int devnull_fd()
+{
+    static int fd = -1;
+
+    if (fd == -1)
+    {
+        fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    }
+
+    return fd;
+}
+
+
+/**
+ * @brief drain_pipe() moves exactly len bytes from the pipe in to out, with splice() where out allows it and read()
+ *        and write() where it does not. Returns false if out cannot take them.
+ * 
+ * @param in 
+ * @param out 
+ * @param len 
+ * @return true 
+ * @return false 
+ */
+bool drain_pipe(int in, int out, size_t len)
+{
+    char buf[65536];
+    ssize_t n;
+    ssize_t done;
+    ssize_t w;
+
+    while (len > 0)
+    {
+        n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+
+        if ((n == -1) && (errno == EINTR))
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            if (errno != EINVAL)
+            {
+                return false;
+            }
+
+            /* Terminals and some other files cannot be spliced to. */
+            n = read(in, buf, (len < sizeof(buf)) ? len : sizeof(buf));
+            if (n <= 0)
+            {
+                return false;
+            }
+            for (done = 0; done < n; done += w)
+            {
+                if ((w = write(out, buf + done, n - done)) == -1)
+                {
+                    return false;
+                }
+            }
+        }
+        if (n == 0)
+        {
+            return false;
+        }
+
+        len -= n;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief relay_output() copies everything written to the pipe in to every one of the targets until the writers close
+ *        it. Each block is duplicated with tee() into a spare pipe and spliced from there to one target at a time, and
+ *        the last target takes the block out of in itself, so the data is never copied into the shell. A target that
+ *        fails stops getting data but the others carry on.
+ * 
+ * @param in 
+ * @param targets 
+ * @param num_targets 
+ */
+void relay_output(int in, int * targets, int num_targets)
+{
+    int spare[2];
+    int pipe_size;
+    ssize_t n = 0;
+    ssize_t again;
+    bool * failed = arena_alloc(sizeof(bool) * num_targets);
+    int i;
+
+    memset(failed, 0, sizeof(bool) * num_targets);
+
+    /* The spare pipe must hold a whole block of in, or tee() could hand over less than the last target gets. */
+    if (pipe2(spare, O_CLOEXEC) == -1)
+    {
+        spare[0] = spare[1] = -1;
+    }
+    pipe_size = fcntl(in, F_GETPIPE_SZ);
+    if ((spare[1] != -1) && (pipe_size > 0))
+    {
+        fcntl(spare[1], F_SETPIPE_SZ, pipe_size);
+    }
+
+    while (spare[1] != -1)
+    {
+        n = tee(in, spare[1], (pipe_size > 0) ? pipe_size : 65536, 0);
+
+        if ((n == -1) && (errno == EINTR))
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+
+        for (i = 0; i < num_targets - 1; i++)
+        {
+            /* The first copy came from the tee() above; later ones duplicate the same, still unread, block. */
+            if (i > 0)
+            {
+                do
+                {
+                    again = tee(in, spare[1], n, 0);
+                }
+                while ((again == -1) && (errno == EINTR));
+            }
+
+            if (!failed[i])
+            {
+                failed[i] = !drain_pipe(spare[0], targets[i], n);
+            }
+            if (failed[i])
+            {
+                /* Throw the copy away so the spare pipe is empty for the next target. */
+                drain_pipe(spare[0], devnull_fd(), n);
+            }
+        }
+
+        if (failed[num_targets - 1] || !drain_pipe(in, targets[num_targets - 1], n))
+        {
+            failed[num_targets - 1] = true;
+            drain_pipe(in, devnull_fd(), n);
+        }
+    }
+
+    /* Without a spare pipe, or if tee() is refused, copy through a buffer instead. */
+    if ((spare[1] == -1) || ((n == -1) && (errno == EINVAL)))
+    {
+        char buf[65536];
+        ssize_t done;
+        ssize_t w;
+
+        while (((n = read(in, buf, sizeof(buf))) > 0) || ((n == -1) && (errno == EINTR)))
+        {
+            for (i = 0; (i < num_targets) && (n > 0); i++)
+            {
+                for (done = 0; !failed[i] && (done < n); done += w)
+                {
+                    if ((w = write(targets[i], buf + done, n - done)) == -1)
+                    {
+                        failed[i] = true;
+                    }
+                }
+            }
+        }
+    }
+
+    if (spare[1] != -1)
+    {
+        close(spare[0]);
+        close(spare[1]);
+    }
+    return;
+}
+
+
+/* A background command that fans out its output runs foreground_process() in its child. */
+void foreground_process(char ** arguments, char ** assigns, struct redirection * redirs);
+
+
+/**
+ * @brief background_process handles forking and child processes that are meant to be processed in the background when & is present and tstp is false.
+ * 
+ * @param arguments 
+ * @param assigns 
+ * @param redirs 
+ */
+void background_process(char ** arguments, char ** assigns, struct redirection * redirs) // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - TO DO - - - |||
+{
+    /* local variables */
+    int wstatus;          // child exit status
+
+    /* Call fork and create a child process, with nothing left queued for it to write again. */
+    int spawn_pid;
+    long long forking;
+    out_flush(STDOUT_FILENO);
+    trace_begin("fork", NULL);
+    forking = (metrics_file != NULL) ? trace_now() : 0;
+    spawn_pid = fork();
+
+    switch(spawn_pid)
+    {
+        case -1: // Fork Failed. 
+            shell_printf("Fork() failed.\n");
+            exit(1);
+            break;
+
+        case 0: // Child process. Ignores SIGINT and SIGTSTP.
+            /* Ignore SIGINT */
+            signal(SIGINT, SIG_IGN);
+
+            /* Ignore SIGTSTP */
+            signal(SIGTSTP, SIG_IGN);
+
+            /* The shell cannot wait here to relay a fanned out output, so this child runs the command in the
+               foreground of its own and relays for it, then exits with its status. */
+            if (count_outputs(redirs) > 1)
+            {
+                foreground_process(arguments, assigns, redirs);
+                child_exit(status);
+            }
+
+            /* Apply the redirections the shell already opened for this command. */
+            redirect_child(redirs, false);
+
+            /* Call Exec with this command's assignments added to the environment */
+            apply_assignments(assigns);
+            close_shell_fds();
+            exec_command(arguments);
+
+            /* Print an error, if you get here, since exec only returns on failure */
+            shell_printf("Exec failed!\n");
+            metrics_exec_failed();
+            child_exit(2);
+            break;
+
+        default: // Parent Process. Ignores SIGINT, handles SIGTSTP // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - TO DO - - - |||
+            /* Ignore SIGINT */
+            trace_end("fork");
+            metrics_fork(forking);
+            signal(SIGINT, SIG_IGN);
+            signal(SIGTSTP, handle_SIGTSTP);
+
+            /* Add the spawnpid to the bchildrenarray, and say so with the next prompt */
+            add_bchild(spawn_pid);
+            shell_printf("background pid is %d\n", spawn_pid);
+            
+            /* Do not block the parent process, run child in the background */
+            spawn_pid = waitpid(spawn_pid, &wstatus, WNOHANG);
+
+            break;
+
+    }
+
+    return;
+}
+
+
+/**
+ * @brief foreground_process() runs the forking for a foreground child process 
+ * 
+ * @param command 
+ * @param arguments 
+ * @param assigns 
+ * @param redirs 
+ */
+void foreground_process(char ** arguments, char ** assigns, struct redirection * redirs) // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - TO DO - - - |||
+{
+    /* local variables */
+    int wstatus;  // child exit status
+    int i = 0;    // iterator
+    int w = 0;    // value of waitpid, for parent processing
+    int num_outputs = count_outputs(redirs);
+    int * targets = NULL;   // output files when the output fans out to several
+    int relay[2];           // pipe from the child to relay_output()
+
+    /* With more than one output file, the child writes into a pipe and the shell relays it to all of them. */
+    if (num_outputs > 1)
+    {
+        targets = arena_alloc(sizeof(int) * num_outputs);
+        for (i = 0, num_outputs = 0; redirs[i].type != TOK_END; i++)
+        {
+            if (redirs[i].dest == 1)
+            {
+                targets[num_outputs++] = redirs[i].fd;
+            }
+        }
+        if (pipe2(relay, O_CLOEXEC) == -1)
+        {
+            shell_printf("Pipe error!\n");
+            status = 1;
+            return;
+        }
+    }
+
+    /* Call fork and create a child process, with nothing left queued for it to write again. */
+    int spawn_pid;
+    long long forking;
+    out_flush(STDOUT_FILENO);
+    trace_begin("fork", NULL);
+    forking = (metrics_file != NULL) ? trace_now() : 0;
+    spawn_pid = fork();
+
+    switch(spawn_pid)
+    {
+        case -1: // Fork Failed. 
+            shell_printf("Fork() failed.\n");
+            exit(1);
+            break;
+
+        case 0: // Child process. Is killed by SIGINT. Ignores SIGTSTP.
+            /* Ignore SIGTSTP */
+            signal(SIGTSTP, SIG_IGN);
+
+            /* Apply the redirections the shell already opened for this command. A fanned out output goes into the
+               relay pipe instead. */
+            redirect_child(redirs, num_outputs > 1);
+            if ((num_outputs > 1) && (dup2(relay[1], 1) == -1))
+            {
+                shell_printf("Dup2 Error!\n");
+                child_exit(1);
+            }
+
+            /* Call Exec with this command's assignments added to the environment */
+            apply_assignments(assigns);
+            close_shell_fds();
+            exec_command(arguments);
+
+            /* Print an error if you get here, since exec only returns on failure. */
+            shell_printf("Exec failed!\n");
+            metrics_exec_failed();
+            child_exit(2);
+            break;
+
+        default: // Parent Process. Ignores SIGINT, handles SIGTSTP // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - TO DO - - - |||
+            /* Parent process ignore SIGINT and handle SIGTSTP */
+            trace_end("fork");
+            metrics_fork(forking);
+            signal(SIGINT, SIG_IGN);
+            signal(SIGTSTP, handle_SIGTSTP);
+
+            /* Relay the child's output to its files until it closes its end of the pipe. */
+            if (num_outputs > 1)
+            {
+                close(relay[1]);
+                relay_output(relay[0], targets, num_outputs);
+                close(relay[0]);
+            }
+
+            /* Block Parent until child or children are done */
+            trace_begin("wait", NULL);
+            do 
+            {
+                w = waitpid(spawn_pid, &wstatus, 0);
+
+                if (w == -1) 
+                {
+                    shell_printf("waitpid()\n");
+                    exit(EXIT_FAILURE);
+                } 
+                /* If the process exited, we want to get the child's exit status and cast it to our status variable. */
+                if (WIFEXITED(wstatus))
+                {
+                    status = WEXITSTATUS(wstatus);
+                }
+
+                /* Else, if the process was terminated, write the signal that killed the child to our status buffer */
+                else if (WIFSIGNALED(wstatus))
+                {
+                    shell_printf("killed by signal %d\n", WTERMSIG(wstatus));
+                }
+                
+                /* Else, if the process was stopped, write the stop signal */
+                else if (WIFSTOPPED(wstatus)) 
+                {
+                    shell_printf("stopped by signal %d\n", WSTOPSIG(wstatus));
+                } 
+                
+                /* Else, if continued, write that it was continued */
+                else if (WIFCONTINUED(wstatus)) 
+                {
+                    shell_printf("continued\n");
+                }
+            }
+            while (!WIFEXITED(wstatus) && !WIFSIGNALED(wstatus));
+            metrics_collect(spawn_pid, wstatus);
+            trace_end("wait");
+
+            break;
+
+    }
+
+    return;
+}
+
+
+/**
+ * @brief launch_child() forks a child that runs arguments with the same signal setup as a foreground child and returns
+ *        its pid without waiting on it. The caller waits on it; it is not a background job, so it stays out of the
+ *        bchildren job table and reap(). If infd is not -1 it becomes the child's stdin.
+ * 
+ * @param arguments 
+ * @param infd 
+ * @return int 
+ */
+int launch_child(char ** arguments, int infd)
+{
+    long long forking;
+    int spawn_pid;
+
+    out_flush(STDOUT_FILENO);
+    trace_begin("fork", NULL);
+    forking = (metrics_file != NULL) ? trace_now() : 0;
+    spawn_pid = fork();
+
+    switch(spawn_pid)
+    {
+        case -1: // Fork Failed.
+            trace_end("fork");
+            shell_printf("Fork() failed.\n");
+            return -1;
+
+        case 0: // Child process. Is killed by SIGINT. Ignores SIGTSTP.
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTSTP, SIG_IGN);
+
+            if ((infd != -1) && (dup2(infd, 0) == -1))
+            {
+                shell_printf("Dup2 Error!\n");
+                child_exit(1);
+            }
+
+            close_shell_fds();
+            exec_command(arguments);
+
+            /* Print an error if you get here, since exec only returns on failure. */
+            shell_printf("Exec failed!\n");
+            metrics_exec_failed();
+            child_exit(2);
+            break;
+
+        default: // Parent process.
+            trace_end("fork");
+            metrics_fork(forking);
+            break;
+    }
+
+    return spawn_pid;
+}
+
+
+/**
+ * @brief struct xargs_batch holds the state of one xargs run: the fixed command, the arguments collected for the next
+ *        exec, and the children that are still running.
+ */
+struct xargs_batch
+{
+    char ** command;       // command and initial arguments
+    int command_argc;
+    char * pool;           // argument text, NUL separated
+    size_t pool_len;
+    size_t pool_cap;
+    size_t * offsets;      // start of each collected argument in pool
+    int nargs;
+    int cap_args;
+    size_t token_start;    // start of the argument currently being read
+    long budget;           // bytes the collected arguments may use in one exec
+    long used;
+    long max_per_batch;    // -n, 0 means only the budget limits the batch
+    long max_procs;        // -P
+    int * pids;            // batches still running
+    struct pollfd * polls; // a pidfd for each of pids, or -1 where none could be opened
+    int npids;
+    int infd;              // stdin given to the batches
+    int xstatus;           // exit status xargs will report
+    bool ran_once;
+};
+
+
+/**
+ * @brief exec_budget() returns how many bytes of arguments one exec can take: whatever ARG_MAX leaves after the
+ *        environment the shell hands to children and some headroom for the loader, the same way POSIX xargs sizes its
+ *        command lines. Each argument costs its length, its '\0' and its pointer.
+ * 
+ * @return long 
+ */
+long exec_budget()
+{
+    long arg_max = sysconf(_SC_ARG_MAX);
+    long budget = ((arg_max > 0) ? arg_max : 131072) - 2048;
+    int i;
+
+    for (i = 0; i < envp_count; i++)
+    {
+        budget -= strlen(shell_envp[i]) + 1 + sizeof(char *);
+    }
+
+    return budget;
+}
+
+
+/**
+ * @brief xargs_done() removes the batch at index i from the pid list and folds its wait status into the xargs status.
+ *        wstatus is -1 for a batch that could not be waited on.
+ * 
+ * @param xb 
+ * @param i 
+ * @param wstatus 
+ */
+void xargs_done(struct xargs_batch * xb, int i, int wstatus)
+{
+    if (wstatus != -1)
+    {
+        metrics_collect(xb->pids[i], wstatus);
+    }
+    if (xb->polls[i].fd != -1)
+    {
+        close(xb->polls[i].fd);
+    }
+    xb->npids--;
+    xb->pids[i] = xb->pids[xb->npids];
+    xb->polls[i] = xb->polls[xb->npids];
+
+    /* Use the exit codes GNU xargs reports so scripts can tell failures apart. */
+    if (wstatus == -1)
+    {
+        return;
+    }
+    if (WIFEXITED(wstatus) && (WEXITSTATUS(wstatus) == 255))
+    {
+        xb->xstatus = 124;
+    }
+    else if (WIFEXITED(wstatus) && (WEXITSTATUS(wstatus) != 0) && (xb->xstatus == 0))
+    {
+        xb->xstatus = 123;
+    }
+    else if (WIFSIGNALED(wstatus))
+    {
+        xb->xstatus = 125;
+    }
+
+    return;
+}
+
+
+/**
+ * @brief xargs_wait() blocks until one of the running xargs batches finishes and passes it to xargs_done(). It polls
+ *        the batches' pidfds, so it wakes for them alone and never reaps a background job, which is left for reap().
+ *        A batch without a pidfd is checked every 10ms instead.
+ * 
+ * @param xb 
+ */
+void xargs_wait(struct xargs_batch * xb)
+{
+    bool timed;
+    int wstatus;
+    int w;
+    int i;
+
+    while (xb->npids > 0)
+    {
+        timed = false;
+        for (i = 0; i < xb->npids; i++)
+        {
+            xb->polls[i].revents = 0;
+            timed = timed || (xb->polls[i].fd == -1);
+        }
+        if ((poll(xb->polls, xb->npids, timed ? 10 : -1) == -1) && (errno != EINTR))
+        {
+            /* Without poll() the batches can only be waited on in order. */
+            xb->polls[0].revents = POLLIN;
+        }
+
+        for (i = 0; i < xb->npids; i++)
+        {
+            if ((xb->polls[i].fd != -1) && (xb->polls[i].revents == 0))
+            {
+                continue;
+            }
+            w = waitpid(xb->pids[i], &wstatus, (xb->polls[i].revents != 0) ? 0 : WNOHANG);
+            if (w == xb->pids[i])
+            {
+                xargs_done(xb, i, wstatus);
+                return;
+            }
+            if ((w == -1) && (errno == ECHILD))
+            {
+                xargs_done(xb, i, -1);
+                return;
+            }
+        }
+    }
+
+    return;
+}
+
+
+/**
+ * @brief xargs_run() launches the command with the first count collected arguments, waiting for a running batch first if
+ *        -P batches are already going, then moves any arguments after those to the front of the pool.
+ * 
+ * @param xb 
+ * @param count 
+ */
+void xargs_run(struct xargs_batch * xb, int count)
+{
+    char ** batch = malloc(sizeof(char *) * (xb->command_argc + count + 1));
+    size_t keep_from = (count < xb->nargs) ? xb->offsets[count] : xb->pool_len;
+    int n = 0;
+    int i;
+
+    for (i = 0; i < xb->command_argc; i++)
+    {
+        batch[n++] = xb->command[i];
+    }
+    for (i = 0; i < count; i++)
+    {
+        batch[n++] = xb->pool + xb->offsets[i];
+    }
+    batch[n] = NULL;
+
+    while (xb->npids >= xb->max_procs)
+    {
+        xargs_wait(xb);
+    }
+    if ((xb->pids[xb->npids] = launch_child(batch, xb->infd)) != -1)
+    {
+        xb->polls[xb->npids].fd = (int) syscall(SYS_pidfd_open, xb->pids[xb->npids], 0);
+        xb->polls[xb->npids].events = POLLIN;
+        xb->npids++;
+    }
+    xb->ran_once = true;
+    free(batch);
+
+    /* The child has its own copy of the arguments, so the pool can be reused right away. */
+    memmove(xb->pool, xb->pool + keep_from, xb->pool_len - keep_from);
+    xb->pool_len -= keep_from;
+    xb->token_start -= keep_from;
+    for (i = count; i < xb->nargs; i++)
+    {
+        xb->offsets[i - count] = xb->offsets[i] - keep_from;
+    }
+    xb->nargs -= count;
+    xb->used = 0;
+
+    return;
+}
+
+
+/**
+ * @brief xargs_putc() appends one byte of argument text to the pool.
+ * 
+ * @param xb 
+ * @param c 
+ */
+void xargs_putc(struct xargs_batch * xb, char c)
+{
+    if (xb->pool_len + 1 > xb->pool_cap)
+    {
+        xb->pool_cap = (xb->pool_cap == 0) ? 65536 : xb->pool_cap * 2;
+        xb->pool = realloc(xb->pool, xb->pool_cap);
+    }
+    xb->pool[xb->pool_len++] = c;
+
+    return;
+}
+
+
+/**
+ * @brief xargs_end_arg() terminates the argument being read and adds it to the batch, first running the batch if the new
+ *        argument would push it past the ARG_MAX budget or the -n limit. Returns false if the argument can never fit.
+ * 
+ * @param xb 
+ * @return true 
+ * @return false 
+ */
+bool xargs_end_arg(struct xargs_batch * xb)
+{
+    long cost;
+
+    xargs_putc(xb, '\0');
+    cost = (long)(xb->pool_len - xb->token_start) + (long)sizeof(char *);
+
+    if (cost > xb->budget)
+    {
+        shell_printf("xargs: argument line too long\n");
+        xb->xstatus = 1;
+        xb->pool_len = xb->token_start;
+        return false;
+    }
+
+    if (xb->nargs == xb->cap_args)
+    {
+        xb->cap_args = (xb->cap_args == 0) ? 1024 : xb->cap_args * 2;
+        xb->offsets = realloc(xb->offsets, sizeof(size_t) * xb->cap_args);
+    }
+    xb->offsets[xb->nargs++] = xb->token_start;
+    xb->token_start = xb->pool_len;
+
+    /* Launch everything before this argument if it does not fit, and start the next batch with it. */
+    if ((xb->used + cost > xb->budget) || ((xb->max_per_batch > 0) && (xb->nargs > xb->max_per_batch)))
+    {
+        xargs_run(xb, xb->nargs - 1);
+    }
+    xb->used += cost;
+
+    return true;
+}
+
+
+/**
+ * @brief xargs_process() is the built in xargs. It reads blank separated arguments (NUL separated with -0) from stdin or
+ *        the file given with -a, packs them into the largest batch that fits under ARG_MAX (or -n per batch), and runs
+ *        the batches through launch_child() with up to -P of them at once. -r skips the command when there is no input.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void xargs_process(char ** arguments, int argc)
+{
+    /* local variables */
+    struct xargs_batch xb;
+    static char * default_command[] = { "echo", NULL };
+    bool nul_separated = false;
+    bool no_run_if_empty = false;
+    char * input_file = NULL;
+    char buf[65536];
+    char * end;
+    long number = 0;
+    ssize_t nread;
+    ssize_t k;
+    int fd = 0;
+    bool in_token = false;
+    bool escaped = false;
+    bool too_long = false;
+    char quote = '\0';
+    int i;
+
+    memset(&xb, 0, sizeof(xb));
+    xb.max_procs = 1;
+    xb.infd = -1;
+
+    /* Parse the options, which may be given as "-n 5" or "-n5". */
+    for (i = 1; i < argc; i++)
+    {
+        char * opt = arguments[i];
+        char * val = NULL;
+
+        if ((opt[0] != '-') || (opt[1] == '\0'))
+        {
+            break;
+        }
+        if (strcmp(opt, "--") == 0)
+        {
+            i++;
+            break;
+        }
+        if (strcmp(opt, "-0") == 0)
+        {
+            nul_separated = true;
+            continue;
+        }
+        if (strcmp(opt, "-r") == 0)
+        {
+            no_run_if_empty = true;
+            continue;
+        }
+
+        if ((opt[1] == 'n') || (opt[1] == 'P') || (opt[1] == 'a'))
+        {
+            val = (opt[2] != '\0') ? &opt[2] : ((i + 1 < argc) ? arguments[++i] : NULL);
+        }
+        if (val == NULL)
+        {
+            shell_printf("xargs: bad option %s\n", opt);
+            status = 1;
+            return;
+        }
+
+        /* -n takes a count of at least 1, -P one of at least 0. */
+        if ((opt[1] == 'n') || (opt[1] == 'P'))
+        {
+            errno = 0;
+            number = strtol(val, &end, 10);
+            if ((end == val) || (*end != '\0') || (errno == ERANGE) || (number < ((opt[1] == 'n') ? 1 : 0)))
+            {
+                shell_printf("xargs: -%c needs a number of at least %d, not %s\n", opt[1], (opt[1] == 'n') ? 1 : 0, val);
+                shell_printf("usage: xargs [-0] [-r] [-n max-args] [-P max-procs] [-a file] [command [arg ...]]\n");
+                status = 1;
+                return;
+            }
+        }
+
+        if (opt[1] == 'n')
+        {
+            xb.max_per_batch = number;
+        }
+        else if (opt[1] == 'P')
+        {
+            xb.max_procs = number;
+        }
+        else
+        {
+            input_file = val;
+        }
+    }
+
+    /* -P 0 means as many batches at once as xargs allows. */
+    if ((xb.max_procs <= 0) || (xb.max_procs > max_xargs_procs))
+    {
+        xb.max_procs = max_xargs_procs;
+    }
+
+    /* The command defaults to echo, like the external xargs. */
+    xb.command = (i < argc) ? &arguments[i] : default_command;
+    xb.command_argc = (i < argc) ? argc - i : 1;
+
+    /* The arguments get what is left of the exec budget after the command itself. */
+    xb.budget = exec_budget();
+    for (i = 0; i < xb.command_argc; i++)
+    {
+        xb.budget -= strlen(xb.command[i]) + 1 + sizeof(char *);
+    }
+    if (xb.budget <= 0)
+    {
+        shell_printf("xargs: environment is too large for exec\n");
+        status = 1;
+        return;
+    }
+
+    /* Open the input, and give the batches /dev/null when they would otherwise share our input. */
+    if (input_file != NULL)
+    {
+        if ((fd = open(input_file, O_RDONLY | O_CLOEXEC)) == -1)
+        {
+            shell_printf("xargs: cannot open %s\n", input_file);
+            status = 1;
+            return;
+        }
+    }
+    else
+    {
+        xb.infd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    xb.pids = malloc(sizeof(int) * xb.max_procs);
+    xb.polls = malloc(sizeof(struct pollfd) * xb.max_procs);
+
+    /* Read the input in large blocks and split it as it arrives, so batches start before the input is finished. */
+    while (!too_long && (((nread = read(fd, buf, sizeof(buf))) > 0) || ((nread == -1) && (errno == EINTR))))
+    {
+        for (k = 0; (k < nread) && !too_long; k++)
+        {
+            char c = buf[k];
+
+            if (nul_separated)
+            {
+                if (c == '\0')
+                {
+                    too_long = !xargs_end_arg(&xb);
+                    in_token = false;
+                    continue;
+                }
+            }
+            else if (escaped)
+            {
+                escaped = false;
+            }
+            else if (quote != '\0')
+            {
+                if (c == quote)
+                {
+                    quote = '\0';
+                    continue;
+                }
+            }
+            else if (c == '\\')
+            {
+                escaped = true;
+                in_token = true;
+                continue;
+            }
+            else if ((c == '\'') || (c == '"'))
+            {
+                quote = c;
+                in_token = true;
+                continue;
+            }
+            else if ((c == ' ') || (c == '\t') || (c == '\n'))
+            {
+                if (in_token)
+                {
+                    too_long = !xargs_end_arg(&xb);
+                    in_token = false;
+                }
+                continue;
+            }
+
+            xargs_putc(&xb, c);
+            in_token = true;
+        }
+    }
+
+    if (in_token && !too_long)
+    {
+        xargs_end_arg(&xb);
+    }
+
+    /* Run whatever is left over, and run the command once with no arguments if there was no input at all. */
+    if ((xb.nargs > 0) || (!xb.ran_once && !no_run_if_empty && (xb.xstatus == 0)))
+    {
+        xargs_run(&xb, xb.nargs);
+    }
+
+    /* Wait for the rest of the batches before giving the prompt back. */
+    while (xb.npids > 0)
+    {
+        xargs_wait(&xb);
+    }
+
+    if (fd != 0)
+    {
+        close(fd);
+    }
+    if (xb.infd != -1)
+    {
+        close(xb.infd);
+    }
+    free(xb.pids);
+    free(xb.polls);
+    free(xb.offsets);
+    free(xb.pool);
+
+    status = xb.xstatus;
+    return;
+}
+
+
+/**
+ * @brief prep() determines if a program should be run in the foreground or background, and calls the respective function to run the command.
+ * 
+ * @param argv 
+ * @param assigns 
+ * @param redirs 
+ * @param try_bg 
+ */
+void prep(char ** argv, char ** assigns, struct redirection * redirs, bool try_bg)
+{
+    /* If the command ended with an ampersand, and tstp is off, run the process in the background. */
+    if ((try_bg) && (!tstp))
+    {
+        background_process(argv, assigns, redirs); 
+    }
+
+    /* Otherwise, run it in the foreground. */
+    else 
+    {
+        foreground_process(argv, assigns, redirs);
+    }
+    return;
+}
+
+
+/**
+ * @brief wordvec_push() appends a word to a growable, NULL terminated word vector kept in the line arena.
+ * 
+ * @param wv 
+ * @param word 
+ */
+void wordvec_push(struct wordvec * wv, char * word)
+{
+    char ** grown;
+
+    if (wv->count + 1 >= wv->cap)
+    {
+        wv->cap = (wv->cap == 0) ? 16 : wv->cap * 2;
+        grown = arena_alloc(sizeof(char *) * wv->cap);
+        if (wv->count > 0)
+        {
+            memcpy(grown, wv->words, sizeof(char *) * wv->count);
+        }
+        wv->words = grown;
+    }
+
+    wv->words[wv->count++] = word;
+    wv->words[wv->count] = NULL;
+
+    return;
+}
+
+
+/**
+ * @brief is_operator_char() reports whether c starts an operator, which also ends any word it follows.
+ * 
+ * @param c 
+ * @return true 
+ * @return false 
+ */
+bool is_operator_char(char c)
+{
+    return (c == ';') || (c == '&') || (c == '|') || (c == '<') || (c == '>');
+}
+
+
+/**
+ * @brief match_backquote() finds the '`' closing the one at p, skipping escaped ones. Returns NULL if the line ends
+ *        first.
+ * 
+ * @param p 
+ * @return char* 
+ */
+char * match_backquote(char * p)
+{
+    for (p++; (*p != '\0') && (*p != '`'); p++)
+    {
+        if ((*p == '\\') && (p[1] != '\0'))
+        {
+            p++;
+        }
+    }
+
+    return (*p == '`') ? p : NULL;
+}
+
+
+/**
+ * @brief match_paren() finds the ')' closing the '(' at p, skipping over quotes and nested parentheses. Returns NULL if
+ *        the line ends first.
+ * 
+ * @param p 
+ * @return char* 
+ */
+char * match_paren(char * p)
+{
+    int depth = 0;
+
+    for (; *p != '\0'; p++)
+    {
+        if ((*p == '\\') && (p[1] != '\0'))
+        {
+            p++;
+        }
+        else if (*p == '\'')
+        {
+            if ((p = strchr(p + 1, '\'')) == NULL)
+            {
+                return NULL;
+            }
+        }
+        else if (*p == '"')
+        {
+            for (p++; (*p != '\0') && (*p != '"'); p++)
+            {
+                if ((*p == '\\') && (p[1] != '\0'))
+                {
+                    p++;
+                }
+            }
+            if (*p == '\0')
+            {
+                return NULL;
+            }
+        }
+        else if (*p == '`')
+        {
+            if ((p = match_backquote(p)) == NULL)
+            {
+                return NULL;
+            }
+        }
+        else if (*p == '(')
+        {
+            depth++;
+        }
+        else if ((*p == ')') && (--depth == 0))
+        {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief at_process_substitution() tells whether p starts a <(...) or >(...), which is part of a word rather than a
+ *        redirection.
+ * 
+ * @param p 
+ * @return true 
+ * @return false 
+ */
+bool at_process_substitution(const char * p)
+{
+    return ((*p == '<') || (*p == '>')) && (p[1] == '(');
+}
+
+
+/**
+ * @brief skip_command_substitution() returns the end of the $(...) or `...` starting at p, p itself when none starts
+ *        there, or NULL when it is not closed.
+ * 
+ * @param p 
+ * @return char* 
+ */
+char * skip_command_substitution(char * p)
+{
+    char * end;
+
+    if ((p[0] == '$') && (p[1] == '('))
+    {
+        end = match_paren(p + 1);
+    }
+    else if (*p == '`')
+    {
+        end = match_backquote(p);
+    }
+    else
+    {
+        return p;
+    }
+
+    return (end != NULL) ? end + 1 : NULL;
+}
+
+
+/**
+ * @brief lex_word() reads one word starting at *pos, keeping its quotes, backslashes and substitutions for the
+ *        expansion stage, and advances *pos past it. Returns NULL if a quote or parenthesis is left open.
+ * 
+ * @param pos 
+ * @return char* 
+ */
+char * lex_word(char ** pos)
+{
+    char * start = *pos;
+    char * p = start;
+    char * end;
+
+    while ((*p != '\0') && (*p != ' ') && (*p != '\t') && (*p != '\n') && (!is_operator_char(*p) || at_process_substitution(p)))
+    {
+        if (at_process_substitution(p))
+        {
+            if ((p = match_paren(p + 1)) == NULL)
+            {
+                return NULL;
+            }
+            p++;
+        }
+        else if ((end = skip_command_substitution(p)) != p)
+        {
+            if (end == NULL)
+            {
+                return NULL;
+            }
+            p = end;
+        }
+        else if (*p == '\\')
+        {
+            p += (p[1] != '\0') ? 2 : 1;
+        }
+        else if (*p == '\'')
+        {
+            p = strchr(p + 1, '\'');
+            if (p == NULL)
+            {
+                return NULL;
+            }
+            p++;
+        }
+        else if (*p == '"')
+        {
+            for (p++; (*p != '\0') && (*p != '"'); )
+            {
+                if ((*p == '\\') && (p[1] != '\0'))
+                {
+                    p += 2;
+                }
+                else if ((end = skip_command_substitution(p)) == NULL)
+                {
+                    return NULL;
+                }
+                else
+                {
+                    p = (end == p) ? p + 1 : end;
+                }
+            }
+            if (*p == '\0')
+            {
+                return NULL;
+            }
+            p++;
+        }
+        else
+        {
+            p++;
+        }
+    }
+
+    *pos = p;
+    return arena_strndup(start, p - start);
+}
+
+
+/**
+ * @brief skip_blanks() moves the parser past spaces, tabs and newlines.
+ * 
+ * @param ps 
+ */
+void skip_blanks(struct parser * ps)
+{
+    while ((*ps->p == ' ') || (*ps->p == '\t') || (*ps->p == '\n'))
+    {
+        ps->p++;
+    }
+
+    return;
+}
+
+
+/**
+ * @brief at_keyword() reports whether the parser is looking at keyword as a whole word. Keywords such as while and
+ *        done only count where a command could start.
+ * 
+ * @param ps 
+ * @param keyword 
+ * @return true 
+ * @return false 
+ */
+bool at_keyword(struct parser * ps, const char * keyword)
+{
+    size_t len = strlen(keyword);
+    char next = ps->p[len];
+
+    return (strncmp(ps->p, keyword, len) == 0)
+           && ((next == '\0') || (next == ' ') || (next == '\t') || (next == '\n') || is_operator_char(next));
+}
+
+
+/**
+ * @brief syntax_error() reports a syntax error and marks the parse as failed.
+ * 
+ * @param ps 
+ * @param message 
+ */
+void syntax_error(struct parser * ps, const char * message)
+{
+    if (!ps->error)
+    {
+        shell_printf("Syntax error: %s.\n", message);
+    }
+    ps->error = true;
+
+    return;
+}
+
+
+/**
+ * @brief lex_list() parses commands into the list until it reaches the keyword stop at the start of a command, which it
+ *        consumes, or the end of the line when stop is NULL. A while or until loop becomes one command whose condition
+ *        and body are the commands stored right after it; its end field skips over them. Returns false on an error.
+ * 
+ * @param ps 
+ * @param stop 
+ * @return true 
+ * @return false 
+ */
+bool lex_list(struct parser * ps, const char * stop)
+{
+    struct command_list * list = ps->list;
+    struct command * cmd;
+    int index;
+    int type;
+    bool strip;
+    char * word;
+
+    while (1)
+    {
+        skip_blanks(ps);
+
+        /* The line is over at its end or at a comment. */
+        if ((*ps->p == '\0') || (*ps->p == '#'))
+        {
+            if (stop != NULL)
+            {
+                syntax_error(ps, (strcmp(stop, "do") == 0) ? "missing \"do\"" : "missing \"done\"");
+                return false;
+            }
+            return true;
+        }
+
+        if ((stop != NULL) && at_keyword(ps, stop))
+        {
+            ps->p += strlen(stop);
+            return true;
+        }
+
+        index = list->num_commands++;
+        cmd = &list->commands[index];
+        memset(cmd, 0, sizeof(struct command));
+        cmd->type = CMD_SIMPLE;
+
+        /* A loop holds its condition and then its body as nested lists. */
+        if (at_keyword(ps, "while") || at_keyword(ps, "until"))
+        {
+            cmd->type = (*ps->p == 'w') ? CMD_WHILE : CMD_UNTIL;
+            ps->p += 5;
+
+            if (!lex_list(ps, "do"))
+            {
+                return false;
+            }
+            cmd->body = list->num_commands;
+            if (cmd->body == index + 1)
+            {
+                syntax_error(ps, "loop without a condition");
+                return false;
+            }
+
+            if (!lex_list(ps, "done"))
+            {
+                return false;
+            }
+            if (list->num_commands == cmd->body)
+            {
+                syntax_error(ps, "loop without a body");
+                return false;
+            }
+        }
+
+        /* A for loop's variable and words are its own words, ahead of its body's. */
+        else if (at_keyword(ps, "for"))
+        {
+            cmd->type = CMD_FOR;
+            cmd->first_word = ps->num_words;
+            ps->p += 3;
+            skip_blanks(ps);
+            if (((word = lex_word(&ps->p)) == NULL) || !valid_name(word, strlen(word)))
+            {
+                syntax_error(ps, "bad for loop variable");
+                return false;
+            }
+            list->words[ps->num_words++] = word;
+
+            skip_blanks(ps);
+            if (!at_keyword(ps, "in"))
+            {
+                syntax_error(ps, "missing \"in\"");
+                return false;
+            }
+            ps->p += 2;
+
+            while (1)
+            {
+                skip_blanks(ps);
+                if ((*ps->p == '\0') || (*ps->p == '#') || (*ps->p == ';'))
+                {
+                    break;
+                }
+                if ((is_operator_char(*ps->p) && !at_process_substitution(ps->p)) || ((word = lex_word(&ps->p)) == NULL))
+                {
+                    syntax_error(ps, "bad word in for loop");
+                    return false;
+                }
+                list->words[ps->num_words++] = word;
+            }
+            cmd->num_words = ps->num_words - cmd->first_word;
+
+            ps->p += (*ps->p == ';') ? 1 : 0;
+            skip_blanks(ps);
+            if (!at_keyword(ps, "do"))
+            {
+                syntax_error(ps, "missing \"do\"");
+                return false;
+            }
+            ps->p += 2;
+
+            cmd->body = list->num_commands;
+            if (!lex_list(ps, "done"))
+            {
+                return false;
+            }
+            if (list->num_commands == cmd->body)
+            {
+                syntax_error(ps, "loop without a body");
+                return false;
+            }
+        }
+
+        /* Collect the command's words and redirections. A loop may only be followed by redirections. */
+        if (cmd->type != CMD_FOR)
+        {
+            cmd->first_word = ps->num_words;
+        }
+        cmd->first_redir = ps->num_redirs;
+
+        while (1)
+        {
+            skip_blanks(ps);
+
+            if (((*ps->p == '<') || (*ps->p == '>')) && !at_process_substitution(ps->p))
+            {
+                strip = false;
+                if (strncmp(ps->p, "<<<", 3) == 0)
+                {
+                    type = TOK_HERESTRING;
+                    ps->p += 3;
+                }
+                else if (strncmp(ps->p, "<<", 2) == 0)
+                {
+                    type = TOK_HEREDOC;
+                    strip = (ps->p[2] == '-');
+                    ps->p += strip ? 3 : 2;
+                }
+                else
+                {
+                    type = (*ps->p == '<') ? TOK_LESS : TOK_GREAT;
+                    ps->p++;
+                }
+                skip_blanks(ps);
+                if ((*ps->p == '\0') || (is_operator_char(*ps->p) && !at_process_substitution(ps->p))
+                    || ((word = lex_word(&ps->p)) == NULL))
+                {
+                    syntax_error(ps, (type == TOK_HEREDOC) ? "here-document without a delimiter" : "redirection without a file");
+                    return false;
+                }
+
+                /* A here-document's body comes from the lines after this one, so for now the target is its delimiter. */
+                if (type == TOK_HEREDOC)
+                {
+                    ps->heredocs[ps->num_heredocs] = ps->num_redirs;
+                    ps->strip_tabs[ps->num_heredocs] = strip;
+                    ps->num_heredocs++;
+                }
+                list->redirs[ps->num_redirs].type = type;
+                list->redirs[ps->num_redirs].target = word;
+                list->redirs[ps->num_redirs].dest = (type == TOK_GREAT) ? 1 : 0;
+                list->redirs[ps->num_redirs].fd = -1;
+                ps->num_redirs++;
+                cmd->num_redirs++;
+                continue;
+            }
+
+            if ((*ps->p == '\0') || (*ps->p == '#') || (is_operator_char(*ps->p) && !at_process_substitution(ps->p)))
+            {
+                break;
+            }
+
+            if (cmd->type != CMD_SIMPLE)
+            {
+                syntax_error(ps, "unexpected word after \"done\"");
+                return false;
+            }
+
+            if ((word = lex_word(&ps->p)) == NULL)
+            {
+                syntax_error(ps, "unterminated quote or parenthesis");
+                return false;
+            }
+            list->words[ps->num_words++] = word;
+            cmd->num_words++;
+        }
+        cmd->end = list->num_commands;
+
+        if ((cmd->type == CMD_SIMPLE) && (cmd->num_words == 0) && (cmd->num_redirs == 0))
+        {
+            if (*ps->p == '|')
+            {
+                syntax_error(ps, "pipelines are not supported");
+            }
+            else
+            {
+                syntax_error(ps, "missing command");
+            }
+            return false;
+        }
+
+        /* Work out which operator joins this command to the next one. */
+        cmd->connector = TOK_SEMI;
+        if ((ps->p[0] == '&') && (ps->p[1] == '&'))
+        {
+            cmd->connector = TOK_AND;
+        }
+        else if ((ps->p[0] == '|') && (ps->p[1] == '|'))
+        {
+            cmd->connector = TOK_OR;
+        }
+        else if (ps->p[0] == '&')
+        {
+            cmd->connector = TOK_AMP;
+        }
+        else if (ps->p[0] == '|')
+        {
+            syntax_error(ps, "pipelines are not supported");
+            return false;
+        }
+        ps->p += ((cmd->connector == TOK_AND) || (cmd->connector == TOK_OR)) ? 2 : ((*ps->p == '\0') || (*ps->p == '#')) ? 0 : 1;
+
+        /* "&&" and "||" need a command after them. */
+        if ((cmd->connector == TOK_AND) || (cmd->connector == TOK_OR))
+        {
+            skip_blanks(ps);
+            if ((*ps->p == '\0') || (*ps->p == '#') || ((stop != NULL) && at_keyword(ps, stop)))
+            {
+                syntax_error(ps, "missing command");
+                return false;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief heredoc_delimiter() removes the quotes and backslashes from a here-document's delimiter word. Any quoting at
+ *        all sets quoted, which keeps the body from being expanded.
+ * 
+ * @param word 
+ * @param quoted 
+ * @return char* 
+ */
+char * heredoc_delimiter(char * word, bool * quoted)
+{
+    char * delim = arena_alloc(strlen(word) + 1);
+    char * out = delim;
+    char * p;
+
+    *quoted = false;
+    for (p = word; *p != '\0'; p++)
+    {
+        if ((*p == '\'') || (*p == '"'))
+        {
+            *quoted = true;
+            continue;
+        }
+        if ((*p == '\\') && (p[1] != '\0'))
+        {
+            *quoted = true;
+            p++;
+        }
+        *out++ = *p;
+    }
+    *out = '\0';
+
+    return delim;
+}
+
+
+/**
+ * @brief read_heredoc() reads the body of a here-document from the input, up to a line holding only delim. With
+ *        strip_tabs, leading tabs are removed from every line, the delimiter's included. Running out of input ends the
+ *        body with a warning.
+ * 
+ * @param delim 
+ * @param strip_tabs 
+ * @return char* 
+ */
+char * read_heredoc(const char * delim, bool strip_tabs)
+{
+    static char * line = NULL;
+    static size_t line_cap = 0;
+    char * body = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    ssize_t nread;
+    char * text;
+    char * result;
+
+    while (1)
+    {
+        if (isatty(0))
+        {
+            out_add("> ", 2);
+            out_flush(STDOUT_FILENO);
+        }
+
+        if ((nread = getline(&line, &line_cap, stdin)) == -1)
+        {
+            shell_printf("Here-document ended before \"%s\"\n", delim);
+            break;
+        }
+
+        text = line;
+        if (strip_tabs)
+        {
+            while (*text == '\t')
+            {
+                text++;
+                nread--;
+            }
+        }
+        if ((strncmp(text, delim, strlen(delim)) == 0) && ((text[strlen(delim)] == '\n') || (text[strlen(delim)] == '\0')))
+        {
+            break;
+        }
+
+        if (len + nread >= cap)
+        {
+            cap = (len + nread) * 2 + 256;
+            body = realloc(body, cap);
+        }
+        memcpy(body + len, text, nread);
+        len += nread;
+    }
+
+    result = arena_strndup((len > 0) ? body : "", len);
+    free(body);
+    return result;
+}
+
+
+/**
+ * @brief lex_line() splits a line into a command list: every command's words and redirections go into flat arrays, and
+ *        each command records the operator (";", "&&", "||" or "&") that joins it to the next. The bodies of any
+ *        here-documents are then read from the input. Prints the error and returns false on a syntax error.
+ * 
+ * @param line 
+ * @param list 
+ * @return true 
+ * @return false 
+ */
+bool lex_line(char * line, struct command_list * list)
+{
+    size_t slots = strlen(line) + 2;   // no line holds more words, redirections or commands than it has characters
+    struct parser ps;
+    struct redirection * redir;
+    char * delim;
+    bool quoted;
+    bool ok;
+    int i;
+
+    list->words = arena_alloc(sizeof(char *) * slots);
+    list->redirs = arena_alloc(sizeof(struct redirection) * slots);
+    list->commands = arena_alloc(sizeof(struct command) * slots);
+    list->num_commands = 0;
+
+    ps.p = line;
+    ps.list = list;
+    ps.num_words = 0;
+    ps.num_redirs = 0;
+    ps.heredocs = arena_alloc(sizeof(int) * slots);
+    ps.strip_tabs = arena_alloc(sizeof(bool) * slots);
+    ps.num_heredocs = 0;
+    ps.error = false;
+
+    ok = lex_list(&ps, NULL) && !ps.error;
+    list->num_redirs = ps.num_redirs;
+
+    /* Here-document bodies follow the line in the order their redirections appear. One without a quoted delimiter
+       and with nothing to expand in it is as constant as a quoted one, so it can be kept once it is made. */
+    for (i = 0; i < ps.num_heredocs; i++)
+    {
+        redir = &list->redirs[ps.heredocs[i]];
+        delim = heredoc_delimiter(redir->target, &quoted);
+        redir->target = read_heredoc(delim, ps.strip_tabs[i]);
+        if (quoted || (strpbrk(redir->target, "$\\`") == NULL))
+        {
+            redir->type = TOK_HEREDOC_LITERAL;
+        }
+    }
+
+    return ok;
+}
+
+
+/* Command and process substitutions run commands while a line is being expanded. */
+void parse(char * line);
+void run_list(struct command_list * list);
+void execute_command(struct command_list * list, struct command * cmd, bool background);
+struct builtin * find_builtin(const char * name);
+char * expand_string(char * raw);
+
+
+/**
+ * @brief read_fd_text() reads fd to its end into the line arena, dropping any newlines at the end, the way command
+ *        substitution does. The buffer starts at the file's size when it has one and grows as needed.
+ * 
+ * @param fd 
+ * @return char* 
+ */
+char * read_fd_text(int fd)
+{
+    struct stat st;
+    char * buf;
+    char * text;
+    size_t cap = 4096;
+    size_t len = 0;
+    ssize_t n;
+
+    if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0))
+    {
+        cap = st.st_size + 1;
+    }
+    buf = malloc(cap);
+
+    while (1)
+    {
+        if (len == cap)
+        {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        if ((n = read(fd, buf + len, cap - len)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        len += n;
+    }
+
+    while ((len > 0) && (buf[len - 1] == '\n'))
+    {
+        len--;
+    }
+    text = arena_strndup(buf, len);
+    free(buf);
+
+    return text;
+}
+
+
+/**
+ * @brief command_substitution() runs the commands of a $(...) or `...` and returns what they wrote, without its
+ *        trailing newlines. $(<file) just reads the file. A single built in that changes nothing in the shell runs
+ *        in the shell with its output going to a memfd. Anything else runs in a forked child writing into a pipe. The
+ *        status is that of the commands.
+ * 
+ * @param inner 
+ * @return char* 
+ */
+char * command_substitution(char * inner)
+{
+    struct command_list list;
+    struct command * cmd;
+    struct builtin * builtin;
+    struct redirection * redir;
+    char * text = "";
+    long long forking;
+    int pipefd[2];
+    int saved;
+    int wstatus;
+    int spawn_pid;
+    int fd;
+    bool failed;
+
+    substituted = true;
+    if (!lex_line(inner, &list))
+    {
+        status = 2;
+        return text;
+    }
+    if (list.num_commands == 0)
+    {
+        return text;
+    }
+    cmd = &list.commands[0];
+    redir = &list.redirs[cmd->first_redir];
+
+    /* $(<file) */
+    if ((list.num_commands == 1) && (cmd->type == CMD_SIMPLE) && (cmd->num_words == 0) && (cmd->num_redirs == 1)
+        && (redir->type == TOK_LESS))
+    {
+        if ((fd = open(expand_string(redir->target), O_RDONLY | O_CLOEXEC)) == -1)
+        {
+            shell_printf("Input redirection error!\n");
+            status = 1;
+            return text;
+        }
+        text = read_fd_text(fd);
+        close(fd);
+        status = 0;
+        return text;
+    }
+
+    /* A built in on its own runs here, with stdout swapped for a memfd while it does. */
+    if ((list.num_commands == 1) && (cmd->type == CMD_SIMPLE) && (cmd->num_words > 0) && (cmd->connector != TOK_AMP)
+        && ((builtin = find_builtin(list.words[cmd->first_word])) != NULL) && builtin->subshell_safe
+        && ((fd = memfd_create("smallsh-subst", MFD_CLOEXEC)) != -1))
+    {
+        out_flush(STDOUT_FILENO);
+        saved = fcntl(1, F_DUPFD_CLOEXEC, 10);
+        dup3(fd, 1, 0);
+        fd_generation++;
+
+        failed = expansion_failed;
+        execute_command(&list, cmd, false);
+        substituted = true;
+        expansion_failed = failed;
+
+        out_flush(STDOUT_FILENO);
+        dup3(saved, 1, 0);
+        close(saved);
+        fd_generation++;
+
+        lseek(fd, 0, SEEK_SET);
+        text = read_fd_text(fd);
+        close(fd);
+        return text;
+    }
+
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+    {
+        shell_printf("Pipe error!\n");
+        status = 1;
+        return text;
+    }
+
+    out_flush(STDOUT_FILENO);
+    trace_begin("fork", NULL);
+    forking = (metrics_file != NULL) ? trace_now() : 0;
+    spawn_pid = fork();
+
+    switch (spawn_pid)
+    {
+        case -1: // Fork Failed.
+            trace_end("fork");
+            shell_printf("Fork() failed.\n");
+            close(pipefd[0]);
+            close(pipefd[1]);
+            status = 1;
+            return text;
+
+        case 0: // Child process. Ignores SIGTSTP and runs the commands into the pipe.
+            signal(SIGTSTP, SIG_IGN);
+            if (dup2(pipefd[1], 1) == -1)
+            {
+                shell_printf("Dup2 Error!\n");
+                child_exit(1);
+            }
+            run_list(&list);
+            child_exit(last_status());
+            break;
+
+        default: // Parent process. Drains the pipe, then waits for the child's status.
+            trace_end("fork");
+            metrics_fork(forking);
+            close(pipefd[1]);
+            text = read_fd_text(pipefd[0]);
+            close(pipefd[0]);
+
+            while ((waitpid(spawn_pid, &wstatus, 0) == -1) && (errno == EINTR))
+            {
+            }
+            status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+            metrics_collect(spawn_pid, wstatus);
+            break;
+    }
+
+    return text;
+}
+
+
+/**
+ * @brief expand_parameter() expands the $ expansion or `...` at *pos and moves *pos past it. The value is a
+ *        variable's, the output of a command substitution, or is written into numbuf for $$, $? and $(( )). Returns NULL,
+ *        leaving *pos alone, when the $ starts no expansion.
+ * 
+ * @param pos 
+ * @param numbuf 
+ * @return const char* 
+ */
+const char * expand_parameter(char ** pos, char * numbuf)
+{
+    char * p = *pos;
+    struct variable * var;
+    size_t name_len;
+    const char * value;
+    char * end;
+    char * inner;
+    size_t len;
+
+    if ((p[1] == '$') || (p[1] == '?'))
+    {
+        sprintf(numbuf, "%d", (p[1] == '$') ? shell_pid : last_status());
+        *pos = p + 2;
+        return numbuf;
+    }
+
+    if ((p[0] == '$') && (p[1] == '('))
+    {
+        end = match_paren(p + 1);
+        *pos = end + 1;
+
+        /* $((...)) is arithmetic when its inner parentheses close right before the outer ones. Its text gets $
+           expansions and quote removal first. */
+        if ((p[2] == '(') && (match_paren(p + 2) == end - 1))
+        {
+            inner = arena_strndup(p + 3, (end - 1) - (p + 3));
+            if (strpbrk(inner, "$`'\"\\") != NULL)
+            {
+                inner = expand_string(inner);
+            }
+            if ((value = arithmetic(inner, numbuf)) == NULL)
+            {
+                expansion_failed = true;
+                return "";
+            }
+            return value;
+        }
+
+        return command_substitution(arena_strndup(p + 2, end - (p + 2)));
+    }
+
+    /* Inside backquotes a backslash only escapes $, ` and another backslash. */
+    if (p[0] == '`')
+    {
+        end = match_backquote(p);
+        inner = arena_alloc(end - p);
+        for (len = 0, p++; p < end; p++)
+        {
+            if ((*p == '\\') && (strchr("$`\\", p[1]) != NULL) && (p + 1 < end))
+            {
+                p++;
+            }
+            inner[len++] = *p;
+        }
+        inner[len] = '\0';
+        *pos = end + 1;
+        return command_substitution(inner);
+    }
+
+    if (p[1] == '{')
+    {
+        name_len = strcspn(p + 2, "}");
+        if (!valid_name(p + 2, name_len) || (p[2 + name_len] != '}'))
+        {
+            return NULL;
+        }
+        var = find_var(p + 2, name_len);
+        *pos = p + name_len + 3;
+        return (var != NULL) ? var->entry + name_len + 1 : "";
+    }
+
+    if (!isalpha((unsigned char)p[1]) && (p[1] != '_'))
+    {
+        return NULL;
+    }
+    for (name_len = 1; isalnum((unsigned char)p[1 + name_len]) || (p[1 + name_len] == '_'); name_len++)
+    {
+    }
+    var = find_var(p + 1, name_len);
+    *pos = p + name_len + 1;
+    return (var != NULL) ? var->entry + name_len + 1 : "";
+}
+
+
+/**
+ * @brief process_substitution() starts the command of the <(...) or >(...) at *pos in a child, joined to the shell by a
+ *        pipe, and moves *pos past it. The child writes to the pipe for <(...) and reads from it for >(...). The shell's
+ *        end of the pipe is named in path as /dev/fd/N, for the command being expanded to open. The job goes into the
+ *        bchildren table like a background one. path is left empty if no job could be started.
+ * 
+ * @param pos 
+ * @param path 
+ */
+void process_substitution(char ** pos, char * path)
+{
+    char * p = *pos;
+    char * end = match_paren(p + 1);
+    bool reads = (*p == '<');     // whether the command reads the job's output
+    char * inner;
+    long long forking;
+    int pipefd[2];
+    int spawn_pid;
+    int i;
+
+    *pos = end + 1;
+    path[0] = '\0';
+
+    if (num_procsubst == max_procsubst)
+    {
+        shell_printf("Too many process substitutions!\n");
+        return;
+    }
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+    {
+        shell_printf("Pipe error!\n");
+        return;
+    }
+    inner = arena_strndup(p + 2, end - (p + 2));
+
+    out_flush(STDOUT_FILENO);
+    trace_begin("fork", NULL);
+    forking = (metrics_file != NULL) ? trace_now() : 0;
+    spawn_pid = fork();
+
+    switch (spawn_pid)
+    {
+        case -1: // Fork Failed.
+            trace_end("fork");
+            shell_printf("Fork() failed.\n");
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return;
+
+        case 0: // Child process. Ignores SIGTSTP and runs the command with its end of the pipe.
+            signal(SIGTSTP, SIG_IGN);
+
+            /* The pipes of other substitutions are not this job's, and a reader waiting on one of them would never see
+               its end while this job held it open. */
+            for (i = 0; i < num_procsubst; i++)
+            {
+                close(procsubst_fds[i]);
+            }
+            num_procsubst = 0;
+            procsubst_start = 0;
+
+            if (dup2(pipefd[reads ? 1 : 0], reads ? 1 : 0) == -1)
+            {
+                shell_printf("Dup2 Error!\n");
+                child_exit(1);
+            }
+            close(pipefd[0]);
+            close(pipefd[1]);
+
+            parse(inner);
+            child_exit(last_status());
+            break;
+
+        default: // Parent process. Keeps the other end for the command and tracks the job.
+            trace_end("fork");
+            metrics_fork(forking);
+            close(pipefd[reads ? 1 : 0]);
+            add_bchild(spawn_pid);
+            break;
+    }
+
+    procsubst_fds[num_procsubst] = pipefd[reads ? 0 : 1];
+    procsubst_pids[num_procsubst] = spawn_pid;
+    num_procsubst++;
+    sprintf(path, "/dev/fd/%d", pipefd[reads ? 0 : 1]);
+
+    return;
+}
+
+
+/**
+ * @brief close_process_substitutions() closes the shell's ends of the pipes made from entry from on, once the command
+ *        they were made for is done with them, and waits on the jobs that have already finished. Jobs still running
+ *        are left to reap() like background ones.
+ * 
+ * @param from 
+ */
+void close_process_substitutions(int from)
+{
+    int wstatus;
+    int i;
+
+    for (i = from; i < num_procsubst; i++)
+    {
+        close(procsubst_fds[i]);
+        if (waitpid(procsubst_pids[i], &wstatus, WNOHANG) > 0)
+        {
+            metrics_collect(procsubst_pids[i], wstatus);
+            remove_bchild(procsubst_pids[i]);
+        }
+    }
+    num_procsubst = from;
+
+    return;
+}
+
+
+/**
+ * @brief glob_unescape() removes, in place, the backslashes expand_word() puts before quoted pattern characters, for
+ *        a word that is not expanded as a pattern after all. Returns the new length.
+ * 
+ * @param s 
+ * @param len 
+ * @return size_t 
+ */
+size_t glob_unescape(char * s, size_t len)
+{
+    size_t i;
+    size_t j = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        if ((s[i] == '\\') && (i + 1 < len))
+        {
+            i++;
+        }
+        s[j++] = s[i];
+    }
+    s[j] = '\0';
+
+    return j;
+}
+
+
+/**
+ * @brief glob_set() compiles the bracket expression starting just after a '[' into a bitmap of the bytes it accepts,
+ *        with ranges, [:class:] names and a leading ! or ^ to negate it. Returns the end of the expression, or NULL
+ *        if it has no closing ']', in which case the '[' is an ordinary character.
+ * 
+ * @param p 
+ * @param end 
+ * @param set 
+ * @return const char* 
+ */
+const char * glob_set(const char * p, const char * end, uint8_t * set)
+{
+    static const char * class_names[] = { "alnum", "alpha", "blank", "cntrl", "digit", "graph", "lower", "print",
+                                          "punct", "space", "upper", "xdigit", NULL };
+    static int (* const class_tests[])(int) = { isalnum, isalpha, isblank, iscntrl, isdigit, isgraph, islower,
+                                                isprint, ispunct, isspace, isupper, isxdigit };
+    const char * start;
+    const char * close;
+    bool negate = false;
+    unsigned char c;
+    unsigned char last;
+    int i;
+
+    memset(set, 0, 32);
+    if ((p < end) && ((*p == '!') || (*p == '^')))
+    {
+        negate = true;
+        p++;
+    }
+
+    /* A ']' right at the start is one of the characters rather than the end. */
+    for (start = p; (p < end) && ((*p != ']') || (p == start)); )
+    {
+        if ((*p == '[') && (p + 1 < end) && (p[1] == ':') && ((close = strstr(p + 2, ":]")) != NULL) && (close < end))
+        {
+            for (i = 0; class_names[i] != NULL; i++)
+            {
+                if ((strlen(class_names[i]) == (size_t) (close - p - 2)) && (strncmp(p + 2, class_names[i], close - p - 2) == 0))
+                {
+                    for (c = 1; c != 0; c++)
+                    {
+                        if (class_tests[i](c))
+                        {
+                            set[c >> 3] |= 1 << (c & 7);
+                        }
+                    }
+                }
+            }
+            p = close + 2;
+            continue;
+        }
+
+        if ((*p == '\\') && (p + 1 < end))
+        {
+            p++;
+        }
+        c = *p++;
+        last = c;
+        if ((p + 1 < end) && (*p == '-') && (p[1] != ']'))
+        {
+            p += ((p[1] == '\\') && (p + 2 < end)) ? 2 : 1;
+            last = *p++;
+        }
+        for (i = c; i <= last; i++)
+        {
+            set[i >> 3] |= 1 << (i & 7);
+        }
+    }
+
+    if (p >= end)
+    {
+        return NULL;
+    }
+    if (negate)
+    {
+        for (i = 0; i < 32; i++)
+        {
+            set[i] = ~set[i];
+        }
+    }
+
+    return p + 1;
+}
+
+
+/**
+ * @brief glob_compile() compiles one path component of a pattern into steps for glob_match(). Returns false when the
+ *        component has no unescaped *, ? or [...] and so only names itself.
+ * 
+ * @param p 
+ * @param len 
+ * @param m 
+ * @return true 
+ * @return false 
+ */
+bool glob_compile(const char * p, size_t len, struct glob_matcher * m)
+{
+    const char * end = p + len;
+    const char * after;
+    char * text = arena_alloc(len + 1);   // the literal runs, back to back
+    size_t text_len = 0;
+    uint8_t * set = NULL;
+    struct glob_step * step = NULL;
+    bool active = false;
+
+    m->steps = arena_alloc(sizeof(struct glob_step) * (len + 1));
+    m->num_steps = 0;
+    m->min_len = 0;
+    m->dot = (*p == '.');
+
+    while (p < end)
+    {
+        if (*p == '*')
+        {
+            if ((step == NULL) || (step->op != GOP_STAR))
+            {
+                step = &m->steps[m->num_steps++];
+                step->op = GOP_STAR;
+            }
+            active = true;
+            p++;
+            continue;
+        }
+        if (*p == '?')
+        {
+            step = &m->steps[m->num_steps++];
+            step->op = GOP_ANY;
+            m->min_len++;
+            active = true;
+            p++;
+            continue;
+        }
+        if (*p == '[')
+        {
+            if (set == NULL)
+            {
+                set = arena_alloc(32);
+            }
+            if ((after = glob_set(p + 1, end, set)) != NULL)
+            {
+                step = &m->steps[m->num_steps++];
+                step->op = GOP_SET;
+                step->set = set;
+                set = NULL;
+                m->min_len++;
+                active = true;
+                p = after;
+                continue;
+            }
+        }
+
+        /* Anything else, escaped or not, is literal text, joined to the run before it. */
+        if ((*p == '\\') && (p + 1 < end))
+        {
+            p++;
+        }
+        if ((step == NULL) || (step->op != GOP_TEXT))
+        {
+            step = &m->steps[m->num_steps++];
+            step->op = GOP_TEXT;
+            step->text = text + text_len;
+            step->len = 0;
+        }
+        text[text_len++] = *p++;
+        step->len++;
+        m->min_len++;
+    }
+
+    return active;
+}
+
+
+/**
+ * @brief glob_match() matches a name against a compiled pattern. A * that is followed by a failed match is moved on
+ *        one character at a time; only the last * ever needs to be retried, so this stays linear in practice. Names
+ *        that cannot fit the pattern's fixed first and last text are turned away before that.
+ * 
+ * @param m 
+ * @param name 
+ * @param len 
+ * @return true 
+ * @return false 
+ */
+bool glob_match(struct glob_matcher * m, const char * name, size_t len)
+{
+    struct glob_step * st = &m->steps[0];
+    struct glob_step * last = &m->steps[m->num_steps - 1];
+    int s = 0;
+    int star = -1;                // step after the last * passed, where a retry resumes
+    size_t n = 0;
+    size_t star_n = 0;            // where in the name the last * stopped taking characters
+    bool ok;
+
+    if ((len < m->min_len) ||
+        ((st->op == GOP_TEXT) && (memcmp(name, st->text, st->len) != 0)) ||
+        ((last->op == GOP_TEXT) && (memcmp(name + len - last->len, last->text, last->len) != 0)))
+    {
+        return false;
+    }
+
+    while (1)
+    {
+        if (s < m->num_steps)
+        {
+            st = &m->steps[s];
+            if (st->op == GOP_STAR)
+            {
+                star = ++s;
+                star_n = n;
+                continue;
+            }
+            if (n < len)
+            {
+                ok = (st->op == GOP_ANY) ||
+                     ((st->op == GOP_SET) && (st->set[(unsigned char) name[n] >> 3] & (1 << (name[n] & 7)))) ||
+                     ((st->op == GOP_TEXT) && (n + st->len <= len) && (memcmp(name + n, st->text, st->len) == 0));
+                if (ok)
+                {
+                    n += (st->op == GOP_TEXT) ? st->len : 1;
+                    s++;
+                    continue;
+                }
+            }
+        }
+        else if (n == len)
+        {
+            return true;
+        }
+
+        if ((star < 0) || (star_n >= len))
+        {
+            return false;
+        }
+        s = star;
+        n = ++star_n;
+    }
+}
+
+
+/**
+ * @brief read_listing() returns the names in a directory. A listing read before is used again while the directory
+ *        keeps its device, inode and mtime and the listing is younger than dir_cache_ttl_ms; otherwise the directory
+ *        is read again with getdents64() in batches of dirent_batch_size bytes. Returns NULL if it cannot be read.
+ *        A listing that is not cached belongs to the caller, who frees it.
+ * 
+ * @param dir 
+ * @return struct dir_listing* 
+ */
+struct dir_listing * read_listing(const char * dir)
+{
+    struct dir_listing * listing;
+    struct dir_listing ** slot;
+    struct dirent64 * d;
+    struct timespec now;
+    struct timespec wall;
+    struct stat st;
+    size_t name_len;
+    size_t grown;
+    ssize_t got;
+    ssize_t pos;
+    long age_ms;
+    int fd;
+
+    if ((stat(dir, &st) == -1) || !S_ISDIR(st.st_mode))
+    {
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (dir_cache == NULL)
+    {
+        dir_cache = private_map(sizeof(struct dir_listing *) * 64, true);
+        dirent_batch = private_map(dirent_batch_size, true);
+    }
+    slot = &dir_cache[(st.st_dev ^ st.st_ino) & 63];
+    listing = *slot;
+    if ((listing != NULL) && (listing->dev == st.st_dev) && (listing->ino == st.st_ino) &&
+        (listing->mtime.tv_sec == st.st_mtim.tv_sec) && (listing->mtime.tv_nsec == st.st_mtim.tv_nsec))
+    {
+        age_ms = (now.tv_sec - listing->read_at.tv_sec) * 1000 + (now.tv_nsec - listing->read_at.tv_nsec) / 1000000;
+        if (age_ms < dir_cache_ttl_ms)
+        {
+            return listing;
+        }
+    }
+
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    {
+        return NULL;
+    }
+
+    /* The mtime is taken before reading, so a change made while reading shows up as a different mtime next time. */
+    fstat(fd, &st);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    listing = calloc(1, sizeof(struct dir_listing));
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->read_at = now;
+
+    while ((got = getdents64(fd, dirent_batch, dirent_batch_size)) > 0)
+    {
+        for (pos = 0; pos < got; pos += d->d_reclen)
+        {
+            d = (struct dirent64 *) (dirent_batch + pos);
+            if ((d->d_name[0] == '.') && ((d->d_name[1] == '\0') || ((d->d_name[1] == '.') && (d->d_name[2] == '\0'))))
+            {
+                continue;
+            }
+            name_len = strlen(d->d_name);
+            if (listing->size + name_len + 2 > listing->cap)
+            {
+                grown = (listing->cap == 0) ? 4096 : listing->cap * 2;
+                grown = (grown < listing->size + name_len + 2) ? listing->size + name_len + 2 : grown;
+                listing->entries = private_remap(listing->entries, listing->cap, grown);
+                listing->cap = grown;
+            }
+            listing->entries[listing->size++] = d->d_type;
+            memcpy(listing->entries + listing->size, d->d_name, name_len + 1);
+            listing->size += name_len + 1;
+            listing->count++;
+        }
+    }
+    close(fd);
+
+    /* Directory timestamps move in clock ticks, so one changed in the same tick it was read in could change again
+       without its mtime moving. Only listings read well after the last change are kept. */
+    age_ms = (wall.tv_sec - st.st_mtim.tv_sec) * 1000 + (wall.tv_nsec - st.st_mtim.tv_nsec) / 1000000;
+    if ((listing->size <= dir_cache_max) && (age_ms >= 20))
+    {
+        if (*slot != NULL)
+        {
+            private_unmap((*slot)->entries, (*slot)->cap);
+            free(*slot);
+        }
+        listing->cached = true;
+        *slot = listing;
+    }
+
+    return listing;
+}
+
+
+/**
+ * @brief walk_strdup() copies the parts of a path into the worker's own string chunks, which the threads of a walk
+ *        can fill without taking turns. Returns NULL when the walk has gone over its memory cap.
+ * 
+ * @param w 
+ * @param a 
+ * @param b 
+ * @param c 
+ * @return char* 
+ */
+char * walk_strdup(struct glob_worker * w, const char * a, const char * b, const char * c)
+{
+    size_t a_len = strlen(a);
+    size_t b_len = strlen(b);
+    size_t c_len = strlen(c);
+    size_t need = a_len + b_len + c_len + 1;
+    char * next;
+    char * s;
+
+    if (__atomic_add_fetch(&w->walk->bytes, need + sizeof(char *), __ATOMIC_RELAXED) > glob_max_bytes)
+    {
+        __atomic_store_n(&w->walk->overflow, true, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    if ((w->chunk == NULL) || (w->chunk_used + need > glob_chunk_size))
+    {
+        next = malloc(glob_chunk_size);
+        memcpy(next, &w->chunk, sizeof(char *));
+        w->chunk = next;
+        w->chunk_used = sizeof(char *);
+    }
+
+    s = w->chunk + w->chunk_used;
+    memcpy(s, a, a_len);
+    memcpy(s + a_len, b, b_len);
+    memcpy(s + a_len + b_len, c, c_len + 1);
+    w->chunk_used += need;
+
+    return s;
+}
+
+
+/**
+ * @brief walk_result() adds a path to the worker's results.
+ * 
+ * @param w 
+ * @param path 
+ */
+void walk_result(struct glob_worker * w, char * path)
+{
+    if (w->num_results == w->results_cap)
+    {
+        w->results_cap = (w->results_cap == 0) ? 1024 : w->results_cap * 2;
+        w->results = realloc(w->results, sizeof(char *) * w->results_cap);
+    }
+    w->results[w->num_results++] = path;
+
+    return;
+}
+
+
+/**
+ * @brief walk_push() queues a directory on the worker's own end of its deque.
+ * 
+ * @param w 
+ * @param dir 
+ */
+void walk_push(struct glob_worker * w, char * dir)
+{
+    __atomic_add_fetch(&w->walk->pending, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->cap)
+    {
+        if (w->head > 0)
+        {
+            memmove(w->tasks, w->tasks + w->head, sizeof(char *) * (w->tail - w->head));
+            w->tail -= w->head;
+            w->head = 0;
+        }
+        else
+        {
+            w->cap = (w->cap == 0) ? 256 : w->cap * 2;
+            w->tasks = realloc(w->tasks, sizeof(char *) * w->cap);
+        }
+    }
+    w->tasks[w->tail++] = dir;
+    pthread_mutex_unlock(&w->lock);
+
+    return;
+}
+
+
+/**
+ * @brief walk_take() takes a directory to read: the newest one of the worker's own, which keeps each thread deep in
+ *        its part of the tree, or else the oldest one of another worker's, which tends to be a whole subtree.
+ * 
+ * @param w 
+ * @return char* 
+ */
+char * walk_take(struct glob_worker * w)
+{
+    struct glob_worker * victim;
+    char * dir = NULL;
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail > w->head)
+    {
+        dir = w->tasks[--w->tail];
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    for (i = 1; (dir == NULL) && (i < w->walk->num_workers); i++)
+    {
+        victim = &w->walk->workers[(w->index + i) % w->walk->num_workers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->tail > victim->head)
+        {
+            dir = victim->tasks[victim->head++];
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    return dir;
+}
+
+
+/**
+ * @brief walk_dir() reads one directory of a ** walk, queueing the directories in it that are not hidden and adding
+ *        the names that match to the worker's results. Symbolic links to directories are not followed.
+ * 
+ * @param w 
+ * @param dir 
+ */
+void walk_dir(struct glob_worker * w, char * dir)
+{
+    struct glob_walk * walk = w->walk;
+    struct dirent64 * d;
+    struct stat st;
+    char * path;
+    ssize_t got;
+    ssize_t pos;
+    size_t name_len;
+    bool is_dir;
+    int fd;
+
+    if (__atomic_load_n(&walk->overflow, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    if ((fd = openat(walk->base_fd, (dir[0] != '\0') ? dir : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+    {
+        return;
+    }
+    if (walk->dirs && ((path = walk_strdup(w, walk->prefix, dir, "")) != NULL))
+    {
+        walk_result(w, path);
+    }
+
+    while (!__atomic_load_n(&walk->overflow, __ATOMIC_RELAXED) && ((got = getdents64(fd, w->batch, dirent_batch_size)) > 0))
+    {
+        for (pos = 0; pos < got; pos += d->d_reclen)
+        {
+            d = (struct dirent64 *) (w->batch + pos);
+            if ((d->d_name[0] == '.') && ((d->d_name[1] == '\0') || ((d->d_name[1] == '.') && (d->d_name[2] == '\0'))))
+            {
+                continue;
+            }
+
+            is_dir = (d->d_type == DT_DIR) || ((d->d_type == DT_UNKNOWN) &&
+                     (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) && S_ISDIR(st.st_mode));
+            if (is_dir && (d->d_name[0] != '.'))
+            {
+                if ((path = walk_strdup(w, dir, d->d_name, "/")) == NULL)
+                {
+                    break;
+                }
+                walk_push(w, path);
+            }
+
+            if (walk->dirs)
+            {
+                continue;
+            }
+            name_len = strlen(d->d_name);
+            if ((walk->tail == NULL) ? (d->d_name[0] != '.') :
+                (((d->d_name[0] != '.') || walk->tail->dot) && glob_match(walk->tail, d->d_name, name_len)))
+            {
+                if ((path = walk_strdup(w, walk->prefix, dir, d->d_name)) == NULL)
+                {
+                    break;
+                }
+                walk_result(w, path);
+            }
+        }
+    }
+    close(fd);
+
+    return;
+}
+
+
+/**
+ * @brief walk_worker() reads directories until none is left anywhere in the walk, then sorts what it found, so the
+ *        sorting is shared out between the threads too.
+ * 
+ * @param arg 
+ * @return void* 
+ */
+void * walk_worker(void * arg)
+{
+    struct glob_worker * w = arg;
+    struct timespec pause = { 0, 50000 };
+    char * dir;
+
+    while (1)
+    {
+        if ((dir = walk_take(w)) != NULL)
+        {
+            walk_dir(w, dir);
+            __atomic_sub_fetch(&w->walk->pending, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        if (__atomic_load_n(&w->walk->pending, __ATOMIC_SEQ_CST) == 0)
+        {
+            break;
+        }
+        nanosleep(&pause, NULL);
+    }
+
+    if (w->num_results > 1)
+    {
+        qsort(w->results, w->num_results, sizeof(char *), compare_words);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief glob_walk() walks the tree under prefix for a ** component, with up to glob_max_threads threads reading
+ *        directories in parallel. Names matching tail are collected, or every name when tail is NULL, or the
+ *        directories themselves when dirs is true. Each thread sorts its own results and they are merged into out,
+ *        so the order never depends on which thread read what. Returns false if the walk went over glob_max_bytes.
+ * 
+ * @param prefix 
+ * @param tail 
+ * @param dirs 
+ * @param out 
+ * @return true 
+ * @return false 
+ */
+bool glob_walk(const char * prefix, struct glob_matcher * tail, bool dirs, struct wordvec * out)
+{
+    struct glob_walk walk;
+    struct glob_worker * w;
+    sigset_t all;
+    sigset_t saved;
+    char * chunk;
+    char * best;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int started;
+    int i;
+    int k = 0;
+
+    memset(&walk, 0, sizeof(walk));
+    if ((walk.base_fd = open((prefix[0] != '\0') ? prefix : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    {
+        return true;
+    }
+    walk.tail = tail;
+    walk.dirs = dirs;
+    walk.prefix = prefix;
+    walk.prefix_len = strlen(prefix);
+    walk.num_workers = ((cpus < 1) || (cpus > glob_max_threads)) ? glob_max_threads : (int) cpus;
+    walk.workers = calloc(walk.num_workers, sizeof(struct glob_worker));
+
+    for (i = 0; i < walk.num_workers; i++)
+    {
+        w = &walk.workers[i];
+        w->walk = &walk;
+        w->index = i;
+        w->batch = malloc(dirent_batch_size);
+        pthread_mutex_init(&w->lock, NULL);
+    }
+    walk_push(&walk.workers[0], "");
+
+    /* The shell itself is worker 0. The others block every signal, so the shell's handlers only ever run on it. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    for (started = 1; started < walk.num_workers; started++)
+    {
+        if (pthread_create(&walk.workers[started].thread, NULL, walk_worker, &walk.workers[started]) != 0)
+        {
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    /* Workers that could not be started only ever have empty deques, and find nothing to merge. */
+    walk_worker(&walk.workers[0]);
+    for (i = 1; i < started; i++)
+    {
+        pthread_join(walk.workers[i].thread, NULL);
+    }
+    close(walk.base_fd);
+
+    /* Merge the sorted runs, taking the smallest head each time. There are few runs, so a scan is enough. */
+    while (!walk.overflow)
+    {
+        best = NULL;
+        for (i = 0; i < started; i++)
+        {
+            w = &walk.workers[i];
+            if ((w->merged < w->num_results) && ((best == NULL) || (strcmp(w->results[w->merged], best) < 0)))
+            {
+                best = w->results[w->merged];
+                k = i;
+            }
+        }
+        if (best == NULL)
+        {
+            break;
+        }
+        walk.workers[k].merged++;
+        wordvec_push(out, arena_strndup(best, strlen(best)));
+    }
+
+    for (i = 0; i < walk.num_workers; i++)
+    {
+        w = &walk.workers[i];
+        while ((chunk = w->chunk) != NULL)
+        {
+            memcpy(&w->chunk, chunk, sizeof(char *));
+            free(chunk);
+        }
+        free(w->tasks);
+        free(w->results);
+        free(w->batch);
+        pthread_mutex_destroy(&w->lock);
+    }
+    free(walk.workers);
+
+    return !walk.overflow;
+}
+
+
+/**
+ * @brief glob_expand() adds the paths matching a pattern to out in sorted order and returns how many there were.
+ *        Components of the pattern without *, ? or [...] are taken as they are, and only the directories holding a
+ *        pattern component are read. Names starting with '.' are only matched by a component that starts with one.
+ *        Quoted characters reach here escaped with a backslash by expand_word(). Returns -1, with nothing added, when
+ *        a ** walk found more than it may hold.
+ * 
+ * @param pattern 
+ * @param out 
+ * @return int 
+ */
+int glob_expand(char * pattern, struct wordvec * out)
+{
+    struct glob_matcher m;
+    struct glob_matcher * tail;
+    struct dir_listing * listing;
+    struct wordvec paths;
+    struct wordvec next;
+    struct stat st;
+    char * comp = pattern;
+    char * slash;
+    char * after;
+    char * name;
+    char * path;
+    char * lit;
+    size_t comp_len;
+    size_t prefix_len;
+    size_t name_len;
+    bool matched = false;         // a component was a pattern
+    bool check = false;           // the paths end in text that was not read from a directory, so may not exist
+    bool sorted = false;          // the paths came sorted from a single ** walk
+    bool dirs;
+    int count = 0;
+    int i;
+    int j;
+
+    memset(&paths, 0, sizeof(paths));
+    wordvec_push(&paths, (*pattern == '/') ? "/" : "");
+
+    while (*comp == '/')
+    {
+        comp++;
+    }
+
+    while ((*comp != '\0') && (paths.count > 0))
+    {
+        slash = strchr(comp, '/');
+        comp_len = (slash != NULL) ? (size_t) (slash - comp) : strlen(comp);
+        memset(&next, 0, sizeof(next));
+
+        /* A component that is just ** stands for any number of directories, which are walked in parallel. The last
+           component, when it comes right after, is matched during the walk; otherwise the walk yields the directories
+           for the components after it to go on from. */
+        if ((comp_len == 2) && (comp[0] == '*') && (comp[1] == '*'))
+        {
+            tail = NULL;
+            dirs = (slash != NULL);
+            after = (slash != NULL) ? slash + strspn(slash, "/") : NULL;
+            if ((after != NULL) && (*after != '\0') && (strchr(after, '/') == NULL))
+            {
+                glob_compile(after, strlen(after), &m);
+                tail = &m;
+                dirs = false;
+                slash = NULL;
+            }
+
+            for (i = 0; i < paths.count; i++)
+            {
+                if (!glob_walk(paths.words[i], tail, dirs, &next))
+                {
+                    shell_printf("Too many matches for %s!\n", pattern);
+                    expansion_failed = true;
+                    return -1;
+                }
+            }
+            matched = true;
+            check = false;
+            sorted = (paths.count == 1);
+        }
+        else if (!glob_compile(comp, comp_len, &m))
+        {
+            lit = arena_strndup(comp, comp_len);
+            comp_len = glob_unescape(lit, comp_len);
+            for (i = 0; i < paths.count; i++)
+            {
+                prefix_len = strlen(paths.words[i]);
+                path = arena_alloc(prefix_len + comp_len + 2);
+                memcpy(path, paths.words[i], prefix_len);
+                memcpy(path + prefix_len, lit, comp_len);
+                strcpy(path + prefix_len + comp_len, (slash != NULL) ? "/" : "");
+                wordvec_push(&next, path);
+            }
+            check = matched;
+            sorted = false;
+        }
+        else
+        {
+            for (i = 0; i < paths.count; i++)
+            {
+                if ((listing = read_listing((paths.words[i][0] != '\0') ? paths.words[i] : ".")) == NULL)
+                {
+                    continue;
+                }
+                prefix_len = strlen(paths.words[i]);
+                for (name = listing->entries + 1, j = 0; j < listing->count; j++, name += name_len + 2)
+                {
+                    name_len = strlen(name);
+                    if (((name[0] == '.') && !m.dot) || !glob_match(&m, name, name_len))
+                    {
+                        continue;
+                    }
+                    path = arena_alloc(prefix_len + name_len + 2);
+                    memcpy(path, paths.words[i], prefix_len);
+                    memcpy(path + prefix_len, name, name_len);
+                    strcpy(path + prefix_len + name_len, (slash != NULL) ? "/" : "");
+                    wordvec_push(&next, path);
+                }
+                if (!listing->cached)
+                {
+                    private_unmap(listing->entries, listing->cap);
+                    free(listing);
+                }
+            }
+            matched = true;
+            check = false;
+            sorted = false;
+        }
+
+        paths = next;
+        if (slash == NULL)
+        {
+            break;
+        }
+        for (comp = slash; *comp == '/'; comp++)
+        {
+        }
+    }
+
+    if (!matched)
+    {
+        return 0;
+    }
+
+    /* A trailing '/' keeps only directories, which lstat() sees through the slash. */
+    check = check || (pattern[strlen(pattern) - 1] == '/');
+    if ((paths.count > 1) && !sorted)
+    {
+        qsort(paths.words, paths.count, sizeof(char *), compare_words);
+    }
+    for (i = 0; i < paths.count; i++)
+    {
+        if (!check || (lstat(paths.words[i], &st) == 0))
+        {
+            wordvec_push(out, paths.words[i]);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+/**
+ * @brief glob_field() adds a finished field of expand_word() to out. A field holding an unquoted *, ? or [ is a
+ *        pattern and is replaced by the paths it matches; one that matches nothing, like any other, is added as it
+ *        is, less the escapes that marked its quoted characters.
+ * 
+ * @param out 
+ * @param buf 
+ * @param len 
+ * @param glob 
+ * @param escaped 
+ */
+void glob_field(struct wordvec * out, char * buf, size_t len, bool glob, bool escaped)
+{
+    if (len == 0)
+    {
+        wordvec_push(out, "");
+        return;
+    }
+
+    buf[len] = '\0';
+    if (glob && (glob_expand(buf, out) != 0))
+    {
+        return;
+    }
+    if (escaped)
+    {
+        len = glob_unescape(buf, len);
+    }
+    wordvec_push(out, arena_strndup(buf, len));
+
+    return;
+}
+
+
+/**
+ * @brief expand_word() expands one raw word from the lexer into out. Quotes and backslashes are removed, $ expansions
+ *        are done, and when split is true the unquoted results of expansions are split into separate words on IFS and
+ *        words with an unquoted *, ? or [ are expanded as pathname patterns. While such a word is built, its quoted
+ *        pattern characters are escaped with a backslash so the pattern takes them literally.
+ * 
+ * @param raw 
+ * @param split 
+ * @param out 
+ */
+void expand_word(char * raw, bool split, struct wordvec * out)
+{
+    static char * spare = NULL;   // buffer for building words, kept between calls
+    static size_t spare_cap = 0;
+    char * buf;
+    size_t cap;
+    size_t len = 0;
+    bool have_word = false;       // quotes make a word even when it ends up empty
+    bool in_dquote = false;
+    bool quoted;                  // whether the text being added was quoted
+    bool glob = false;            // the word has an unquoted pattern character
+    bool escaped = false;         // backslashes were put before quoted pattern characters
+    const char * ifs = get_var("IFS");
+    const char * value;
+    size_t value_len;
+    char numbuf[24];
+    char path[24];                // /dev/fd/N of a process substitution
+    char * p = raw;
+    size_t k;
+
+    /* Most words have nothing to expand and can be used as they are. */
+    if (strpbrk(raw, "'\"\\$(`*?[") == NULL)
+    {
+        wordvec_push(out, raw);
+        return;
+    }
+
+    /* The buffer is taken while the word is built, since a command substitution in it expands words of its own. */
+    buf = spare;
+    cap = spare_cap;
+    spare = NULL;
+    spare_cap = 0;
+
+    if (ifs == NULL)
+    {
+        ifs = " \t\n";
+    }
+
+    while (*p != '\0')
+    {
+        value = NULL;
+        value_len = 0;
+        quoted = true;
+
+        if ((*p == '\'') && !in_dquote)
+        {
+            value = p + 1;
+            value_len = strchr(p + 1, '\'') - value;
+            p += value_len + 2;
+            have_word = true;
+        }
+        else if (*p == '"')
+        {
+            in_dquote = !in_dquote;
+            have_word = true;
+            p++;
+            continue;
+        }
+        else if ((*p == '\\') && (p[1] != '\0'))
+        {
+            /* Inside double quotes a backslash only escapes the characters that are special there. */
+            if (in_dquote && (strchr("$`\"\\", p[1]) == NULL))
+            {
+                value = p;
+                value_len = 2;
+            }
+            else
+            {
+                value = p + 1;
+                value_len = 1;
+            }
+            p += 2;
+            have_word = true;
+        }
+        else if (!in_dquote && at_process_substitution(p))
+        {
+            process_substitution(&p, path);
+            value = path;
+            value_len = strlen(path);
+            have_word = true;
+        }
+        else if (((*p == '$') || (*p == '`')) && ((value = expand_parameter(&p, numbuf)) != NULL))
+        {
+            value_len = strlen(value);
+
+            /* Unquoted expansion results are split into words on IFS. */
+            if (split && !in_dquote)
+            {
+                for (k = 0; k < value_len; k++)
+                {
+                    if (strchr(ifs, value[k]) != NULL)
+                    {
+                        if (have_word || (len > 0))
+                        {
+                            glob_field(out, buf, len, glob, escaped);
+                        }
+                        len = 0;
+                        have_word = false;
+                        glob = false;
+                        escaped = false;
+                        continue;
+                    }
+                    if (len + 2 >= cap)
+                    {
+                        cap = (cap == 0) ? 256 : cap * 2;
+                        buf = realloc(buf, cap);
+                    }
+                    if (value[k] == '\\')
+                    {
+                        buf[len++] = '\\';
+                        escaped = true;
+                    }
+                    glob = glob || (strchr("*?[", value[k]) != NULL);
+                    buf[len++] = value[k];
+                }
+                continue;
+            }
+        }
+        else
+        {
+            value = p;
+            value_len = 1;
+            quoted = in_dquote || (*p == '\\');
+            glob = glob || (!quoted && (strchr("*?[", *p) != NULL));
+            p++;
+            have_word = true;
+        }
+
+        if (len + value_len * 2 >= cap)
+        {
+            cap = (len + value_len) * 2 + 256;
+            buf = realloc(buf, cap);
+        }
+        if (split && quoted && (value_len > 0))
+        {
+            for (k = 0; k < value_len; k++)
+            {
+                if (strchr("*?[]\\", value[k]) != NULL)
+                {
+                    buf[len++] = '\\';
+                    escaped = true;
+                }
+                buf[len++] = value[k];
+            }
+            continue;
+        }
+        memcpy(buf + len, value, value_len);
+        len += value_len;
+    }
+
+    if (have_word || (len > 0) || !split)
+    {
+        glob_field(out, buf, len, glob, escaped);
+    }
+
+    if (spare == NULL)
+    {
+        spare = buf;
+        spare_cap = cap;
+    }
+    else
+    {
+        free(buf);
+    }
+
+    return;
+}
+
+
+/**
+ * @brief expand_string() expands a raw word without splitting it, for places that need exactly one string such as
+ *        assignment values and redirection targets.
+ * 
+ * @param raw 
+ * @return char* 
+ */
+char * expand_string(char * raw)
+{
+    struct wordvec wv;
+
+    memset(&wv, 0, sizeof(wv));
+    expand_word(raw, false, &wv);
+
+    return wv.words[0];
+}
+
+
+/**
+ * @brief skip_quoted() returns the end of the quoted or escaped text, or the $ or command substitution, starting at p,
+ *        or p itself when none starts there. Text left open runs to the end of the word.
+ * 
+ * @param p 
+ * @return char* 
+ */
+char * skip_quoted(char * p)
+{
+    char * end = p;
+
+    if ((*p == '\\') && (p[1] != '\0'))
+    {
+        end = p + 2;
+    }
+    else if (*p == '\'')
+    {
+        end = strchr(p + 1, '\'');
+        end = (end != NULL) ? end + 1 : NULL;
+    }
+    else if (*p == '"')
+    {
+        for (end = p + 1; (end != NULL) && (*end != '\0') && (*end != '"'); )
+        {
+            if ((*end == '\\') && (end[1] != '\0'))
+            {
+                end += 2;
+            }
+            else
+            {
+                end = (skip_command_substitution(end) == end) ? end + 1 : skip_command_substitution(end);
+            }
+        }
+        end = ((end != NULL) && (*end == '"')) ? end + 1 : NULL;
+    }
+    else if ((p[0] == '$') && (p[1] == '{'))
+    {
+        end = strchr(p, '}');
+        end = (end != NULL) ? end + 1 : NULL;
+    }
+    else
+    {
+        end = skip_command_substitution(p);
+    }
+
+    return (end != NULL) ? end : p + strlen(p);
+}
+
+
+/**
+ * @brief parse_range() reads the inside of a {first..last} or {first..last..step} range, len characters at text. Both
+ *        ends are integers or both are single letters. An end written with leading zeros pads every value to the
+ *        width of the wider end. Returns false if the text is not a range.
+ * 
+ * @param text 
+ * @param len 
+ * @param range 
+ * @return true 
+ * @return false 
+ */
+bool parse_range(const char * text, size_t len, struct brace_range * range)
+{
+    char buf[64];
+    char * ends[3];
+    char * end;
+    long long values[3] = { 0, 0, 1 };
+    size_t digits;
+    bool padded = false;
+    int num_ends = 1;
+    int i;
+
+    if ((len == 0) || (len >= sizeof(buf)))
+    {
+        return false;
+    }
+    memcpy(buf, text, len);
+    buf[len] = '\0';
+
+    /* Split at each "..". */
+    ends[0] = buf;
+    while ((num_ends < 3) && ((end = strstr(ends[num_ends - 1], "..")) != NULL))
+    {
+        *end = '\0';
+        ends[num_ends++] = end + 2;
+    }
+    if ((num_ends < 2) || (strstr(ends[num_ends - 1], "..") != NULL))
+    {
+        return false;
+    }
+
+    range->chars = isalpha((unsigned char)ends[0][0]) && (ends[0][1] == '\0')
+                   && isalpha((unsigned char)ends[1][0]) && (ends[1][1] == '\0');
+    range->width = 0;
+
+    for (i = 0; i < num_ends; i++)
+    {
+        if (range->chars && (i < 2))
+        {
+            values[i] = (unsigned char)ends[i][0];
+            continue;
+        }
+
+        errno = 0;
+        values[i] = strtoll(ends[i], &end, 10);
+        if ((end == ends[i]) || (*end != '\0') || (errno == ERANGE) || !isdigit((unsigned char)end[-1]))
+        {
+            return false;
+        }
+
+        digits = strlen(ends[i]) - (((ends[i][0] == '-') || (ends[i][0] == '+')) ? 1 : 0);
+        padded = padded || ((i < 2) && (digits > 1) && (ends[i][strlen(ends[i]) - digits] == '0'));
+    }
+    if (padded)
+    {
+        range->width = (strlen(ends[0]) > strlen(ends[1])) ? strlen(ends[0]) : strlen(ends[1]);
+    }
+
+    /* The step's sign is taken from the direction of the range. */
+    if (values[2] == 0)
+    {
+        values[2] = 1;
+    }
+    else if (values[2] < 0)
+    {
+        values[2] = (values[2] == LLONG_MIN) ? LLONG_MAX : -values[2];
+    }
+    range->first = values[0];
+    range->count = ((values[1] >= values[0]) ? (unsigned long long)values[1] - values[0]
+                                             : (unsigned long long)values[0] - values[1]) / (unsigned long long)values[2] + 1;
+    range->step = (values[1] >= values[0]) ? values[2] : -values[2];
+
+    return true;
+}
+
+
+/**
+ * @brief range_value() writes value k of a range into buf and returns it as a number.
+ * 
+ * @param range 
+ * @param k 
+ * @param buf 
+ * @return long long 
+ */
+long long range_value(struct brace_range * range, unsigned long long k, char * buf)
+{
+    long long value = (long long)((unsigned long long)range->first + k * (unsigned long long)range->step);
+
+    if (range->chars)
+    {
+        sprintf(buf, "%c", (char)value);
+    }
+    else
+    {
+        sprintf(buf, "%0*lld", range->width, value);
+    }
+
+    return value;
+}
+
+
+/**
+ * @brief find_brace() finds the first brace expansion in a raw word at or after from: a {...} with a comma outside any
+ *        braces nested in it, or a range. Quoted text and $ expansions are skipped. On success open and close point at
+ *        its braces, and range is filled in if it is a range.
+ * 
+ * @param from 
+ * @param open 
+ * @param close 
+ * @param is_range 
+ * @param range 
+ * @return true 
+ * @return false 
+ */
+bool find_brace(char * from, char ** open, char ** close, bool * is_range, struct brace_range * range)
+{
+    char * p = from;
+    char * q;
+    char * skip;
+    bool comma;
+    int depth;
+
+    while (*p != '\0')
+    {
+        if ((skip = skip_quoted(p)) != p)
+        {
+            p = skip;
+            continue;
+        }
+        if (*p != '{')
+        {
+            p++;
+            continue;
+        }
+
+        comma = false;
+        for (q = p + 1, depth = 1; *q != '\0'; )
+        {
+            if ((skip = skip_quoted(q)) != q)
+            {
+                q = skip;
+                continue;
+            }
+            if (*q == '{')
+            {
+                depth++;
+            }
+            else if ((*q == '}') && (--depth == 0))
+            {
+                break;
+            }
+            else if ((*q == ',') && (depth == 1))
+            {
+                comma = true;
+            }
+            q++;
+        }
+
+        if ((*q == '}') && (comma || parse_range(p + 1, q - p - 1, range)))
+        {
+            *open = p;
+            *close = q;
+            *is_range = !comma;
+            return true;
+        }
+        p++;
+    }
+
+    return false;
+}
+
+
+/**
+ * @brief brace_expand() expands the braces in a raw word and passes every word they make on to expand_word(), in
+ *        order, into out. Each word is written once, straight into the line arena, and becomes an argument as it is;
+ *        nothing else is built on the way. budget, if not NULL, is the exec budget left, and each argument made is
+ *        taken from it. Returns false as soon as the budget runs out, so a huge range stops early instead of filling
+ *        memory. from is where to look for braces; text before it has none.
+ * 
+ * @param raw 
+ * @param from 
+ * @param out 
+ * @param budget 
+ * @return true 
+ * @return false 
+ */
+bool brace_expand(char * raw, char * from, struct wordvec * out, long * budget)
+{
+    struct brace_range range;
+    char * open;
+    char * close;
+    char * alt;
+    char * q;
+    char * skip;
+    char * word;
+    char value[32];
+    size_t prefix_len;
+    size_t suffix_len;
+    size_t alt_len;
+    unsigned long long k;
+    bool is_range;
+    int first = out->count;
+    int depth;
+
+    if (!find_brace(from, &open, &close, &is_range, &range))
+    {
+        expand_word(raw, true, out);
+        for (; (budget != NULL) && (first < out->count); first++)
+        {
+            *budget -= strlen(out->words[first]) + 1 + sizeof(char *);
+        }
+        return (budget == NULL) || (*budget >= 0);
+    }
+
+    prefix_len = open - raw;
+    suffix_len = strlen(close + 1);
+
+    if (is_range)
+    {
+        for (k = 0; k < range.count; k++)
+        {
+            range_value(&range, k, value);
+            alt_len = strlen(value);
+            word = arena_alloc(prefix_len + alt_len + suffix_len + 1);
+            memcpy(word, raw, prefix_len);
+            memcpy(word + prefix_len, value, alt_len);
+            memcpy(word + prefix_len + alt_len, close + 1, suffix_len + 1);
+            if (!brace_expand(word, word + prefix_len + alt_len, out, budget))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* Each comma separated alternative may hold braces of its own, so the search goes on from its start. */
+    for (alt = open + 1; alt <= close; alt = q + 1)
+    {
+        for (q = alt, depth = 0; (q < close) && ((*q != ',') || (depth > 0)); )
+        {
+            if ((skip = skip_quoted(q)) != q)
+            {
+                q = skip;
+                continue;
+            }
+            depth += (*q == '{') ? 1 : (*q == '}') ? -1 : 0;
+            q++;
+        }
+        alt_len = q - alt;
+        word = arena_alloc(prefix_len + alt_len + suffix_len + 1);
+        memcpy(word, raw, prefix_len);
+        memcpy(word + prefix_len, alt, alt_len);
+        memcpy(word + prefix_len + alt_len, close + 1, suffix_len + 1);
+        if (!brace_expand(word, word + prefix_len, out, budget))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief expand_heredoc() expands the body of a here-document. Quotes are ordinary characters there; a backslash only
+ *        escapes $, ` and another backslash, and joins lines when it ends one. The text is left in a buffer reused by
+ *        the next call, with its length in len. Like expand_word(), it holds on to the buffer while it works, in case a
+ *        command substitution in the body needs one too.
+ * 
+ * @param body 
+ * @param len 
+ * @return char* 
+ */
+char * expand_heredoc(char * body, size_t * len)
+{
+    static char * spare = NULL;
+    static size_t spare_cap = 0;
+    char * buf = spare;
+    size_t cap = spare_cap;
+    const char * value;
+    size_t value_len;
+    char numbuf[24];
+    char * p = body;
+
+    spare = NULL;
+    spare_cap = 0;
+    *len = 0;
+    while (*p != '\0')
+    {
+        value = p;
+        value_len = 1;
+
+        if ((*p == '\\') && (p[1] == '\n'))
+        {
+            p += 2;
+            continue;
+        }
+        if ((*p == '\\') && (strchr("$`\\", p[1]) != NULL) && (p[1] != '\0'))
+        {
+            value = p + 1;
+            p += 2;
+        }
+        else if (((*p == '$') || (*p == '`')) && ((value = expand_parameter(&p, numbuf)) != NULL))
+        {
+            value_len = strlen(value);
+        }
+        else
+        {
+            value = p++;
+        }
+
+        if (*len + value_len >= cap)
+        {
+            cap = (*len + value_len) * 2 + 256;
+            buf = realloc(buf, cap);
+        }
+        memcpy(buf + *len, value, value_len);
+        *len += value_len;
+    }
+
+    if (spare != NULL)
+    {
+        free(spare);
+    }
+    spare = buf;
+    spare_cap = cap;
+
+    return (buf != NULL) ? buf : "";
+}
+
+
+/**
+ * @brief text_fd() puts len bytes of text into a sealed memfd and returns it open for reading from the start, or -1 on
+ *        an error. Nothing can change the text once it is sealed, and unlike a pipe it holds any amount without a
+ *        writer having to wait for the reader. Where there are no memfds, an unnamed temporary file does the same job.
+ * 
+ * @param text 
+ * @param len 
+ * @return int 
+ */
+int text_fd(const char * text, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+    int fd;
+
+    if ((fd = memfd_create("smallsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1)
+    {
+        if ((fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) == -1)
+        {
+            return -1;
+        }
+    }
+
+    while (done < len)
+    {
+        if ((n = write(fd, text + done, len - done)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+
+/**
+ * @brief out_copy() queues a copy of len bytes at data, for text that is about to be overwritten.
+ * 
+ * @param data 
+ * @param len 
+ */
+void out_copy(const char * data, size_t len)
+{
+    if (len > 0)
+    {
+        out_add(arena_strndup(data, len), len);
+    }
+
+    return;
+}
+
+
+/**
+ * @brief true_builtin() is true and ":", which do nothing successfully.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void true_builtin(char ** arguments, int argc)
+{
+    (void)arguments;
+    (void)argc;
+
+    status = 0;
+}
+
+
+/**
+ * @brief false_builtin() is false, which does nothing unsuccessfully.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void false_builtin(char ** arguments, int argc)
+{
+    (void)arguments;
+    (void)argc;
+
+    status = 1;
+}
+
+
+/**
+ * @brief unescape() decodes the backslash escapes echo -e, printf formats and printf %b understand, from str into out.
+ *        In %b mode octal escapes are written \0NNN. Returns the length of the decoded text, and sets *stop when a \c
+ *        says to stop all further output.
+ * 
+ * @param str 
+ * @param out 
+ * @param b_mode 
+ * @param stop 
+ * @return size_t 
+ */
+size_t unescape(const char * str, char * out, bool b_mode, bool * stop)
+{
+    size_t len = 0;
+    int value;
+    int digits;
+
+    while (*str != '\0')
+    {
+        if ((*str != '\\') || (str[1] == '\0'))
+        {
+            out[len++] = *str++;
+            continue;
+        }
+
+        str++;
+        switch (*str)
+        {
+            case 'a': out[len++] = '\a'; str++; break;
+            case 'b': out[len++] = '\b'; str++; break;
+            case 'f': out[len++] = '\f'; str++; break;
+            case 'n': out[len++] = '\n'; str++; break;
+            case 'r': out[len++] = '\r'; str++; break;
+            case 't': out[len++] = '\t'; str++; break;
+            case 'v': out[len++] = '\v'; str++; break;
+            case '\\': out[len++] = '\\'; str++; break;
+            case 'c':
+                *stop = true;
+                return len;
+
+            case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7':
+                /* Up to three octal digits, after the leading 0 that %b and echo put in front of them. */
+                if (b_mode && (*str == '0'))
+                {
+                    str++;
+                }
+                for (value = 0, digits = 0; (digits < 3) && (*str >= '0') && (*str <= '7'); digits++, str++)
+                {
+                    value = value * 8 + (*str - '0');
+                }
+                out[len++] = (char)value;
+                break;
+
+            default:
+                out[len++] = '\\';
+                out[len++] = *str++;
+                break;
+        }
+    }
+
+    return len;
+}
+
+
+/**
+ * @brief echo_builtin() is echo. The arguments are queued straight from the argument vector, separated by spaces and
+ *        ended by a newline unless -n is given, and written with one writev(). -e turns on backslash escapes.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void echo_builtin(char ** arguments, int argc)
+{
+    bool newline = true;
+    bool escapes = false;
+    bool stop = false;
+    char * decoded;
+    size_t len;
+    int i;
+    int k;
+
+    /* Options are only words made of n, e and E letters after a dash. */
+    for (i = 1; (i < argc) && (arguments[i][0] == '-') && (arguments[i][1] != '\0')
+                && (strspn(arguments[i] + 1, "neE") == strlen(arguments[i] + 1)); i++)
+    {
+        for (k = 1; arguments[i][k] != '\0'; k++)
+        {
+            if (arguments[i][k] == 'n')
+            {
+                newline = false;
+            }
+            else
+            {
+                escapes = (arguments[i][k] == 'e');
+            }
+        }
+    }
+
+    for (; (i < argc) && !stop; i++)
+    {
+        if (escapes && (strchr(arguments[i], '\\') != NULL))
+        {
+            decoded = arena_alloc(strlen(arguments[i]) + 1);
+            len = unescape(arguments[i], decoded, true, &stop);
+            out_add(decoded, len);
+        }
+        else
+        {
+            out_add(arguments[i], strlen(arguments[i]));
+        }
+
+        if ((i + 1 < argc) && !stop)
+        {
+            out_add(" ", 1);
+        }
+    }
+
+    if (newline && !stop)
+    {
+        out_add("\n", 1);
+    }
+
+    status = out_flush(1) ? 0 : 1;
+    return;
+}
+
+
+/**
+ * @brief printf_number() reads a printf numeric argument. A leading quote gives the code of the next character, the
+ *        way POSIX printf does. Prints a warning and sets *bad if the argument is not a number.
+ * 
+ * @param arg 
+ * @param bad 
+ * @return long long 
+ */
+long long printf_number(const char * arg, bool * bad)
+{
+    char * end;
+    long long value;
+
+    if ((arg[0] == '\'') || (arg[0] == '"'))
+    {
+        return (unsigned char)arg[1];
+    }
+
+    errno = 0;
+    value = strtoll(arg, &end, 0);
+
+    /* Unsigned formats may be handed values only an unsigned long long holds. */
+    if (errno == ERANGE)
+    {
+        errno = 0;
+        value = (long long)strtoull(arg, &end, 0);
+    }
+
+    if ((*arg != '\0') && ((*end != '\0') || (errno != 0)))
+    {
+        shell_printf("printf: %s: invalid number\n", arg);
+        *bad = true;
+    }
+
+    return value;
+}
+
+
+/**
+ * @brief format_piece() formats one printf conversion into the line arena, returning the text and its length in *len.
+ * 
+ * @param len 
+ * @param spec 
+ * @param ... 
+ * @return char* 
+ */
+char * format_piece(size_t * len, const char * spec, ...)
+{
+    va_list args;
+    va_list again;
+    char * piece;
+
+    va_start(args, spec);
+    va_copy(again, args);
+    *len = vsnprintf(NULL, 0, spec, args);
+    piece = arena_alloc(*len + 1);
+    vsnprintf(piece, *len + 1, spec, again);
+    va_end(again);
+    va_end(args);
+
+    return piece;
+}
+
+
+/**
+ * @brief printf_builtin() is printf. The format is reused until every argument has been consumed, each piece of output
+ *        is queued in the line arena, and it is all written with one writev() at the end.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void printf_builtin(char ** arguments, int argc)
+{
+    /* local variables */
+    char spec[96];             // one conversion rebuilt for snprintf: stars filled in, length modifier added
+    size_t spec_len;
+    size_t len;
+    int next = 2;              // next argument to consume
+    bool bad = false;
+    bool stop = false;
+    const char * arg;
+    char * piece;
+    char * p;
+    char conv;
+
+    if (argc < 2)
+    {
+        shell_printf("printf: usage: printf format [arguments]\n");
+        status = 2;
+        return;
+    }
+
+    do
+    {
+        for (p = arguments[1]; (*p != '\0') && !stop; )
+        {
+            /* Queue literal text up to the next conversion, decoding its escapes. */
+            if (*p != '%')
+            {
+                len = strcspn(p, "%");
+                piece = arena_strndup(p, len);
+                out_add(piece, unescape(piece, piece, false, &stop));
+                p += len;
+                continue;
+            }
+
+            if (p[1] == '%')
+            {
+                out_add("%", 1);
+                p += 2;
+                continue;
+            }
+
+            /* Copy the flags, width and precision, filling in any * from the arguments. */
+            spec[0] = '%';
+            spec_len = 1;
+            for (p++; (*p != '\0') && (strchr("-+ #0123456789.*", *p) != NULL) && (spec_len < 64); p++)
+            {
+                if (*p == '*')
+                {
+                    spec_len += sprintf(spec + spec_len, "%d", (int)printf_number((next < argc) ? arguments[next++] : "0", &bad));
+                }
+                else
+                {
+                    spec[spec_len++] = *p;
+                }
+            }
+            conv = *p;
+
+            if ((conv == '\0') || (strchr("diouxXcsbeEfFgGaA", conv) == NULL))
+            {
+                shell_printf("printf: %%%c: invalid conversion\n", conv);
+                out_flush(1);
+                status = 1;
+                return;
+            }
+            p++;
+
+            arg = (next < argc) ? arguments[next++] : NULL;
+
+            /* Let snprintf do the formatting, with a length modifier that fits the argument type. */
+            if (strchr("diouxX", conv) != NULL)
+            {
+                sprintf(spec + spec_len, "ll%c", conv);
+                piece = format_piece(&len, spec, (arg != NULL) ? printf_number(arg, &bad) : 0LL);
+            }
+            else if (strchr("eEfFgGaA", conv) != NULL)
+            {
+                double number = 0.0;
+                char * end = "";
+
+                if ((arg != NULL) && ((arg[0] == '\'') || (arg[0] == '"')))
+                {
+                    number = (unsigned char)arg[1];
+                }
+                else if ((arg != NULL) && (arg[0] != '\0'))
+                {
+                    number = strtod(arg, &end);
+                }
+                if (*end != '\0')
+                {
+                    shell_printf("printf: %s: invalid number\n", arg);
+                    bad = true;
+                }
+                sprintf(spec + spec_len, "%c", conv);
+                piece = format_piece(&len, spec, number);
+            }
+            else if (conv == 'c')
+            {
+                sprintf(spec + spec_len, "c");
+                piece = format_piece(&len, spec, ((arg != NULL) && (arg[0] != '\0')) ? arg[0] : '\0');
+                len = ((arg != NULL) && (arg[0] != '\0')) ? len : 0;
+            }
+            else
+            {
+                /* %b is %s after its argument's escapes are decoded. */
+                if ((conv == 'b') && (arg != NULL))
+                {
+                    piece = arena_strndup(arg, strlen(arg));
+                    piece[unescape(piece, piece, true, &stop)] = '\0';
+                    arg = piece;
+                }
+                sprintf(spec + spec_len, "s");
+                piece = format_piece(&len, spec, (arg != NULL) ? arg : "");
+            }
+
+            out_add(piece, len);
+        }
+    }
+    while ((next < argc) && (next > 2) && !stop);
+
+    status = (out_flush(1) && !bad) ? 0 : 1;
+    return;
+}
+
+
+/**
+ * @brief test_integer() reads an integer operand of test, setting test_error if it is not one.
+ * 
+ * @param arg 
+ * @return long long 
+ */
+long long test_integer(const char * arg)
+{
+    char * end;
+    long long value;
+
+    errno = 0;
+    value = strtoll(arg, &end, 10);
+
+    while ((*end == ' ') || (*end == '\t'))
+    {
+        end++;
+    }
+    if ((*arg == '\0') || (*end != '\0') || (errno != 0))
+    {
+        shell_printf("test: %s: integer expression expected\n", arg);
+        test_error = true;
+    }
+
+    return value;
+}
+
+
+/**
+ * @brief test_binary() reports whether op is one of test's binary operators.
+ * 
+ * @param op 
+ * @return true 
+ * @return false 
+ */
+bool test_binary(const char * op)
+{
+    static const char * ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot",
+                                  "-ef", NULL };
+    int i;
+
+    for (i = 0; ops[i] != NULL; i++)
+    {
+        if (strcmp(op, ops[i]) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * @brief test_unary() evaluates one of test's unary operators, which are mostly checks on a file.
+ * 
+ * @param op 
+ * @param arg 
+ * @return true 
+ * @return false 
+ */
+bool test_unary(char op, const char * arg)
+{
+    struct stat st;
+    bool exists;
+
+    switch (op)
+    {
+        case 'n': return arg[0] != '\0';
+        case 'z': return arg[0] == '\0';
+        case 't': return isatty((int)test_integer(arg));
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+        case 'h':
+        case 'L': return (lstat(arg, &st) == 0) && S_ISLNK(st.st_mode);
+    }
+
+    exists = (stat(arg, &st) == 0);
+
+    switch (op)
+    {
+        case 'e': return exists;
+        case 'f': return exists && S_ISREG(st.st_mode);
+        case 'd': return exists && S_ISDIR(st.st_mode);
+        case 'b': return exists && S_ISBLK(st.st_mode);
+        case 'c': return exists && S_ISCHR(st.st_mode);
+        case 'p': return exists && S_ISFIFO(st.st_mode);
+        case 'S': return exists && S_ISSOCK(st.st_mode);
+        case 's': return exists && (st.st_size > 0);
+        case 'g': return exists && (st.st_mode & S_ISGID);
+        case 'u': return exists && (st.st_mode & S_ISUID);
+        case 'k': return exists && (st.st_mode & S_ISVTX);
+        case 'O': return exists && (st.st_uid == geteuid());
+        case 'G': return exists && (st.st_gid == getegid());
+    }
+
+    return false;
+}
+
+
+/**
+ * @brief test_compare() evaluates one of test's binary operators.
+ * 
+ * @param left 
+ * @param op 
+ * @param right 
+ * @return true 
+ * @return false 
+ */
+bool test_compare(const char * left, const char * op, const char * right)
+{
+    struct stat st_left;
+    struct stat st_right;
+    bool have_left;
+    bool have_right;
+
+    if ((strcmp(op, "=") == 0) || (strcmp(op, "==") == 0))
+    {
+        return strcmp(left, right) == 0;
+    }
+    if (strcmp(op, "!=") == 0)
+    {
+        return strcmp(left, right) != 0;
+    }
+    if (strcmp(op, "<") == 0)
+    {
+        return strcmp(left, right) < 0;
+    }
+    if (strcmp(op, ">") == 0)
+    {
+        return strcmp(left, right) > 0;
+    }
+
+    /* File comparisons. */
+    if ((op[1] == 'n') || (op[1] == 'o') || (op[1] == 'e' && op[2] == 'f'))
+    {
+        have_left = (stat(left, &st_left) == 0);
+        have_right = (stat(right, &st_right) == 0);
+
+        if (strcmp(op, "-ef") == 0)
+        {
+            return have_left && have_right && (st_left.st_dev == st_right.st_dev) && (st_left.st_ino == st_right.st_ino);
+        }
+        if (strcmp(op, "-nt") == 0)
+        {
+            return have_left && (!have_right || (st_left.st_mtim.tv_sec > st_right.st_mtim.tv_sec)
+                                 || ((st_left.st_mtim.tv_sec == st_right.st_mtim.tv_sec)
+                                     && (st_left.st_mtim.tv_nsec > st_right.st_mtim.tv_nsec)));
+        }
+        return have_right && (!have_left || (st_left.st_mtim.tv_sec < st_right.st_mtim.tv_sec)
+                              || ((st_left.st_mtim.tv_sec == st_right.st_mtim.tv_sec)
+                                  && (st_left.st_mtim.tv_nsec < st_right.st_mtim.tv_nsec)));
+    }
+
+    /* Integer comparisons. */
+    {
+        long long a = test_integer(left);
+        long long b = test_integer(right);
+
+        if (strcmp(op, "-eq") == 0) return a == b;
+        if (strcmp(op, "-ne") == 0) return a != b;
+        if (strcmp(op, "-lt") == 0) return a < b;
+        if (strcmp(op, "-le") == 0) return a <= b;
+        if (strcmp(op, "-gt") == 0) return a > b;
+        return a >= b;
+    }
+}
+
+
+/**
+ * @brief test_expr() evaluates the test expression in args[*pos] up to args[end], advancing *pos past what it used.
+ *        Precedence from loosest to tightest is -o, -a, !, then primaries: ( expr ), binary and unary operators, and
+ *        a lone string, which is true when it is not empty. level picks the precedence to parse at (0 is -o).
+ * 
+ * @param args 
+ * @param pos 
+ * @param end 
+ * @param level 
+ * @return true 
+ * @return false 
+ */
+bool test_expr(char ** args, int * pos, int end, int level)
+{
+    bool result;
+    const char * arg;
+
+    if (*pos >= end)
+    {
+        shell_printf("test: argument expected\n");
+        test_error = true;
+        return false;
+    }
+
+    /* -o and -a combine the expressions on either side of them. */
+    if (level < 2)
+    {
+        result = test_expr(args, pos, end, level + 1);
+        while ((*pos < end) && (strcmp(args[*pos], (level == 0) ? "-o" : "-a") == 0))
+        {
+            (*pos)++;
+            if (level == 0)
+            {
+                result = test_expr(args, pos, end, 1) || result;
+            }
+            else
+            {
+                result = test_expr(args, pos, end, 2) && result;
+            }
+        }
+        return result;
+    }
+
+    arg = args[*pos];
+
+    /* A binary operator between two words wins over everything else, so "test ! = x" compares strings. */
+    if ((*pos + 2 < end) && test_binary(args[*pos + 1]))
+    {
+        *pos += 3;
+        return test_compare(arg, args[*pos - 2], args[*pos - 1]);
+    }
+
+    if ((strcmp(arg, "!") == 0) && (*pos + 1 < end))
+    {
+        (*pos)++;
+        return !test_expr(args, pos, end, 2);
+    }
+
+    if ((strcmp(arg, "(") == 0) && (*pos + 1 < end))
+    {
+        (*pos)++;
+        result = test_expr(args, pos, end, 0);
+        if ((*pos >= end) || (strcmp(args[*pos], ")") != 0))
+        {
+            shell_printf("test: missing )\n");
+            test_error = true;
+            return false;
+        }
+        (*pos)++;
+        return result;
+    }
+
+    if ((arg[0] == '-') && (arg[1] != '\0') && (arg[2] == '\0') && (strchr("bcdefghknprstuwxzLOGS", arg[1]) != NULL)
+        && (*pos + 1 < end))
+    {
+        *pos += 2;
+        return test_unary(arg[1], args[*pos - 1]);
+    }
+
+    (*pos)++;
+    return arg[0] != '\0';
+}
+
+
+/**
+ * @brief test_builtin() is test and [, setting status to 0 when the expression is true, 1 when it is false, and 2 when
+ *        it could not be evaluated.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void test_builtin(char ** arguments, int argc)
+{
+    int end = argc;
+    int pos = 1;
+    bool result;
+
+    /* [ must be closed by ]. */
+    if (strcmp(arguments[0], "[") == 0)
+    {
+        if (strcmp(arguments[argc - 1], "]") != 0)
+        {
+            shell_printf("[: missing ]\n");
+            status = 2;
+            return;
+        }
+        end--;
+    }
+
+    /* No expression at all is false. */
+    if (pos == end)
+    {
+        status = 1;
+        return;
+    }
+
+    test_error = false;
+    result = test_expr(arguments, &pos, end, 0);
+
+    if (!test_error && (pos < end))
+    {
+        shell_printf("test: %s: unexpected argument\n", arguments[pos]);
+        test_error = true;
+    }
+
+    status = test_error ? 2 : (result ? 0 : 1);
+    return;
+}
+
+
+/**
+ * @brief read_line_unbuffered() reads up to and including delim from fd one byte at a time, for pipes and terminals
+ *        where reading ahead would take input that belongs to the next command. Returns false at end of input.
+ * 
+ * @param fd 
+ * @param delim 
+ * @param line 
+ * @param len 
+ * @param cap 
+ * @return true 
+ * @return false 
+ */
+bool read_line_unbuffered(int fd, char delim, char ** line, size_t * len, size_t * cap)
+{
+    ssize_t nread;
+    char c;
+
+    while (1)
+    {
+        nread = read(fd, &c, 1);
+
+        if ((nread == -1) && (errno == EINTR))
+        {
+            continue;
+        }
+        if (nread <= 0)
+        {
+            return false;
+        }
+        if (c == delim)
+        {
+            return true;
+        }
+
+        if (*len + 1 >= *cap)
+        {
+            *cap = (*cap == 0) ? 256 : *cap * 2;
+            *line = realloc(*line, *cap);
+        }
+        (*line)[(*len)++] = c;
+    }
+}
+
+
+/**
+ * @brief read_line_buffered() reads up to and including delim from a seekable fd. Input is read in large blocks with
+ *        pread() into read_cache, which is kept between calls, and the descriptor's offset is then moved to just past
+ *        the delimiter, so the next command sharing it starts in the right place. A call that finds its line in the
+ *        cache costs two lseek() calls. Returns false at end of input.
+ * 
+ * @param fd 
+ * @param pos 
+ * @param delim 
+ * @param line 
+ * @param len 
+ * @param cap 
+ * @return true 
+ * @return false 
+ */
+bool read_line_buffered(int fd, off_t pos, char delim, char ** line, size_t * len, size_t * cap)
+{
+    struct read_buffer * rc = &read_cache;
+    size_t offset;
+    size_t count;
+    ssize_t nread;
+    char * found;
+    bool done = false;
+
+    /* The cache is only good for the same descriptor, not redirected since, and covering where the offset now is. */
+    if ((rc->fd != fd) || (rc->generation != fd_generation) || (pos < rc->start) || (pos > rc->start + (off_t)rc->len))
+    {
+        rc->fd = fd;
+        rc->generation = fd_generation;
+        rc->start = pos;
+        rc->len = 0;
+    }
+
+    while (1)
+    {
+        offset = pos - rc->start;
+        found = memchr(rc->buf + offset, delim, rc->len - offset);
+        count = (found != NULL) ? (size_t)(found - (rc->buf + offset)) : rc->len - offset;
+
+        /* Copy what belongs to the line. */
+        if (*len + count + 1 > *cap)
+        {
+            *cap = (*len + count + 1) * 2;
+            *line = realloc(*line, *cap);
+        }
+        memcpy(*line + *len, rc->buf + offset, count);
+        *len += count;
+        pos += count;
+
+        if (found != NULL)
+        {
+            pos++;
+            done = true;
+            break;
+        }
+
+        /* The cache is used up, so refill it with the next block of the file. */
+        if (rc->buf == NULL)
+        {
+            rc->buf = malloc(read_block_size);
+        }
+        rc->start = pos;
+        rc->len = 0;
+
+        do
+        {
+            nread = pread(fd, rc->buf, read_block_size, pos);
+        }
+        while ((nread == -1) && (errno == EINTR));
+
+        if (nread <= 0)
+        {
+            break;
+        }
+        rc->len = nread;
+    }
+
+    lseek(fd, pos, SEEK_SET);
+    return done;
+}
+
+
+/**
+ * @brief read_builtin() is read [-r] [-d delim] [name ...]. It reads a line from stdin and splits it on IFS into the
+ *        named variables, the last one taking the rest of the line (REPLY gets the whole line when no names are given).
+ *        Without -r a backslash escapes the next character and a backslash before the end of the line continues it.
+ *        Status is 1 at end of input.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void read_builtin(char ** arguments, int argc)
+{
+    /* local variables */
+    static char * line = NULL;     // the line read, reused between calls
+    static size_t cap = 0;
+    size_t len = 0;
+    bool raw = false;
+    bool got_delim;
+    char delim = '\n';
+    const char * ifs = get_var("IFS");
+    char * value;
+    size_t vlen;
+    size_t start;
+    size_t i = 0;
+    off_t pos;
+    int first_name;
+    int n;
+
+    for (first_name = 1; (first_name < argc) && (arguments[first_name][0] == '-'); first_name++)
+    {
+        if (strcmp(arguments[first_name], "-r") == 0)
+        {
+            raw = true;
+        }
+        else if ((strcmp(arguments[first_name], "-d") == 0) && (first_name + 1 < argc))
+        {
+            delim = arguments[++first_name][0];
+        }
+        else if (strcmp(arguments[first_name], "--") == 0)
+        {
+            first_name++;
+            break;
+        }
+        else
+        {
+            shell_printf("read: %s: invalid option\n", arguments[first_name]);
+            status = 2;
+            return;
+        }
+    }
+
+    if (ifs == NULL)
+    {
+        ifs = " \t\n";
+    }
+
+    /* Read the line, joining continued lines unless -r was given. Seekable input is read in blocks. */
+    pos = lseek(0, 0, SEEK_CUR);
+    while (1)
+    {
+        got_delim = (pos == -1) ? read_line_unbuffered(0, delim, &line, &len, &cap)
+                                : read_line_buffered(0, pos, delim, &line, &len, &cap);
+
+        for (n = 0; (n < (int)len) && (line[len - 1 - n] == '\\'); n++)
+        {
+        }
+        if (raw || !got_delim || (delim != '\n') || (n % 2 == 0))
+        {
+            break;
+        }
+
+        len--;
+        if (pos != -1)
+        {
+            pos = lseek(0, 0, SEEK_CUR);
+        }
+    }
+
+    if (len + 1 > cap)
+    {
+        cap = len + 1;
+        line = realloc(line, cap);
+    }
+    line[len] = '\0';
+
+    /* With no names the whole line goes into REPLY. */
+    if (first_name >= argc)
+    {
+        value = arena_alloc(len + 1);
+        for (vlen = 0, i = 0; i < len; i++)
+        {
+            if (!raw && (line[i] == '\\') && (i + 1 < len))
+            {
+                i++;
+            }
+            value[vlen++] = line[i];
+        }
+        value[vlen] = '\0';
+        set_var("REPLY", value, false);
+        status = got_delim ? 0 : 1;
+        return;
+    }
+
+    /* Split on IFS. Whitespace in IFS runs together and is trimmed from the ends; other IFS characters each end a field. */
+    value = arena_alloc(len + 1);
+    for (n = first_name; n < argc; n++)
+    {
+        while ((i < len) && (strchr(" \t\n", line[i]) != NULL) && (strchr(ifs, line[i]) != NULL))
+        {
+            i++;
+        }
+
+        vlen = 0;
+        start = 0;
+        for (; i < len; i++)
+        {
+            if (!raw && (line[i] == '\\') && (i + 1 < len))
+            {
+                value[vlen++] = line[++i];
+                start = vlen;       // escaped characters are never trimmed
+                continue;
+            }
+            if ((strchr(ifs, line[i]) != NULL) && (n + 1 < argc))
+            {
+                break;
+            }
+            value[vlen++] = line[i];
+        }
+
+        /* The last variable keeps the rest of the line, less trailing IFS whitespace. */
+        while ((vlen > start) && (strchr(" \t\n", value[vlen - 1]) != NULL) && (strchr(ifs, value[vlen - 1]) != NULL))
+        {
+            vlen--;
+        }
+        value[vlen] = '\0';
+        set_var(arguments[n], value, false);
+
+        /* Step over the separator: surrounding whitespace and at most one other IFS character. */
+        while ((i < len) && (strchr(" \t\n", line[i]) != NULL) && (strchr(ifs, line[i]) != NULL))
+        {
+            i++;
+        }
+        if ((i < len) && (strchr(ifs, line[i]) != NULL))
+        {
+            i++;
+        }
+    }
+
+    status = got_delim ? 0 : 1;
+    return;
+}
+
+
+/**
+ * @brief copy_fd_loop() copies in to out through a large buffer with read() and write(), for descriptors none of the
+ *        kernel copy calls can handle. Returns false on an error.
+ * 
+ * @param in 
+ * @param out 
+ * @return true 
+ * @return false 
+ */
+bool copy_fd_loop(int in, int out)
+{
+    static char * buf = NULL;
+    ssize_t nread;
+    ssize_t nwritten;
+    ssize_t done;
+
+    if (buf == NULL)
+    {
+        buf = malloc(copy_buffer_size);
+    }
+
+    while (1)
+    {
+        nread = read(in, buf, copy_buffer_size);
+        if ((nread == -1) && (errno == EINTR))
+        {
+            continue;
+        }
+        if (nread <= 0)
+        {
+            return nread == 0;
+        }
+
+        for (done = 0; done < nread; done += nwritten)
+        {
+            nwritten = write(out, buf + done, nread - done);
+            if ((nwritten == -1) && (errno == EINTR))
+            {
+                nwritten = 0;
+            }
+            else if (nwritten == -1)
+            {
+                return false;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief copy_fd() copies in, from its current offset, to out at its current offset, picking the cheapest way the two
+ *        descriptors allow and leaving both offsets after the data copied:
+ *          - file to an empty file, when may_clone is set: an FICLONE reflink, which shares the blocks outright
+ *          - file to file: copy_file_range() over the data regions, skipping holes when appending so sparse files
+ *            stay sparse
+ *          - file to pipe: splice(); file to anything else: sendfile()
+ *          - pipe to anything: splice()
+ *        Whatever is left when a call is not supported for the pair goes through copy_fd_loop(). Returns false on an
+ *        error.
+ * 
+ * @param in 
+ * @param out 
+ * @param may_clone 
+ * @return true 
+ * @return false 
+ */
+bool copy_fd(int in, int out, bool may_clone)
+{
+    struct stat st_in;
+    struct stat st_out;
+    off_t in_off;
+    off_t out_off;
+    off_t end;
+    off_t data;
+    off_t hole;
+    ssize_t n = 0;
+    bool sparse;
+
+    if ((fstat(in, &st_in) == -1) || (fstat(out, &st_out) == -1))
+    {
+        return false;
+    }
+    in_off = lseek(in, 0, SEEK_CUR);
+    out_off = lseek(out, 0, SEEK_CUR);
+    end = st_in.st_size;
+
+    /* Files in /proc and /sys report a size of 0, so only trust the size of files that have one. */
+    if (S_ISREG(st_in.st_mode) && (end > 0) && (in_off != -1) && S_ISREG(st_out.st_mode) && (out_off != -1))
+    {
+        if (may_clone && (in_off == 0) && (out_off == 0) && (st_out.st_size == 0) && (ioctl(out, FICLONE, in) == 0))
+        {
+            lseek(in, end, SEEK_SET);
+            lseek(out, end, SEEK_SET);
+            return true;
+        }
+
+        /* Holes can only be skipped where out has nothing yet, which is past its end. */
+        sparse = (st_out.st_size <= out_off);
+
+        while (in_off < end)
+        {
+            if (sparse)
+            {
+                data = lseek(in, in_off, SEEK_DATA);
+                data = (data == -1) ? ((errno == ENXIO) ? end : in_off) : data;
+                out_off += data - in_off;
+                in_off = data;
+                hole = lseek(in, in_off, SEEK_HOLE);
+                hole = (hole == -1) ? end : hole;
+            }
+            else
+            {
+                hole = end;
+            }
+
+            while (in_off < hole)
+            {
+                n = copy_file_range(in, &in_off, out, &out_off, hole - in_off, 0);
+                if (n <= 0)
+                {
+                    break;
+                }
+            }
+            if ((in_off < hole) && (n <= 0))
+            {
+                break;
+            }
+        }
+
+        /* A hole at the end of in still has to make out as long. */
+        if ((in_off >= end) && (fstat(out, &st_out) == 0) && (st_out.st_size < out_off))
+        {
+            ftruncate(out, out_off);
+        }
+
+        lseek(in, in_off, SEEK_SET);
+        lseek(out, out_off, SEEK_SET);
+
+        if (in_off >= end)
+        {
+            return true;
+        }
+        /* copy_file_range() also refuses an out opened with O_APPEND, with EBADF. */
+        if ((n == -1) && (errno != EXDEV) && (errno != EINVAL) && (errno != ENOSYS) && (errno != EOPNOTSUPP) && (errno != EBADF))
+        {
+            return false;
+        }
+    }
+
+    else if (S_ISREG(st_in.st_mode) && (end > 0) && (in_off != -1))
+    {
+        while (in_off < end)
+        {
+            if (S_ISFIFO(st_out.st_mode))
+            {
+                n = splice(in, &in_off, out, NULL, end - in_off, SPLICE_F_MOVE | SPLICE_F_MORE);
+            }
+            else
+            {
+                n = sendfile(out, in, &in_off, end - in_off);
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+        }
+
+        lseek(in, in_off, SEEK_SET);
+
+        if (in_off >= end)
+        {
+            return true;
+        }
+        if ((n == -1) && (errno != EINVAL) && (errno != ENOSYS))
+        {
+            return false;
+        }
+    }
+
+    else if (S_ISFIFO(st_in.st_mode))
+    {
+        while (1)
+        {
+            n = splice(in, NULL, out, (out_off != -1) ? &out_off : NULL, copy_buffer_size, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n <= 0)
+            {
+                break;
+            }
+        }
+
+        if (out_off != -1)
+        {
+            lseek(out, out_off, SEEK_SET);
+        }
+
+        if (n == 0)
+        {
+            return true;
+        }
+        if ((errno != EINVAL) && (errno != ENOSYS))
+        {
+            return false;
+        }
+    }
+
+    return copy_fd_loop(in, out);
+}
+
+
+/**
+ * @brief cat_builtin() is cat. Each file (or stdin, for "-" or no files) is copied to stdout with copy_fd(), so
+ *        "cat part* > merged" joins the parts without the data passing through the shell.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void cat_builtin(char ** arguments, int argc)
+{
+    int first = 1;
+    int fd;
+    int i;
+
+    status = 0;
+
+    /* -u (unbuffered) is what cat does anyway. */
+    if ((argc > 1) && (strcmp(arguments[1], "-u") == 0))
+    {
+        first++;
+    }
+
+    for (i = first; (i < argc) || (i == first); i++)
+    {
+        if ((i == argc) || (strcmp(arguments[i], "-") == 0))
+        {
+            fd = 0;
+        }
+        else if ((fd = open(arguments[i], O_RDONLY | O_CLOEXEC)) == -1)
+        {
+            shell_printf("cat: %s: %s\n", arguments[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+
+        if (!copy_fd(fd, 1, true))
+        {
+            shell_printf("cat: %s: %s\n", (fd == 0) ? "-" : arguments[i], strerror(errno));
+            status = 1;
+        }
+
+        if (fd != 0)
+        {
+            close(fd);
+        }
+        if (i == argc)
+        {
+            break;
+        }
+    }
+
+    return;
+}
+
+
+/**
+ * @brief cp_file() copies the regular file src to dst, creating dst with src's permissions or truncating it.
+ *        Returns false after printing the error.
+ * 
+ * @param src 
+ * @param dst 
+ * @return true 
+ * @return false 
+ */
+bool cp_file(const char * src, const char * dst)
+{
+    struct stat st_src;
+    struct stat st_dst;
+    int in;
+    int out;
+    bool ok;
+
+    if ((in = open(src, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        shell_printf("cp: %s: %s\n", src, strerror(errno));
+        return false;
+    }
+
+    fstat(in, &st_src);
+    if (S_ISDIR(st_src.st_mode))
+    {
+        shell_printf("cp: %s: is a directory\n", src);
+        close(in);
+        return false;
+    }
+
+    if ((stat(dst, &st_dst) == 0) && (st_dst.st_dev == st_src.st_dev) && (st_dst.st_ino == st_src.st_ino))
+    {
+        shell_printf("cp: %s and %s are the same file\n", src, dst);
+        close(in);
+        return false;
+    }
+
+    if ((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st_src.st_mode & 0777)) == -1)
+    {
+        shell_printf("cp: %s: %s\n", dst, strerror(errno));
+        close(in);
+        return false;
+    }
+
+    ok = copy_fd(in, out, true);
+    if (!ok)
+    {
+        shell_printf("cp: %s: %s\n", dst, strerror(errno));
+    }
+
+    close(in);
+    if ((close(out) == -1) && ok)
+    {
+        shell_printf("cp: %s: %s\n", dst, strerror(errno));
+        ok = false;
+    }
+
+    return ok;
+}
+
+
+/**
+ * @brief cp_builtin() is cp for regular files: "cp src dst" or "cp src ... dir".
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void cp_builtin(char ** arguments, int argc)
+{
+    struct stat st;
+    const char * base;
+    char * dst;
+    bool to_dir;
+    int i;
+
+    if (argc < 3)
+    {
+        shell_printf("cp: usage: cp source dest, or cp source ... directory\n");
+        status = 1;
+        return;
+    }
+
+    to_dir = (stat(arguments[argc - 1], &st) == 0) && S_ISDIR(st.st_mode);
+    if ((argc > 3) && !to_dir)
+    {
+        shell_printf("cp: %s: not a directory\n", arguments[argc - 1]);
+        status = 1;
+        return;
+    }
+
+    status = 0;
+
+    for (i = 1; i < argc - 1; i++)
+    {
+        dst = arguments[argc - 1];
+
+        /* Copying into a directory keeps the file's name. */
+        if (to_dir)
+        {
+            base = strrchr(arguments[i], '/');
+            base = (base != NULL) ? base + 1 : arguments[i];
+            dst = arena_alloc(strlen(arguments[argc - 1]) + strlen(base) + 2);
+            sprintf(dst, "%s/%s", arguments[argc - 1], base);
+        }
+
+        if (!cp_file(arguments[i], dst))
+        {
+            status = 1;
+        }
+    }
+
+    return;
+}
+
+
+/**
+ * @brief exit_builtin() is the exit command: reap what has finished, then kill the rest and exit.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void exit_builtin(char ** arguments, int argc)
+{
+    (void)arguments;
+    (void)argc;
+
+    reap();
+    exit_process();
+}
+
+
+/**
+ * @brief cd_builtin() is the cd command, changing to HOME when no directory is given.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void cd_builtin(char ** arguments, int argc)
+{
+    char * home;
+
+    if (argc > 1)
+    {
+        change_directory(arguments[1]);
+        return;
+    }
+
+    if ((home = get_var("HOME")) != NULL)
+    {
+        change_directory(home);
+    }
+
+    return;
+}
+
+
+/**
+ * @brief status_builtin() is the status command.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void status_builtin(char ** arguments, int argc)
+{
+    (void)arguments;
+    (void)argc;
+
+    check_status();
+}
+
+
+/**
+ * @brief hist_percentile() returns the run time in microseconds that percent of the runs in h took at most, as the
+ *        longest time in the bucket it falls in, but never more than the longest run.
+ * 
+ * @param h 
+ * @param percent 
+ * @return unsigned long long 
+ */
+unsigned long long hist_percentile(struct command_hist * h, double percent)
+{
+    unsigned long long wanted = (unsigned long long) (h->total * percent / 100.0 + 0.999999);
+    unsigned long long seen = 0;
+    unsigned long long top;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS - 1; i++)
+    {
+        seen += h->counts[i];
+        if ((seen >= wanted) && (seen > 0))
+        {
+            break;
+        }
+    }
+    top = hist_bucket_top(i);
+
+    return (top < h->max) ? top : h->max;
+}
+
+
+/**
+ * @brief format_run_time() writes a time of us microseconds into buf in the unit that suits it, and returns buf.
+ * 
+ * @param buf 
+ * @param us 
+ * @return char* 
+ */
+char * format_run_time(char * buf, unsigned long long us)
+{
+    if (us < 1000)
+    {
+        sprintf(buf, "%lluus", us);
+    }
+    else if (us < 1000000)
+    {
+        sprintf(buf, "%.1fms", us / 1e3);
+    }
+    else if (us < 60000000)
+    {
+        sprintf(buf, "%.2fs", us / 1e6);
+    }
+    else if (us < 3600000000ULL)
+    {
+        sprintf(buf, "%llum%02llus", us / 60000000, us / 1000000 % 60);
+    }
+    else
+    {
+        sprintf(buf, "%lluh%02llum", us / 3600000000ULL, us / 60000000 % 60);
+    }
+
+    return buf;
+}
+
+
+/**
+ * @brief hist_builtin() is the hist command. It shows the number of runs and the 50th, 90th and 99th percentile and
+ *        longest run times of each command named, or of every command that has run if none are.
+ * 
+ * @param arguments 
+ * @param argc 
+ */
+void hist_builtin(char ** arguments, int argc)
+{
+    struct command_hist * h;
+    char ** names;
+    char times[4][32];
+    int num_names = 0;
+    size_t i;
+    int j;
+
+    if (!hists_on)
+    {
+        shell_printf("Command histograms are off, set SMALLSH_HISTOGRAMS to keep them!\n");
+        status = 1;
+        return;
+    }
+
+    status = 0;
+    if (argc > 1)
+    {
+        names = arguments + 1;
+        num_names = argc - 1;
+    }
+    else
+    {
+        names = arena_alloc(sizeof(char *) * (num_hists + 1));
+        for (i = 0; i < hists_cap; i++)
+        {
+            if ((hists[i] != NULL) && (hists[i]->total > 0))
+            {
+                names[num_names++] = hists[i]->name;
+            }
+        }
+        qsort(names, num_names, sizeof(char *), compare_words);
+    }
+
+    for (j = 0; j < num_names; j++)
+    {
+        if (((h = find_hist(names[j], false)) == NULL) || (h->total == 0))
+        {
+            shell_printf("No runs of %s recorded!\n", names[j]);
+            status = 1;
+            continue;
+        }
+        shell_printf("%-16s runs %-6llu p50 %-8s p90 %-8s p99 %-8s max %s\n", h->name, h->total,
+                     format_run_time(times[0], hist_percentile(h, 50)), format_run_time(times[1], hist_percentile(h, 90)),
+                     format_run_time(times[2], hist_percentile(h, 99)), format_run_time(times[3], h->max));
+    }
+
+    return;
+}
+
+
+/* The built in commands. They run inside the shell process, with their redirections applied by redirect_shell(). */
+struct builtin builtins[] =
+{
+    { ":",      true_builtin,   true },
+    { "[",      test_builtin,   true },
+    { "cat",    cat_builtin,    true },
+    { "cd",     cd_builtin,     false },
+    { "cp",     cp_builtin,     true },
+    { "echo",   echo_builtin,   true },
+    { "exit",   exit_builtin,   false },
+    { "export", export_vars,    false },
+    { "false",  false_builtin,  true },
+    { "hist",   hist_builtin,   true },
+    { "printf", printf_builtin, true },
+    { "read",   read_builtin,   false },
+    { "status", status_builtin, true },
+    { "test",   test_builtin,   true },
+    { "true",   true_builtin,   true },
+    { "unset",  unset_vars,     false },
+    { "xargs",  xargs_process,  true },
+    { NULL,     NULL,           false }
+};
+
+
+/**
+ * @brief find_builtin() returns the built in named name, or NULL if name is not a built in.
+ * 
+ * @param name 
+ * @return struct builtin* 
+ */
+struct builtin * find_builtin(const char * name)
+{
+    int i;
+
+    for (i = 0; builtins[i].name != NULL; i++)
+    {
+        if (strcmp(builtins[i].name, name) == 0)
+        {
+            return &builtins[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief restore_shell_fds() puts back the descriptors redirect_shell() saved, last saved first, and closes the copies.
+ *        Extra output files of a fan out are filled from the first output file before it is put away.
+ * 
+ * @param saved 
+ * @param num_saved 
+ */
+void restore_shell_fds(struct saved_fd * saved, int num_saved)
+{
+    int src = -1;
+    int i;
+
+    /* Anything a built in left queued belongs to the redirected descriptor. */
+    if (num_saved > 0)
+    {
+        out_flush(STDOUT_FILENO);
+    }
+
+    /* Extra output files get a copy of the first one, made by the kernel with copy_fd() from a fresh descriptor. */
+    for (i = 0; i < num_saved; i++)
+    {
+        if (saved[i].fd != -1)
+        {
+            continue;
+        }
+        if (src == -1)
+        {
+            src = open("/proc/self/fd/1", O_RDONLY | O_CLOEXEC);
+        }
+        if ((src == -1) || (lseek(src, 0, SEEK_SET) == -1) || !copy_fd(src, saved[i].copy, true))
+        {
+            shell_printf("Output redirection error!\n");
+        }
+        close(saved[i].copy);
+    }
+    if (src != -1)
+    {
+        close(src);
+    }
+
+    for (i = num_saved - 1; i >= 0; i--)
+    {
+        if (saved[i].fd != -1)
+        {
+            dup3(saved[i].copy, saved[i].fd, 0);
+            close(saved[i].copy);
+        }
+    }
+    if (num_saved > 0)
+    {
+        fd_generation++;
+    }
+
+    return;
+}
+
+
+/**
+ * @brief redirect_shell() applies a redirection plan to the shell process itself for a built in. Each descriptor it
+ *        replaces is first copied above the standard ones into saved, so restore_shell_fds() can put it back afterwards.
+ *        When there are several output files, stdout goes to the first and the rest are kept open in saved with fd -1,
+ *        to be filled in when the built in is done. On an error it restores what it already changed and returns false.
+ * 
+ * @param redirs 
+ * @param saved 
+ * @param num_saved 
+ * @return true 
+ * @return false 
+ */
+bool redirect_shell(struct redirection * redirs, struct saved_fd * saved, int * num_saved)
+{
+    bool have_output = false;
+    int target;
+    int i;
+
+    /* What is queued was meant for the descriptors as they are now. */
+    *num_saved = 0;
+    if (redirs[0].type != TOK_END)
+    {
+        out_flush(STDOUT_FILENO);
+    }
+
+    for (i = 0; redirs[i].type != TOK_END; i++)
+    {
+        target = redirs[i].dest;
+
+        /* Output files after the first are only filled in by restore_shell_fds(), from a copy of their descriptor. */
+        if ((target == 1) && have_output)
+        {
+            saved[*num_saved].fd = -1;
+            if ((saved[*num_saved].copy = fcntl(redirs[i].fd, F_DUPFD_CLOEXEC, 10)) == -1)
+            {
+                shell_printf("Output redirection error!\n");
+                restore_shell_fds(saved, *num_saved);
+                return false;
+            }
+            (*num_saved)++;
+            continue;
+        }
+        have_output = have_output || (target == 1);
+
+        /* Keep the shell's own descriptor so it can be put back, closed on exec so no child ever sees the copy. */
+        saved[*num_saved].fd = target;
+        saved[*num_saved].copy = fcntl(target, F_DUPFD_CLOEXEC, 10);
+        (*num_saved)++;
+
+        dup3(redirs[i].fd, target, 0);
+        fd_generation++;
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief run_builtin() runs a built in inside the shell. Its redirections are applied to the shell's own descriptors
+ *        and undone afterwards, and NAME=value prefixes are exported only for as long as the built in runs, so built ins
+ *        never need a fork.
+ * 
+ * @param builtin 
+ * @param arguments 
+ * @param argc 
+ * @param assigns 
+ * @param redirs 
+ */
+void run_builtin(struct builtin * builtin, char ** arguments, int argc, char ** assigns, struct redirection * redirs)
+{
+    struct saved_fd * saved;
+    struct variable * var;
+    char ** old_values = NULL;
+    bool * was_exported = NULL;
+    int num_saved;
+    int num_assigns = 0;
+    int i;
+
+    for (i = 0; redirs[i].type != TOK_END; i++)
+    {
+    }
+    saved = arena_alloc(sizeof(struct saved_fd) * (i + 1));
+
+    if (!redirect_shell(redirs, saved, &num_saved))
+    {
+        status = 1;
+        return;
+    }
+
+    /* Remember what each prefixed variable was so it can be put back. */
+    while ((assigns != NULL) && (assigns[num_assigns] != NULL))
+    {
+        num_assigns++;
+    }
+    if (num_assigns > 0)
+    {
+        old_values = arena_alloc(sizeof(char *) * num_assigns);
+        was_exported = arena_alloc(sizeof(bool) * num_assigns);
+
+        for (i = 0; i < num_assigns; i++)
+        {
+            var = find_var(assigns[i], strcspn(assigns[i], "="));
+            old_values[i] = (var != NULL) ? arena_strndup(var->entry, strlen(var->entry)) : NULL;
+            was_exported[i] = (var != NULL) && (var->env_index != -1);
+        }
+        apply_assignments(assigns);
+    }
+
+    builtin->run(arguments, argc);
+
+    for (i = num_assigns - 1; i >= 0; i--)
+    {
+        if (old_values[i] == NULL)
+        {
+            *strchr(assigns[i], '=') = '\0';
+            unset_var(assigns[i]);
+            continue;
+        }
+
+        assign_var(old_values[i], false);
+        if (!was_exported[i])
+        {
+            env_remove(find_var(old_values[i], strcspn(old_values[i], "=")));
+        }
+    }
+
+    restore_shell_fds(saved, num_saved);
+    return;
+}
+
+
+/**
+ * @brief close_redirections() closes the descriptors of a redirection plan once its command has them.
+ * 
+ * @param redirs 
+ */
+void close_redirections(struct redirection * redirs)
+{
+    int i;
+
+    for (i = 0; redirs[i].type != TOK_END; i++)
+    {
+        if (redirs[i].fd != -1)
+        {
+            close(redirs[i].fd);
+        }
+    }
+
+    return;
+}
+
+
+/**
+ * @brief plan_redirections() resolves the redirections of a command into a plan ended by TOK_END, in the shell and
+ *        before anything forks. Targets are expanded and opened in order, close on exec, so a missing file or a denied
+ *        permission is reported without a child ever being made; a child only has to dup each descriptor onto its
+ *        destination. Here-documents and here-strings are put into memfds. A literal here-document is written once and
+ *        kept in the parsed line, and each use opens it again so every reader starts at the top. On an error the
+ *        descriptors opened so far are closed and NULL is returned.
+ * 
+ * @param list 
+ * @param cmd 
+ * @return struct redirection* 
+ */
+struct redirection * plan_redirections(struct command_list * list, struct command * cmd)
+{
+    struct redirection * redirs = arena_alloc(sizeof(struct redirection) * (cmd->num_redirs + 1));
+    struct redirection * raw;
+    char path[32];
+    char * text;
+    size_t len;
+    int i;
+
+    for (i = 0; i < cmd->num_redirs; i++)
+    {
+        raw = &list->redirs[cmd->first_redir + i];
+        redirs[i].type = raw->type;
+        redirs[i].target = raw->target;
+        redirs[i].dest = raw->dest;
+        redirs[i].fd = -1;
+
+        switch (raw->type)
+        {
+            case TOK_LESS:
+                redirs[i].target = expand_string(raw->target);
+                redirs[i].fd = open(redirs[i].target, O_RDONLY | O_CLOEXEC);
+                break;
+
+            case TOK_GREAT:
+                redirs[i].target = expand_string(raw->target);
+                redirs[i].fd = open(redirs[i].target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                break;
+
+            case TOK_HEREDOC:
+                text = expand_heredoc(raw->target, &len);
+                redirs[i].fd = text_fd(text, len);
+                break;
+
+            case TOK_HEREDOC_LITERAL:
+                if (raw->fd == -1)
+                {
+                    raw->fd = text_fd(raw->target, strlen(raw->target));
+                }
+                if (raw->fd != -1)
+                {
+                    sprintf(path, "/proc/self/fd/%d", raw->fd);
+                    redirs[i].fd = open(path, O_RDONLY | O_CLOEXEC);
+                }
+                break;
+
+            case TOK_HERESTRING:
+                /* A here-string is its word with a newline after it. */
+                redirs[i].target = expand_string(raw->target);
+                len = strlen(redirs[i].target);
+                text = arena_alloc(len + 2);
+                sprintf(text, "%s\n", redirs[i].target);
+                redirs[i].fd = text_fd(text, len + 1);
+                break;
+        }
+
+        if (redirs[i].fd == -1)
+        {
+            shell_printf("%s!\n", (raw->type == TOK_LESS) ? "Input redirection error" : (raw->type == TOK_GREAT)
+                                                       ? "Output redirection error" : "Here-document error");
+            redirs[i].type = TOK_END;
+            close_redirections(redirs);
+            return NULL;
+        }
+    }
+    redirs[i].type = TOK_END;
+
+    return redirs;
+}
+
+
+/**
+ * @brief execute_command() expands one command from a list and runs it, either with run_builtin() or through prep().
+ *        Leading NAME=value words are assignments: on their own they set shell variables, otherwise they only go into
+ *        the environment of the command that follows them.
+ * 
+ * @param list 
+ * @param cmd 
+ * @param background 
+ */
+void execute_command(struct command_list * list, struct command * cmd, bool background)
+{
+    /* local variables */
+    char ** raw = list->words + cmd->first_word;
+    struct wordvec argv;
+    struct wordvec assigns;
+    struct redirection * redirs;
+    char * equals;
+    char * value;
+    char * entry;
+    struct builtin * builtin;
+    int procsubst_mark = num_procsubst;
+    long budget = -1;             // exec budget left for brace expansion, worked out when first needed
+    int argc;
+    int i;
+
+    memset(&argv, 0, sizeof(argv));
+    memset(&assigns, 0, sizeof(assigns));
+    substituted = false;
+    expansion_failed = false;
+    trace_begin("expand", NULL);
+
+    /* Collect the assignments, expanding only their values. */
+    for (i = 0; i < cmd->num_words; i++)
+    {
+        equals = strchr(raw[i], '=');
+        if ((equals == NULL) || !valid_name(raw[i], equals - raw[i]))
+        {
+            break;
+        }
+        value = expand_string(equals + 1);
+        entry = arena_alloc((equals - raw[i]) + strlen(value) + 2);
+        sprintf(entry, "%.*s=%s", (int)(equals - raw[i]), raw[i], value);
+        wordvec_push(&assigns, entry);
+    }
+
+    /* Expand the rest of the words into the argument vector. Brace expansion is held to what one exec can take. */
+    for (; i < cmd->num_words; i++)
+    {
+        if (strchr(raw[i], '{') == NULL)
+        {
+            expand_word(raw[i], true, &argv);
+            continue;
+        }
+        if (budget == -1)
+        {
+            budget = exec_budget();
+        }
+        if (!brace_expand(raw[i], raw[i], &argv, &budget))
+        {
+            shell_printf("Argument list too long!\n");
+            expansion_failed = true;
+            break;
+        }
+    }
+    argc = argv.count;
+    trace_end("expand");
+
+    if (expansion_failed || ((redirs = plan_redirections(list, cmd)) == NULL))
+    {
+        close_process_substitutions(procsubst_mark);
+        status = 1;
+        return;
+    }
+
+    if (argc == 0)
+    {
+        close_redirections(redirs);
+        close_process_substitutions(procsubst_mark);
+        for (i = 0; i < assigns.count; i++)
+        {
+            assign_var(assigns.words[i], false);
+        }
+
+        /* Assignments alone leave the status of the last command substitution in them, like other shells. */
+        if (!substituted)
+        {
+            status = 0;
+        }
+        return;
+    }
+
+    /* Built ins run inside the shell. Everything else will be run by exec functions. */
+    procsubst_start = procsubst_mark;
+    if ((builtin = find_builtin(argv.words[0])) != NULL)
+    {
+        metrics.builtins++;
+        trace_begin("builtin", argv.words[0]);
+        run_builtin(builtin, argv.words, argc, assigns.words, redirs);
+        trace_end("builtin");
+    }
+    else
+    {
+        metrics.externals++;
+        prep(argv.words, assigns.words, redirs, background);    
+    }
+    close_redirections(redirs);
+    close_process_substitutions(procsubst_mark);
+
+    return;
+}
+
+
+/* run_range() and run_loop() call each other, since loops hold lists. */
+void run_range(struct command_list * list, int start, int end);
+
+
+/**
+ * @brief run_for() makes the passes of a for loop, one per word its words expand to, setting the variable to each in
+ *        turn. A word that is a range on its own, like {1..1000000}, is counted through one value at a time and never
+ *        made into a list. Returns the status of the last pass, or 0 if there were none.
+ * 
+ * @param list 
+ * @param cmd 
+ * @return int 
+ */
+int run_for(struct command_list * list, struct command * cmd)
+{
+    char * name = list->words[cmd->first_word];
+    struct brace_range range;
+    struct wordvec items;
+    struct arena_mark mark;
+    unsigned long long k;
+    long long value;
+    char buf[32];
+    char * raw;
+    size_t len;
+    int body_status = 0;
+    int i;
+    int j;
+
+    for (i = 1; i < cmd->num_words; i++)
+    {
+        raw = list->words[cmd->first_word + i];
+        len = strlen(raw);
+
+        if ((raw[0] == '{') && (raw[len - 1] == '}') && parse_range(raw + 1, len - 2, &range))
+        {
+            for (k = 0; k < range.count; k++)
+            {
+                mark = arena_mark();
+                value = range_value(&range, k, buf);
+                if (range.chars || (range.width > 0))
+                {
+                    set_var(name, buf, false);
+                }
+                else
+                {
+                    set_int_var(name, value);
+                }
+                run_range(list, cmd->body, cmd->end);
+                body_status = last_status();
+                arena_release(mark);
+            }
+            continue;
+        }
+
+        memset(&items, 0, sizeof(items));
+        brace_expand(raw, raw, &items, NULL);
+        for (j = 0; j < items.count; j++)
+        {
+            mark = arena_mark();
+            set_var(name, items.words[j], false);
+            run_range(list, cmd->body, cmd->end);
+            body_status = last_status();
+            arena_release(mark);
+        }
+    }
+
+    return body_status;
+}
+
+
+/**
+ * @brief run_loop() runs a while, until or for loop in the shell process. The loop's redirections stay applied for all
+ *        of it, so "while read line; do ...; done < file" reads the file a line per pass. The status is that of the last
+ *        pass through the body, or 0 if the body never ran. A loop followed by "&" runs in a forked child.
+ * 
+ * @param list 
+ * @param index 
+ * @param background 
+ */
+void run_loop(struct command_list * list, int index, bool background)
+{
+    struct command * cmd = &list->commands[index];
+    struct redirection * redirs;
+    struct saved_fd * saved = arena_alloc(sizeof(struct saved_fd) * (cmd->num_redirs + 1));
+    struct arena_mark mark;
+    int procsubst_mark = num_procsubst;
+    int body_status = 0;
+    long long forking;
+    int num_saved;
+    int spawn_pid;
+
+    if (background && !tstp)
+    {
+        out_flush(STDOUT_FILENO);
+        trace_begin("fork", NULL);
+        forking = (metrics_file != NULL) ? trace_now() : 0;
+        spawn_pid = fork();
+
+        if (spawn_pid == -1)
+        {
+            trace_end("fork");
+            shell_printf("Fork() failed.\n");
+            return;
+        }
+        if (spawn_pid != 0)
+        {
+            trace_end("fork");
+            metrics_fork(forking);
+            shell_printf("background pid is %d\n", spawn_pid);
+            add_bchild(spawn_pid);
+            return;
+        }
+
+        /* The child runs the loop in the foreground and exits with its status. */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        run_loop(list, index, false);
+        child_exit(last_status());
+    }
+
+    if ((redirs = plan_redirections(list, cmd)) == NULL)
+    {
+        close_process_substitutions(procsubst_mark);
+        status = 1;
+        return;
+    }
+    if (!redirect_shell(redirs, saved, &num_saved))
+    {
+        close_redirections(redirs);
+        close_process_substitutions(procsubst_mark);
+        status = 1;
+        return;
+    }
+
+    /* Each pass gives back what it allocated, so long loops do not grow the line arena. */
+    if (cmd->type == CMD_FOR)
+    {
+        body_status = run_for(list, cmd);
+    }
+    while (cmd->type != CMD_FOR)
+    {
+        mark = arena_mark();
+
+        run_range(list, index + 1, cmd->body);
+        if ((last_status() == 0) == (cmd->type == CMD_UNTIL))
+        {
+            arena_release(mark);
+            break;
+        }
+
+        run_range(list, cmd->body, cmd->end);
+        body_status = last_status();
+        arena_release(mark);
+    }
+
+    status = body_status;
+    restore_shell_fds(saved, num_saved);
+    close_redirections(redirs);
+    close_process_substitutions(procsubst_mark);
+    return;
+}
+
+
+/**
+ * @brief run_range() runs the commands of a list from start up to end, skipping over what is nested in loops. "&&" runs
+ *        the next command only if the last status was 0 and "||" only if it was not; commands ending in "&" are launched
+ *        in the background without waiting, so a line like "a & b & c &" starts all three jobs in one pass.
+ * 
+ * @param list 
+ * @param start 
+ * @param end 
+ */
+void run_range(struct command_list * list, int start, int end)
+{
+    struct command * cmd;
+    bool run = true;
+    int i = start;
+
+    while (i < end)
+    {
+        cmd = &list->commands[i];
+
+        if (run && (cmd->type == CMD_SIMPLE))
+        {
+            execute_command(list, cmd, cmd->connector == TOK_AMP);
+        }
+        else if (run)
+        {
+            run_loop(list, i, cmd->connector == TOK_AMP);
+        }
+
+        /* A skipped command leaves the status alone, so "false && a || b" still runs b. */
+        if (cmd->connector == TOK_AND)
+        {
+            run = (last_status() == 0);
+        }
+        else if (cmd->connector == TOK_OR)
+        {
+            run = (last_status() != 0);
+        }
+        else
+        {
+            run = true;
+        }
+
+        i = cmd->end;
+    }
+
+    return;
+}
+
+
+/**
+ * @brief run_list() runs every command of a parsed line.
+ * 
+ * @param list 
+ */
+void run_list(struct command_list * list)
+{
+    run_range(list, 0, list->num_commands);
+    return;
+}
+
+
+/**
+ * @brief parse() takes the user input in from command_loop(), splits it into a list of commands with lex_line(), and
+ *        runs the list. Each command's words become its command and arguments, '<' and '>' give its input and output
+ *        redirection, and ';', '&&', '||' and '&' separate the commands, with '&' running the command before it in the
+ *        background if tstp is false.
+ * 
+ * @param line 
+ */
+void parse(char * line)
+{
+    /* local variables */
+    struct command_list list;
+    bool lexed;
+    int i;
+
+    trace_begin("lex", NULL);
+    lexed = lex_line(line, &list);
+    trace_end("lex");
+    if (lexed)
+    {
+        run_list(&list);
+    }
+    else
+    {
+        status = 2;
+    }
+
+    /* Literal here-documents keep their memfds for as long as the line can run them. */
+    for (i = 0; i < list.num_redirs; i++)
+    {
+        if (list.redirs[i].fd != -1)
+        {
+            close(list.redirs[i].fd);
+        }
+    }
+
+    return;
+}
+
+
+/**
+ * @brief complete_command() adds to out the built ins and the executables on PATH whose names start with prefix. If
+ *        PATH was changed since the index was built, the index thread is asked to build it again; until it has, the
+ *        old one is used.
+ * 
+ * @param prefix 
+ * @param out 
+ */
+void complete_command(const char * prefix, struct wordvec * out)
+{
+    const char * path = get_var("PATH");
+    const char * name;
+    size_t len = strlen(prefix);
+    uint64_t one = 1;
+    int i;
+
+    for (i = 0; builtins[i].name != NULL; i++)
+    {
+        if (strncmp(builtins[i].name, prefix, len) == 0)
+        {
+            wordvec_push(out, (char *) builtins[i].name);
+        }
+    }
+
+    if (path_index_wake == -1)
+    {
+        return;
+    }
+    pthread_mutex_lock(&path_index_lock);
+    if (strcmp((path != NULL) ? path : "", path_index_want) != 0)
+    {
+        free(path_index_want);
+        path_index_want = strdup((path != NULL) ? path : "");
+        write(path_index_wake, &one, sizeof(one));
+    }
+
+    /* The first name not below the prefix starts the run of names that have it. */
+    for (i = (path_index != NULL) ? find_index(path_index, prefix) : 0; (path_index != NULL) && (i < path_index->count); i++)
+    {
+        name = index_string(path_index, path_index->entries[i].name);
+        if (strncmp(name, prefix, len) != 0)
+        {
+            break;
+        }
+        wordvec_push(out, arena_strndup(name, strlen(name)));
+    }
+    pthread_mutex_unlock(&path_index_lock);
+
+    return;
+}
+
+
+/**
+ * @brief complete_path() adds to out the names in the directory part of word that start with the rest of it, with a
+ *        '/' after those that are directories. Hidden names are only offered when the rest starts with '.'. The
+ *        listing comes through the same cache as globbing.
+ * 
+ * @param word 
+ * @param out 
+ */
+void complete_path(const char * word, struct wordvec * out)
+{
+    const char * base = strrchr(word, '/');
+    struct dir_listing * listing;
+    struct stat st;
+    char * dir;
+    char * name;
+    char * full;
+    size_t base_len;
+    size_t name_len;
+    bool is_dir;
+    int i;
+
+    base = (base != NULL) ? base + 1 : word;
+    base_len = strlen(base);
+    dir = arena_strndup(word, base - word);
+    if ((listing = read_listing((dir[0] != '\0') ? dir : ".")) == NULL)
+    {
+        return;
+    }
+
+    for (name = listing->entries + 1, i = 0; i < listing->count; i++, name += name_len + 2)
+    {
+        name_len = strlen(name);
+        if ((strncmp(name, base, base_len) != 0) || ((name[0] == '.') && (base[0] != '.')))
+        {
+            continue;
+        }
+        is_dir = (name[-1] == DT_DIR);
+        if ((name[-1] == DT_LNK) || (name[-1] == DT_UNKNOWN))
+        {
+            full = arena_alloc(strlen(dir) + name_len + 1);
+            strcpy(full, dir);
+            strcat(full, name);
+            is_dir = (stat(full, &st) == 0) && S_ISDIR(st.st_mode);
+        }
+        full = arena_alloc(name_len + 2);
+        memcpy(full, name, name_len);
+        strcpy(full + name_len, is_dir ? "/" : "");
+        wordvec_push(out, full);
+    }
+
+    if (!listing->cached)
+    {
+        private_unmap(listing->entries, listing->cap);
+        free(listing);
+    }
+
+    return;
+}
+
+
+/**
+ * @brief history_alloc() carves size bytes for the history out of its pool, which is never given back.
+ * 
+ * @param size 
+ * @return void* 
+ */
+void * history_alloc(size_t size)
+{
+    size_t chunk = 1048576;
+
+    size = (size + 7) & ~(size_t) 7;
+    if (size > history.pool_left)
+    {
+        chunk = (size > chunk) ? size : chunk;
+        history.pool = private_map(chunk, false);
+        history.pool_left = chunk;
+    }
+    history.pool += size;
+    history.pool_left -= size;
+
+    return history.pool - size;
+}
+
+
+/**
+ * @brief trigram_slot() returns the slot of a trigram in the history's trigram table, which is empty if the trigram
+ *        has not been seen.
+ * 
+ * @param key 
+ * @return struct trigram_list* 
+ */
+struct trigram_list * trigram_slot(uint32_t key)
+{
+    uint32_t i = (key * 2654435761u) & (history.trigrams_cap - 1);
+
+    while ((history.trigrams[i].key != 0) && (history.trigrams[i].key != key))
+    {
+        i = (i + 1) & (history.trigrams_cap - 1);
+    }
+
+    return &history.trigrams[i];
+}
+
+
+/**
+ * @brief index_trigrams() adds a new text to the lists of the trigrams in it, doubling the table when it gets half
+ *        full. A trigram that comes twice in the text is listed once.
+ * 
+ * @param text 
+ */
+void index_trigrams(uint32_t text)
+{
+    const unsigned char * s = (const unsigned char *) history.texts[text];
+    struct trigram_list * old = history.trigrams;
+    struct trigram_list * slot;
+    uint32_t old_cap = history.trigrams_cap;
+    uint32_t * grown;
+    uint32_t key;
+    uint32_t i;
+
+    for (; (s[0] != '\0') && (s[1] != '\0') && (s[2] != '\0'); s++)
+    {
+        if (2 * (history.num_trigrams + 1) > history.trigrams_cap)
+        {
+            history.trigrams_cap = (old_cap == 0) ? 4096 : old_cap * 2;
+            history.trigrams = private_map(sizeof(struct trigram_list) * history.trigrams_cap, false);
+            for (i = 0; i < old_cap; i++)
+            {
+                if (old[i].key != 0)
+                {
+                    *trigram_slot(old[i].key) = old[i];
+                }
+            }
+            private_unmap(old, sizeof(struct trigram_list) * old_cap);
+            old = history.trigrams;
+            old_cap = history.trigrams_cap;
+        }
+
+        key = ((uint32_t) s[0] << 16) | ((uint32_t) s[1] << 8) | s[2];
+        slot = trigram_slot(key);
+        if (slot->key == 0)
+        {
+            slot->key = key;
+            history.num_trigrams++;
+        }
+        if ((slot->count > 0) && (slot->texts[slot->count - 1] == text))
+        {
+            continue;
+        }
+        if (slot->count == slot->cap)
+        {
+            slot->cap = (slot->cap == 0) ? 4 : slot->cap * 2;
+            grown = history_alloc(sizeof(uint32_t) * slot->cap);
+            if (slot->count > 0)
+            {
+                memcpy(grown, slot->texts, sizeof(uint32_t) * slot->count);
+            }
+            slot->texts = grown;
+        }
+        slot->texts[slot->count++] = text;
+    }
+
+    return;
+}
+
+
+/**
+ * @brief trie_insert() puts a text into the suggestion trie, splitting the node where it parts from what is there,
+ *        and makes it the newest text of every node on its way. A text already in the trie is only made newest.
+ * 
+ * @param text 
+ */
+void trie_insert(uint32_t text)
+{
+    const char * s = history.texts[text];
+    size_t len = strlen(s);
+    struct trie_node * nodes;
+    const char * label;
+    uint32_t * link;           // the child or sibling field that points to the node being looked at
+    uint32_t node = 0;
+    uint32_t c;
+    uint32_t mid;
+    size_t i = 0;
+    size_t k;
+
+    /* An insert adds at most two nodes, so room is made first and the array does not move under link. */
+    if (history.num_nodes + 2 >= history.nodes_cap)
+    {
+        history.nodes = private_remap(history.nodes, sizeof(struct trie_node) * history.nodes_cap,
+                                      sizeof(struct trie_node) * ((history.nodes_cap == 0) ? 1024 : history.nodes_cap * 2));
+        history.nodes_cap = (history.nodes_cap == 0) ? 1024 : history.nodes_cap * 2;
+        if (history.num_nodes == 0)
+        {
+            memset(&history.nodes[0], 0, sizeof(struct trie_node));
+            history.num_nodes = 1;
+        }
+    }
+    nodes = history.nodes;
+    nodes[0].newest = text;
+
+    while (i < len)
+    {
+        for (link = &nodes[node].child; (*link != 0); link = &nodes[*link].sibling)
+        {
+            if (history.texts[nodes[*link].text][nodes[*link].start] == s[i])
+            {
+                break;
+            }
+        }
+
+        if ((c = *link) == 0)
+        {
+            c = history.num_nodes++;
+            nodes[c].text = text;
+            nodes[c].start = i;
+            nodes[c].len = len - i;
+            nodes[c].child = 0;
+            nodes[c].sibling = 0;
+            nodes[c].newest = text;
+            *link = c;
+            return;
+        }
+
+        label = history.texts[nodes[c].text] + nodes[c].start;
+        for (k = 0; (k < nodes[c].len) && (i + k < len) && (label[k] == s[i + k]); k++)
+        {
+        }
+        if (k == nodes[c].len)
+        {
+            nodes[c].newest = text;
+            node = c;
+            i += k;
+            continue;
+        }
+
+        /* The text parts from the label k characters in, so the node is split there. */
+        mid = history.num_nodes++;
+        nodes[mid].text = nodes[c].text;
+        nodes[mid].start = nodes[c].start;
+        nodes[mid].len = k;
+        nodes[mid].child = c;
+        nodes[mid].sibling = nodes[c].sibling;
+        nodes[mid].newest = text;
+        nodes[c].start += k;
+        nodes[c].len -= k;
+        nodes[c].sibling = 0;
+        *link = mid;
+        if (i + k < len)
+        {
+            c = history.num_nodes++;
+            nodes[c].text = text;
+            nodes[c].start = i + k;
+            nodes[c].len = len - i - k;
+            nodes[c].child = 0;
+            nodes[c].sibling = nodes[mid].child;
+            nodes[c].newest = text;
+            nodes[mid].child = c;
+        }
+        return;
+    }
+
+    return;
+}
+
+
+/**
+ * @brief history_add() adds a command line to the history, as a new entry for the text it has.
+ * 
+ * @param line 
+ */
+void history_add(const char * line)
+{
+    size_t len = strlen(line);
+    uint32_t * old = history.by_hash;
+    uint32_t old_cap = history.hash_cap;
+    uint32_t cap;
+    uint32_t text;
+    uint32_t i;
+    uint32_t j;
+
+    if (2 * (history.num_texts + 1) > history.hash_cap)
+    {
+        history.hash_cap = (old_cap == 0) ? 1024 : old_cap * 2;
+        history.by_hash = private_map(sizeof(uint32_t) * history.hash_cap, false);
+        for (i = 0; i < old_cap; i++)
+        {
+            if (old[i] != 0)
+            {
+                j = hash_name(history.texts[old[i] - 1], strlen(history.texts[old[i] - 1])) & (history.hash_cap - 1);
+                while (history.by_hash[j] != 0)
+                {
+                    j = (j + 1) & (history.hash_cap - 1);
+                }
+                history.by_hash[j] = old[i];
+            }
+        }
+        private_unmap(old, sizeof(uint32_t) * old_cap);
+    }
+
+    for (i = hash_name(line, len) & (history.hash_cap - 1); history.by_hash[i] != 0; i = (i + 1) & (history.hash_cap - 1))
+    {
+        if (strcmp(history.texts[history.by_hash[i] - 1], line) == 0)
+        {
+            break;
+        }
+    }
+
+    if (history.by_hash[i] != 0)
+    {
+        text = history.by_hash[i] - 1;
+    }
+    else
+    {
+        if (history.num_texts == history.texts_cap)
+        {
+            cap = (history.texts_cap == 0) ? 1024 : history.texts_cap * 2;
+            history.texts = private_remap(history.texts, sizeof(char *) * history.texts_cap, sizeof(char *) * cap);
+            history.last = private_remap(history.last, sizeof(uint32_t) * history.texts_cap, sizeof(uint32_t) * cap);
+            history.texts_cap = cap;
+        }
+        text = history.num_texts++;
+        history.texts[text] = strcpy(history_alloc(len + 1), line);
+        history.by_hash[i] = text + 1;
+        index_trigrams(text);
+    }
+    trie_insert(text);
+
+    if (history.count == history.cap)
+    {
+        history.entries = private_remap(history.entries, sizeof(uint32_t) * history.cap,
+                                        sizeof(uint32_t) * ((history.cap == 0) ? 1024 : history.cap * 2));
+        history.cap = (history.cap == 0) ? 1024 : history.cap * 2;
+    }
+    history.last[text] = history.count;
+    history.entries[history.count++] = text;
+
+    return;
+}
+
+
+/**
+ * @brief history_suggest() returns the newest text in the history that starts with the len bytes of prefix, or NULL.
+ * 
+ * @param prefix 
+ * @param len 
+ * @return const char* 
+ */
+const char * history_suggest(const char * prefix, size_t len)
+{
+    struct trie_node * nodes = history.nodes;
+    const char * label;
+    uint32_t c;
+    size_t i = 0;
+    size_t k;
+
+    if ((history.num_nodes == 0) || (len == 0))
+    {
+        return NULL;
+    }
+
+    for (c = nodes[0].child; c != 0; )
+    {
+        label = history.texts[nodes[c].text] + nodes[c].start;
+        if (label[0] != prefix[i])
+        {
+            c = nodes[c].sibling;
+            continue;
+        }
+        for (k = 0; (k < nodes[c].len) && (i + k < len) && (label[k] == prefix[i + k]); k++)
+        {
+        }
+        if (i + k == len)
+        {
+            return history.texts[nodes[c].newest];
+        }
+        if (k < nodes[c].len)
+        {
+            return NULL;
+        }
+        i += k;
+        c = nodes[c].child;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief history_search() returns the newest history entry before entry from whose text holds the len bytes of
+ *        query, or -1. Each text is found at its newest entry only. Queries of three bytes or more only look at the
+ *        texts listed for their rarest trigram; shorter ones look back through the entries.
+ * 
+ * @param query 
+ * @param len 
+ * @param from 
+ * @return int 
+ */
+int history_search(const char * query, size_t len, uint32_t from)
+{
+    struct trigram_list * list = NULL;
+    struct trigram_list * slot;
+    const unsigned char * q = (const unsigned char *) query;
+    uint32_t text;
+    uint32_t e;
+    uint32_t i;
+    int best = -1;
+
+    if (len == 0)
+    {
+        return -1;
+    }
+
+    if (len < 3)
+    {
+        for (e = from; e-- > 0; )
+        {
+            text = history.entries[e];
+            if ((history.last[text] == e) && (memmem(history.texts[text], strlen(history.texts[text]), query, len) != NULL))
+            {
+                return e;
+            }
+        }
+        return -1;
+    }
+
+    if (history.trigrams_cap == 0)
+    {
+        return -1;
+    }
+    for (i = 0; i + 3 <= len; i++)
+    {
+        slot = trigram_slot(((uint32_t) q[i] << 16) | ((uint32_t) q[i + 1] << 8) | q[i + 2]);
+        if (slot->key == 0)
+        {
+            return -1;
+        }
+        list = ((list == NULL) || (slot->count < list->count)) ? slot : list;
+    }
+
+    for (i = 0; i < list->count; i++)
+    {
+        text = list->texts[i];
+        if ((history.last[text] < from) && ((int) history.last[text] > best) &&
+            (memmem(history.texts[text], strlen(history.texts[text]), query, len) != NULL))
+        {
+            best = history.last[text];
+        }
+    }
+
+    return best;
+}
+
+
+/**
+ * @brief crc32() returns the CRC-32 of len bytes, the one zlib and Ethernet use.
+ * 
+ * @param data 
+ * @param len 
+ * @return uint32_t 
+ */
+uint32_t crc32(const char * data, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+    uint32_t c;
+    int k;
+
+    if (crc_table[1] == 0)
+    {
+        for (c = 0; c < 256; c++)
+        {
+            crc_table[c] = c;
+            for (k = 0; k < 8; k++)
+            {
+                crc_table[c] = (crc_table[c] & 1) ? 0xEDB88320u ^ (crc_table[c] >> 1) : crc_table[c] >> 1;
+            }
+        }
+    }
+
+    while (len-- > 0)
+    {
+        crc = crc_table[(crc ^ (unsigned char) *data++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xFFFFFFFFu;
+}
+
+
+/**
+ * @brief trailer_check() returns what the check of a trailer of the given kind and size ending at end must be. The
+ *        end is mixed in so the trailer of an older pass round the ring is never taken for a new one.
+ * 
+ * @param kind 
+ * @param size 
+ * @param end 
+ * @return uint32_t 
+ */
+uint32_t trailer_check(uint32_t kind, uint32_t size, uint64_t end)
+{
+    return kind ^ (size * 2654435761u) ^ (uint32_t) end ^ (uint32_t) (end >> 32);
+}
+
+
+/**
+ * @brief read_history_record() copies the text of the record that ends at end, if the trailer there belongs to one,
+ *        into text. Returns the size of the record, the size of filler as a negative number, or 0 if there is
+ *        nothing valid ending there. The record is checked after it is copied, so a writer overwriting it while it
+ *        is read is noticed.
+ * 
+ * @param end 
+ * @param text 
+ * @return int64_t 
+ */
+int64_t read_history_record(uint64_t end, char ** text)
+{
+    uint64_t capacity = history_file->capacity;
+    struct history_record record;
+    uint64_t trailer;
+    uint32_t size;
+    uint32_t check;
+    uint64_t start;
+    uint64_t at;
+    char * copy;
+
+    at = (end - sizeof(trailer)) % capacity;
+    trailer = __atomic_load_n((uint64_t *) (history_ring + at), __ATOMIC_ACQUIRE);
+    size = (uint32_t) trailer;
+    check = (uint32_t) (trailer >> 32);
+
+    if ((size == 0) || ((size & 7) != 0) || (size > end) || (size > capacity))
+    {
+        return 0;
+    }
+    if (check == trailer_check(HISTORY_FILLER, size, end))
+    {
+        return -(int64_t) size;
+    }
+    if ((check != trailer_check(HISTORY_RECORD, size, end)) || (size < sizeof(record) + sizeof(trailer)))
+    {
+        return 0;
+    }
+
+    start = end - size;
+    memcpy(&record, history_ring + start % capacity, sizeof(record));
+    if ((record.position != start) || (record.len > size - sizeof(record) - sizeof(trailer)))
+    {
+        return 0;
+    }
+    copy = malloc(record.len + 1);
+    memcpy(copy, history_ring + start % capacity + sizeof(record), record.len);
+    copy[record.len] = '\0';
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((__atomic_load_n((uint64_t *) (history_ring + start % capacity), __ATOMIC_RELAXED) != start) ||
+        (crc32(copy, record.len) != record.crc) || (memchr(copy, '\0', record.len) != NULL))
+    {
+        free(copy);
+        return 0;
+    }
+
+    *text = copy;
+    return size;
+}
+
+
+/**
+ * @brief sync_history() adds the records written to the history file since it was last looked at, by this shell or
+ *        any other, to the history. It walks back from head to where it stopped last time, or to the oldest byte
+ *        still in the ring, then adds what it found oldest first. A record still being written is waited for
+ *        briefly; past anything that is not a record it steps back eight bytes at a time until it finds one.
+ * 
+ */
+void sync_history()
+{
+    struct wordvec found;
+    uint64_t head;
+    uint64_t stop;
+    uint64_t end;
+    int64_t size;
+    char * text;
+    int tries = 0;
+    int i;
+
+    if (history_file == NULL)
+    {
+        return;
+    }
+
+    head = __atomic_load_n(&history_file->head, __ATOMIC_ACQUIRE);
+    stop = (head > history_file->capacity) ? head - history_file->capacity : 0;
+    stop = (history_seen > stop) ? history_seen : stop;
+
+    memset(&found, 0, sizeof(found));
+    for (end = head; end > stop; )
+    {
+        if ((size = read_history_record(end, &text)) > 0)
+        {
+            if (end - size < stop)
+            {
+                free(text);
+                break;
+            }
+            wordvec_push(&found, text);
+            end -= size;
+        }
+        else if ((size < 0) && (end + size >= stop))
+        {
+            end += size;
+        }
+        else if ((end == head) && (tries++ < 1000))
+        {
+            sched_yield();
+        }
+        else
+        {
+            end -= 8;
+        }
+    }
+
+    for (i = found.count - 1; i >= 0; i--)
+    {
+        history_add(found.words[i]);
+        free(found.words[i]);
+    }
+    history_seen = head;
+
+    return;
+}
+
+
+/**
+ * @brief save_history() appends a command line to the history file, claiming room for it with a compare-and-swap on
+ *        head, so it shows up in every shell the next time it syncs, this one included. Without a history file, or
+ *        for a line too long for the ring, the line goes straight into this shell's history.
+ * 
+ * @param line 
+ */
+void save_history(const char * line)
+{
+    struct history_record record;
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t start;
+    uint64_t skip;
+    size_t len = strlen(line);
+    size_t size = (sizeof(record) + len + sizeof(uint64_t) + 7) & ~(size_t) 7;
+
+    if ((history_file == NULL) || (size > history_file->capacity / 4))
+    {
+        history_add(line);
+        return;
+    }
+    capacity = history_file->capacity;
+
+    /* A record never wraps. If it would run past the end of the ring, the bytes up to the end are claimed as well. */
+    head = __atomic_load_n(&history_file->head, __ATOMIC_RELAXED);
+    do
+    {
+        skip = (head % capacity + size > capacity) ? capacity - head % capacity : 0;
+    } while (!__atomic_compare_exchange_n(&history_file->head, &head, head + skip + size, false, __ATOMIC_ACQ_REL,
+                                          __ATOMIC_RELAXED));
+
+    if (skip > 0)
+    {
+        __atomic_store_n((uint64_t *) (history_ring + capacity - sizeof(uint64_t)),
+                         TRAILER(skip, trailer_check(HISTORY_FILLER, skip, head + skip)), __ATOMIC_RELEASE);
+    }
+
+    start = head + skip;
+    record.position = start;
+    record.len = len;
+    record.crc = crc32(line, len);
+    memcpy(history_ring + start % capacity, &record, sizeof(record));
+    memcpy(history_ring + start % capacity + sizeof(record), line, len);
+    __atomic_store_n((uint64_t *) (history_ring + (start + size - sizeof(uint64_t)) % capacity),
+                     TRAILER(size, trailer_check(HISTORY_RECORD, size, start + size)), __ATOMIC_RELEASE);
+
+    return;
+}
+
+
+/**
+ * @brief check_history_index() checks that every number in the history snapshot at data, with header h, points
+ *        inside what it points into, and puts the length of each text in lens.
+ * 
+ * @param h 
+ * @param data 
+ * @param lens 
+ * @return true 
+ * @return false if anything in it is out of place
+ */
+bool check_history_index(const struct history_index_header * h, const char * data, uint32_t * lens)
+{
+    const char * blob = data + sizeof(*h);
+    const uint32_t * last = (const uint32_t *) (blob + h->text_bytes);
+    const uint32_t * entries = last + h->num_texts;
+    const uint32_t * by_hash = entries + h->count;
+    const uint32_t * keys = by_hash + h->hash_cap;
+    const uint32_t * lists = keys + 2 * (size_t) h->trigrams_cap;
+    const struct trie_node * nodes = (const struct trie_node *) (lists + h->list_words);
+    const char * nul;
+    uint64_t words = 0;
+    uint64_t pos = 0;
+    uint32_t used = 0;
+    uint32_t i;
+
+    for (i = 0; i < h->num_texts; i++)
+    {
+        if ((nul = memchr(blob + pos, '\0', h->text_bytes - pos)) == NULL)
+        {
+            return false;
+        }
+        lens[i] = nul - (blob + pos);
+        pos += lens[i] + 1;
+    }
+    for (i = 0; i < h->num_texts; i++)
+    {
+        if (last[i] >= h->count)
+        {
+            return false;
+        }
+    }
+    for (i = 0; i < h->count; i++)
+    {
+        if (entries[i] >= h->num_texts)
+        {
+            return false;
+        }
+    }
+
+    /* The open addressed tables must hold what they say, with room left, or a lookup would never end. */
+    for (i = 0; i < h->hash_cap; i++)
+    {
+        if (by_hash[i] > h->num_texts)
+        {
+            return false;
+        }
+        used += (by_hash[i] != 0);
+    }
+    if (used != h->num_texts)
+    {
+        return false;
+    }
+    for (i = 0, used = 0; i < h->trigrams_cap; i++)
+    {
+        if ((keys[2 * i] == 0) && (keys[2 * i + 1] != 0))
+        {
+            return false;
+        }
+        used += (keys[2 * i] != 0);
+        words += keys[2 * i + 1];
+    }
+    if ((used != h->num_trigrams) || (words != h->list_words))
+    {
+        return false;
+    }
+    for (words = 0; words < h->list_words; words++)
+    {
+        if (lists[words] >= h->num_texts)
+        {
+            return false;
+        }
+    }
+
+    for (i = 0; i < h->num_nodes; i++)
+    {
+        if ((nodes[i].text >= h->num_texts) || (nodes[i].newest >= h->num_texts) || (nodes[i].child >= h->num_nodes) ||
+            (nodes[i].sibling >= h->num_nodes) || ((uint64_t) nodes[i].start + nodes[i].len > lens[nodes[i].text]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief load_history_index() loads the history snapshot, if there is one that goes with the mapped history file,
+ *        and sets history_seen to where it goes up to. It is all checked before any of it is used, so a damaged
+ *        snapshot is passed over like a missing one.
+ * 
+ * @return true 
+ * @return false if there is no usable snapshot
+ */
+bool load_history_index()
+{
+    struct history_index_header h;
+    const uint32_t * last;
+    const uint32_t * entries;
+    const uint32_t * by_hash;
+    const uint32_t * keys;
+    const uint32_t * lists;
+    uint32_t * lens;
+    char * texts;
+    char * data;
+    struct stat st;
+    uint64_t size;
+    uint32_t i;
+    int fd;
+
+    if ((fd = open(history_index_path, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        return false;
+    }
+    if ((fstat(fd, &st) == -1) || ((size_t) st.st_size < sizeof(h)) ||
+        ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+    {
+        close(fd);
+        return false;
+    }
+    close(fd);
+    memcpy(&h, data, sizeof(h));
+
+    /* The header must go with this ring and add up to the size of the file. */
+    size = sizeof(h) + h.text_bytes + sizeof(uint32_t) * ((uint64_t) h.num_texts + h.count + h.hash_cap +
+                                                          2 * (uint64_t) h.trigrams_cap + h.list_words) +
+           sizeof(struct trie_node) * (uint64_t) h.num_nodes;
+    if ((memcmp(h.magic, "smallshI", 8) != 0) || (h.version != HISTORY_INDEX_VERSION) ||
+        (h.ring_dev != (uint64_t) history_ring_stat.st_dev) || (h.ring_ino != (uint64_t) history_ring_stat.st_ino) ||
+        (h.capacity != history_file->capacity) || (h.seen > __atomic_load_n(&history_file->head, __ATOMIC_ACQUIRE)) ||
+        (h.num_texts == 0) || (h.num_texts > h.texts_cap) || (h.count > h.cap) || (h.num_nodes > h.nodes_cap) ||
+        ((h.hash_cap & (h.hash_cap - 1)) != 0) || (h.num_texts >= h.hash_cap) ||
+        ((h.trigrams_cap & (h.trigrams_cap - 1)) != 0) || ((h.trigrams_cap > 0) && (h.num_trigrams >= h.trigrams_cap)) ||
+        (h.text_bytes > (uint64_t) st.st_size) || (h.list_words > (uint64_t) st.st_size) || ((h.text_bytes & 7) != 0) ||
+        (size != (uint64_t) st.st_size))
+    {
+        munmap(data, st.st_size);
+        return false;
+    }
+    lens = malloc(sizeof(uint32_t) * h.num_texts);
+    if (!check_history_index(&h, data, lens))
+    {
+        free(lens);
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    /* It checks out, so it becomes the history, laid out in memory as history_add() would have left it. */
+    last = (const uint32_t *) (data + sizeof(h) + h.text_bytes);
+    entries = last + h.num_texts;
+    by_hash = entries + h.count;
+    keys = by_hash + h.hash_cap;
+    lists = keys + 2 * (size_t) h.trigrams_cap;
+
+    texts = history_alloc(h.text_bytes);
+    memcpy(texts, data + sizeof(h), h.text_bytes);
+    history.texts = private_map(sizeof(char *) * h.texts_cap, false);
+    for (i = 0; i < h.num_texts; i++)
+    {
+        history.texts[i] = texts;
+        texts += lens[i] + 1;
+    }
+    history.last = private_map(sizeof(uint32_t) * h.texts_cap, false);
+    memcpy(history.last, last, sizeof(uint32_t) * h.num_texts);
+    history.num_texts = h.num_texts;
+    history.texts_cap = h.texts_cap;
+    history.entries = private_map(sizeof(uint32_t) * h.cap, false);
+    memcpy(history.entries, entries, sizeof(uint32_t) * h.count);
+    history.count = h.count;
+    history.cap = h.cap;
+    history.by_hash = private_map(sizeof(uint32_t) * h.hash_cap, false);
+    memcpy(history.by_hash, by_hash, sizeof(uint32_t) * h.hash_cap);
+    history.hash_cap = h.hash_cap;
+
+    /* The trigram lists are packed one after another, each as long as its count. */
+    if (h.trigrams_cap > 0)
+    {
+        history.trigrams = private_map(sizeof(struct trigram_list) * h.trigrams_cap, false);
+        texts = (h.list_words > 0) ? history_alloc(sizeof(uint32_t) * h.list_words) : NULL;
+        if (texts != NULL)
+        {
+            memcpy(texts, lists, sizeof(uint32_t) * h.list_words);
+        }
+        for (i = 0; i < h.trigrams_cap; i++)
+        {
+            history.trigrams[i].key = keys[2 * i];
+            history.trigrams[i].count = keys[2 * i + 1];
+            history.trigrams[i].cap = keys[2 * i + 1];
+            if (keys[2 * i + 1] > 0)
+            {
+                history.trigrams[i].texts = (uint32_t *) texts;
+                texts += sizeof(uint32_t) * keys[2 * i + 1];
+            }
+        }
+    }
+    history.num_trigrams = h.num_trigrams;
+    history.trigrams_cap = h.trigrams_cap;
+
+    if (h.nodes_cap > 0)
+    {
+        history.nodes = private_map(sizeof(struct trie_node) * h.nodes_cap, false);
+        memcpy(history.nodes, lists + h.list_words, sizeof(struct trie_node) * h.num_nodes);
+    }
+    history.num_nodes = h.num_nodes;
+    history.nodes_cap = h.nodes_cap;
+    history_seen = h.seen;
+
+    free(lens);
+    munmap(data, st.st_size);
+    return true;
+}
+
+
+/**
+ * @brief save_history_index() writes the history snapshot as the shell exits. It is written beside the old one and
+ *        renamed over it, so a shell starting up never finds half of one.
+ * 
+ */
+void save_history_index()
+{
+    struct history_index_header h;
+    char * out;
+    char * p;
+    char * tmp;
+    size_t len;
+    size_t size;
+    uint32_t i;
+    bool written;
+    int fd;
+
+    if ((history_file == NULL) || (getpid() != history_pid) || (history.num_texts == 0))
+    {
+        return;
+    }
+
+    memset(&h, 0, sizeof(h));
+    for (i = 0; i < history.num_texts; i++)
+    {
+        h.text_bytes += strlen(history.texts[i]) + 1;
+    }
+    h.text_bytes = (h.text_bytes + 7) & ~(uint64_t) 7;
+    if (h.text_bytes > 2 * history_file->capacity)
+    {
+        unlink(history_index_path);
+        return;
+    }
+    for (i = 0; i < history.trigrams_cap; i++)
+    {
+        h.list_words += history.trigrams[i].count;
+    }
+
+    memcpy(h.magic, "smallshI", 8);
+    h.version = HISTORY_INDEX_VERSION;
+    h.num_texts = history.num_texts;
+    h.ring_dev = history_ring_stat.st_dev;
+    h.ring_ino = history_ring_stat.st_ino;
+    h.capacity = history_file->capacity;
+    h.seen = history_seen;
+    h.texts_cap = history.texts_cap;
+    h.count = history.count;
+    h.cap = history.cap;
+    h.hash_cap = history.hash_cap;
+    h.num_trigrams = history.num_trigrams;
+    h.trigrams_cap = history.trigrams_cap;
+    h.num_nodes = history.num_nodes;
+    h.nodes_cap = history.nodes_cap;
+
+    size = sizeof(h) + h.text_bytes + sizeof(uint32_t) * (h.num_texts + h.count + h.hash_cap + 2 * h.trigrams_cap +
+                                                          h.list_words) + sizeof(struct trie_node) * h.num_nodes;
+    out = calloc(1, size);
+    memcpy(out, &h, sizeof(h));
+    p = out + sizeof(h);
+    for (i = 0; i < history.num_texts; i++)
+    {
+        len = strlen(history.texts[i]) + 1;
+        memcpy(p, history.texts[i], len);
+        p += len;
+    }
+    p = out + sizeof(h) + h.text_bytes;
+    memcpy(p, history.last, sizeof(uint32_t) * h.num_texts);
+    p += sizeof(uint32_t) * h.num_texts;
+    memcpy(p, history.entries, sizeof(uint32_t) * h.count);
+    p += sizeof(uint32_t) * h.count;
+    memcpy(p, history.by_hash, sizeof(uint32_t) * h.hash_cap);
+    p += sizeof(uint32_t) * h.hash_cap;
+    for (i = 0; i < h.trigrams_cap; i++)
+    {
+        memcpy(p, &history.trigrams[i].key, sizeof(uint32_t));
+        memcpy(p + sizeof(uint32_t), &history.trigrams[i].count, sizeof(uint32_t));
+        p += 2 * sizeof(uint32_t);
+    }
+    for (i = 0; i < h.trigrams_cap; i++)
+    {
+        if (history.trigrams[i].count > 0)
+        {
+            memcpy(p, history.trigrams[i].texts, sizeof(uint32_t) * history.trigrams[i].count);
+            p += sizeof(uint32_t) * history.trigrams[i].count;
+        }
+    }
+    memcpy(p, history.nodes, sizeof(struct trie_node) * h.num_nodes);
+
+    tmp = malloc(strlen(history_index_path) + 32);
+    sprintf(tmp, "%s.%d.tmp", history_index_path, getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) != -1)
+    {
+        written = (write(fd, out, size) == (ssize_t) size);
+        written = (close(fd) == 0) && written;
+        if (!written || (rename(tmp, history_index_path) == -1))
+        {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(out);
+
+    return;
+}
+
+
+/**
+ * @brief open_history() maps the history file, $HISTFILE or ~/.smallsh_history, making it if there is none, and
+ *        loads the records in it, from the snapshot and the records written after it when there is one. The file is
+ *        locked only while a new one is set up. Without a usable file the history is kept for the session only.
+ * 
+ */
+void open_history()
+{
+    struct history_file_header * header;
+    struct stat st;
+    const char * name = get_var("HISTFILE");
+    const char * home = get_var("HOME");
+    char * path;
+    size_t size;
+    int fd;
+
+    if ((name != NULL) && (name[0] != '\0'))
+    {
+        path = strdup(name);
+    }
+    else if ((home != NULL) && (home[0] == '/'))
+    {
+        path = malloc(strlen(home) + 24);
+        sprintf(path, "%s/.smallsh_history", home);
+    }
+    else
+    {
+        return;
+    }
+
+    history_index_path = malloc(strlen(path) + 8);
+    sprintf(history_index_path, "%s.index", path);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    free(path);
+    if (fd == -1)
+    {
+        return;
+    }
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return;
+    }
+
+    if (st.st_size == 0)
+    {
+        size = sizeof(struct history_file_header) + (history_file_size & ~(size_t) 7);
+        if (ftruncate(fd, size) == -1)
+        {
+            close(fd);
+            return;
+        }
+    }
+    else
+    {
+        size = st.st_size;
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED)
+    {
+        close(fd);
+        return;
+    }
+    if (st.st_size == 0)
+    {
+        memcpy(header->magic, "smallsh\001", 8);
+        header->version = HISTORY_FILE_VERSION;
+        header->capacity = size - sizeof(*header);
+        header->head = 0;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    madvise(header, size, MADV_DONTFORK);
+
+    if ((size < sizeof(*header)) || (memcmp(header->magic, "smallsh\001", 8) != 0) ||
+        (header->version != HISTORY_FILE_VERSION) || (header->capacity != size - sizeof(*header)) ||
+        (header->capacity < 64) || ((header->capacity & 7) != 0))
+    {
+        munmap(header, size);
+        return;
+    }
+
+    history_file = header;
+    history_ring = (char *) (header + 1);
+    history_ring_stat = st;
+    history_pid = getpid();
+    if (!load_history_index())
+    {
+        history_seen = 0;
+    }
+    sync_history();
+    atexit(save_history_index);
+
+    return;
+}
+
+
+/**
+ * @brief put_varint() writes value at out in LEB128, seven bits to a byte with the high bit set on all but the last,
+ *        and returns the bytes written.
+ * 
+ * @param out 
+ * @param value 
+ * @return size_t 
+ */
+size_t put_varint(unsigned char * out, unsigned long long value)
+{
+    size_t n = 0;
+
+    while (value >= 0x80)
+    {
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = value;
+
+    return n;
+}
+
+
+/**
+ * @brief get_varint() reads a LEB128 value at *p, which must end before end, and moves *p past it.
+ * 
+ * @param p 
+ * @param end 
+ * @param value 
+ * @return true 
+ * @return false if the value runs past end or is too long
+ */
+bool get_varint(const unsigned char ** p, const unsigned char * end, unsigned long long * value)
+{
+    int shift;
+
+    *value = 0;
+    for (shift = 0; (*p < end) && (shift < 64); shift += 7)
+    {
+        *value |= (unsigned long long) (**p & 0x7f) << shift;
+        if ((*(*p)++ & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * @brief load_hists() adds the runs in the histogram file path to the histograms. The file is the magic, the version,
+ *        the number of commands, then for each its name, longest run and the buckets that have runs, as a gap from
+ *        the last bucket and a count, all as varints, and last the CRC-32 of everything before it. A file that does
+ *        not check out is ignored.
+ * 
+ * @param path 
+ */
+void load_hists(const char * path)
+{
+    struct command_hist * h;
+    const unsigned char * p;
+    const unsigned char * end;
+    unsigned long long version;
+    unsigned long long commands;
+    unsigned long long name_len;
+    unsigned long long max;
+    unsigned long long buckets;
+    unsigned long long gap;
+    unsigned long long count;
+    unsigned char * data;
+    struct stat st;
+    char name[256];
+    uint32_t crc;
+    ssize_t n;
+    size_t got = 0;
+    int bucket;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        return;
+    }
+    if ((fstat(fd, &st) == -1) || (st.st_size < 12))
+    {
+        close(fd);
+        return;
+    }
+    data = malloc(st.st_size);
+    while ((got < (size_t) st.st_size) && ((n = read(fd, data + got, st.st_size - got)) != 0))
+    {
+        if ((n == -1) && (errno != EINTR))
+        {
+            break;
+        }
+        got += (n > 0) ? n : 0;
+    }
+    close(fd);
+    if (got != (size_t) st.st_size)
+    {
+        free(data);
+        return;
+    }
+
+    end = data + got - 4;
+    crc = end[0] | (end[1] << 8) | (end[2] << 16) | ((uint32_t) end[3] << 24);
+    p = data + 8;
+    if ((memcmp(data, "smallshT", 8) != 0) || (crc32((char *) data, got - 4) != crc) ||
+        !get_varint(&p, end, &version) || (version != HIST_FILE_VERSION) || !get_varint(&p, end, &commands))
+    {
+        free(data);
+        return;
+    }
+
+    while ((commands-- > 0) && get_varint(&p, end, &name_len) && (name_len > 0) && (name_len < sizeof(name)) &&
+           (name_len <= (size_t) (end - p)))
+    {
+        memcpy(name, p, name_len);
+        name[name_len] = '\0';
+        p += name_len;
+        if (!get_varint(&p, end, &max) || !get_varint(&p, end, &buckets))
+        {
+            break;
+        }
+
+        h = find_hist(name, true);
+        h->max = (max > h->max) ? max : h->max;
+        for (bucket = -1; (buckets-- > 0) && get_varint(&p, end, &gap) && get_varint(&p, end, &count); )
+        {
+            if (gap > (unsigned long long) (HIST_BUCKETS - 1 - bucket))
+            {
+                break;
+            }
+            bucket += gap;
+            h->counts[bucket] += count;
+            h->total += count;
+        }
+    }
+    free(data);
+
+    return;
+}
+
+
+/**
+ * @brief save_hists() merges this session's runs into the histogram file as the shell exits. Other shells may have
+ *        saved theirs since this one started, so the file is read again under a lock, and the new one is written
+ *        beside it and renamed over it.
+ * 
+ */
+void save_hists()
+{
+    struct command_hist * h;
+    unsigned char * out;
+    char * tmp;
+    size_t size = 32;
+    size_t n = 8;
+    size_t i;
+    uint32_t crc;
+    bool written;
+    int commands = 0;
+    int buckets;
+    int lock;
+    int fd;
+    int last;
+    int j;
+
+    if ((hist_file == NULL) || (getpid() != hist_pid))
+    {
+        return;
+    }
+    for (i = 0; (i < hists_cap) && ((hists[i] == NULL) || (hists[i]->fresh == NULL)); i++)
+    {
+    }
+    if (i == hists_cap)
+    {
+        return;
+    }
+
+    tmp = malloc(strlen(hist_file) + 32);
+    sprintf(tmp, "%s.lock", hist_file);
+    if ((lock = open(tmp, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) != -1)
+    {
+        flock(lock, LOCK_EX);
+    }
+
+    /* Start again from this session's runs, and add what the file holds now. */
+    for (i = 0; i < hists_cap; i++)
+    {
+        if ((h = hists[i]) != NULL)
+        {
+            h->total = 0;
+            for (j = 0; j < HIST_BUCKETS; j++)
+            {
+                h->counts[j] = (h->fresh != NULL) ? h->fresh[j] : 0;
+                h->total += h->counts[j];
+            }
+            free(h->fresh);
+            h->fresh = NULL;
+        }
+    }
+    load_hists(hist_file);
+
+    for (i = 0; i < hists_cap; i++)
+    {
+        if ((hists[i] != NULL) && (hists[i]->total > 0))
+        {
+            size += strlen(hists[i]->name) + 30;
+            for (j = 0; j < HIST_BUCKETS; j++)
+            {
+                size += (hists[i]->counts[j] != 0) ? 8 : 0;
+            }
+            commands++;
+        }
+    }
+
+    out = malloc(size);
+    memcpy(out, "smallshT", 8);
+    n += put_varint(out + n, HIST_FILE_VERSION);
+    n += put_varint(out + n, commands);
+    for (i = 0; i < hists_cap; i++)
+    {
+        if (((h = hists[i]) == NULL) || (h->total == 0))
+        {
+            continue;
+        }
+        n += put_varint(out + n, strlen(h->name));
+        memcpy(out + n, h->name, strlen(h->name));
+        n += strlen(h->name);
+        n += put_varint(out + n, h->max);
+        for (j = 0, buckets = 0; j < HIST_BUCKETS; j++)
+        {
+            buckets += (h->counts[j] != 0);
+        }
+        n += put_varint(out + n, buckets);
+        for (j = 0, last = -1; j < HIST_BUCKETS; j++)
+        {
+            if (h->counts[j] != 0)
+            {
+                n += put_varint(out + n, j - last);
+                n += put_varint(out + n, h->counts[j]);
+                last = j;
+            }
+        }
+    }
+    crc = crc32((char *) out, n);
+    out[n++] = crc;
+    out[n++] = crc >> 8;
+    out[n++] = crc >> 16;
+    out[n++] = crc >> 24;
+
+    sprintf(tmp, "%s.%d.tmp", hist_file, getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) != -1)
+    {
+        written = (write(fd, out, n) == (ssize_t) n);
+        written = (close(fd) == 0) && written;
+        if (!written || (rename(tmp, hist_file) == -1))
+        {
+            unlink(tmp);
+        }
+    }
+    if (lock != -1)
+    {
+        close(lock);
+    }
+    free(out);
+    free(tmp);
+
+    return;
+}
+
+
+/**
+ * @brief open_hists() turns the command run time histograms on if SMALLSH_HISTOGRAMS is set. If it names a file, they
+ *        are loaded from it and saved back to it at exit; set but empty, they last only the session.
+ * 
+ */
+void open_hists()
+{
+    const char * file = getenv("SMALLSH_HISTOGRAMS");
+
+    if (file == NULL)
+    {
+        return;
+    }
+
+    hists_on = true;
+    if (file[0] == '\0')
+    {
+        return;
+    }
+
+    hist_file = strdup(file);
+    hist_pid = getpid();
+    load_hists(hist_file);
+    atexit(save_hists);
+
+    return;
+}
+
+
+/**
+ * @brief term_write() writes all of len bytes to the terminal.
+ * 
+ * @param data 
+ * @param len 
+ */
+void term_write(const char * data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        if ((n = write(STDOUT_FILENO, data, len)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return;
+}
+
+
+/**
+ * @brief editor_insert() puts len bytes into the line at the cursor and moves the cursor past them.
+ * 
+ * @param ed 
+ * @param text 
+ * @param len 
+ */
+void editor_insert(struct line_editor * ed, const char * text, size_t len)
+{
+    if (ed->len + len + 2 > ed->cap)
+    {
+        ed->cap = (ed->len + len + 2) * 2;
+        ed->buf = realloc(ed->buf, ed->cap);
+    }
+    memmove(ed->buf + ed->pos + len, ed->buf + ed->pos, ed->len - ed->pos);
+    memcpy(ed->buf + ed->pos, text, len);
+    ed->len += len;
+    ed->pos += len;
+
+    return;
+}
+
+
+/**
+ * @brief text_columns() counts the terminal columns taken by the bytes of s from from to to, one for each character.
+ * 
+ * @param s 
+ * @param from 
+ * @param to 
+ * @return size_t 
+ */
+size_t text_columns(const char * s, size_t from, size_t to)
+{
+    size_t n = 0;
+
+    for (; from < to; from++)
+    {
+        n += ((s[from] & 0xC0) != 0x80);
+    }
+
+    return n;
+}
+
+
+/**
+ * @brief editor_render() brings the terminal line up to date with the editor: the prompt, the line and, with the
+ *        cursor at its end, the rest of the newest past command it starts, dimmed. Only what differs from the line
+ *        as last drawn is written, and the cursor is moved with relative steps, so a keystroke usually costs a few
+ *        bytes however long the line is.
+ * 
+ * @param ed 
+ */
+void editor_render(struct line_editor * ed)
+{
+    const char * prompt = ed->prompt;
+    const char * text = ed->buf;
+    const char * hit;
+    char * search_prompt;
+    char * want;
+    char * attr;
+    char * out;
+    size_t text_len = ed->len;
+    size_t at = ed->pos;       // where the cursor goes in text
+    size_t tail_len = 0;
+    size_t prompt_len;
+    size_t want_len;
+    size_t cursor;
+    size_t same;
+    size_t n = 0;
+    size_t k;
+    char dim = 0;
+
+    ed->suggestion = NULL;
+    if (ed->searching)
+    {
+        search_prompt = arena_alloc(ed->search_len + 32);
+        sprintf(search_prompt, "(reverse-i-search)`%.*s': ", (int) ed->search_len, ed->search);
+        prompt = search_prompt;
+        text = (ed->match >= 0) ? history.texts[history.entries[ed->match]] : "";
+        text_len = strlen(text);
+        hit = (ed->search_len > 0) ? memmem(text, text_len, ed->search, ed->search_len) : NULL;
+        at = (hit != NULL) ? (size_t) (hit - text) : 0;
+    }
+    else if (!ed->finished && (ed->pos == ed->len) && ((ed->suggestion = history_suggest(ed->buf, ed->len)) != NULL))
+    {
+        tail_len = strlen(ed->suggestion) - ed->len;
+    }
+
+    prompt_len = strlen(prompt);
+    want_len = prompt_len + text_len + tail_len;
+    want = arena_alloc(want_len + 1);
+    attr = arena_alloc(want_len + 1);
+    memcpy(want, prompt, prompt_len);
+    memcpy(want + prompt_len, text, text_len);
+    memcpy(want + prompt_len + text_len, (tail_len > 0) ? ed->suggestion + ed->len : "", tail_len);
+    memset(attr, 0, prompt_len + text_len);
+    memset(attr + prompt_len + text_len, 1, tail_len);
+    cursor = prompt_len + at;
+
+    /* Everything up to the first cell that differs stays, backing up to the start of a character it cuts. */
+    for (same = 0; (same < ed->shown_len) && (same < want_len) && (ed->shown[same] == want[same]) &&
+                   (ed->shown_attr[same] == attr[same]); same++)
+    {
+    }
+    while ((same > 0) && (((same < want_len) && ((want[same] & 0xC0) == 0x80)) ||
+                          ((same < ed->shown_len) && ((ed->shown[same] & 0xC0) == 0x80))))
+    {
+        same--;
+    }
+
+    out = arena_alloc(want_len - same + 64);
+    if ((same == want_len) && (same == ed->shown_len))
+    {
+        /* Nothing changed but where the cursor is. */
+        if (cursor < ed->cursor)
+        {
+            n += sprintf(out + n, "\x1b[%zuD", text_columns(want, cursor, ed->cursor));
+        }
+        else if (cursor > ed->cursor)
+        {
+            n += sprintf(out + n, "\x1b[%zuC", text_columns(want, ed->cursor, cursor));
+        }
+    }
+    else
+    {
+        if (same < ed->cursor)
+        {
+            n += sprintf(out + n, "\x1b[%zuD", text_columns(ed->shown, same, ed->cursor));
+        }
+        else if (same > ed->cursor)
+        {
+            n += sprintf(out + n, "\x1b[%zuC", text_columns(ed->shown, ed->cursor, same));
+        }
+        for (k = same; k < want_len; k++)
+        {
+            if (attr[k] != dim)
+            {
+                dim = attr[k];
+                n += sprintf(out + n, (dim != 0) ? "\x1b[90m" : "\x1b[0m");
+            }
+            out[n++] = want[k];
+        }
+        if (dim != 0)
+        {
+            n += sprintf(out + n, "\x1b[0m");
+        }
+        if (text_columns(ed->shown, same, ed->shown_len) > text_columns(want, same, want_len))
+        {
+            n += sprintf(out + n, "\x1b[K");
+        }
+        if (cursor < want_len)
+        {
+            n += sprintf(out + n, "\x1b[%zuD", text_columns(want, cursor, want_len));
+        }
+    }
+
+    /* Whatever the shell has to say before the prompt goes out in the same write. */
+    out_add(out, n);
+    out_flush(STDOUT_FILENO);
 
-    if(cd_status == -1)
+    if (want_len + 1 > ed->shown_cap)
     {
-        printf("Failed to change directory.\n");
-        fflush(stdout);
+        ed->shown_cap = (want_len + 1) * 2;
+        ed->shown = realloc(ed->shown, ed->shown_cap);
+        ed->shown_attr = realloc(ed->shown_attr, ed->shown_cap);
     }
+    memcpy(ed->shown, want, want_len);
+    memcpy(ed->shown_attr, attr, want_len);
+    ed->shown_len = want_len;
+    ed->cursor = cursor;
 
     return;
 }
 
 
 /**
- * @brief pid_expansion() takes in a pointer to the location of where "$$" begins and replaces $$ with the current process id, 
- *        then returns the same line, but with the shellpid expanded.
+ * @brief editor_set() replaces the line with text and puts the cursor at its end.
  * 
- * @param dollardollar
- * @param line 
- * @return char*
+ * @param ed 
+ * @param text 
  */
-void pid_expansion(char * line)
+void editor_set(struct line_editor * ed, const char * text)
 {
-    /* local variables */
-    char str1[2050];       // Initialize the holder strings to the size of line length, rounded up for comfort. 
-    str1[0] = '\0';        // set string to start as empty
-    char str2[2050];       // str1 will hold the part of the string before $$, str2 will hold the part that comes after.
-    str2[0] = '\0';
-    unsigned long i;
-    unsigned long k;
-    unsigned long j = 0;
-    unsigned long slen = strlen(line);
+    ed->len = 0;
+    ed->pos = 0;
+    editor_insert(ed, text, strlen(text));
 
-    /* Write the first part of the string, up to where the $$ is, and null terminate the string. */
-    for ( i = 0; i < slen - 1; i++ )
-    {
-        if ((line[i] == '$') && (line[i+1] == '$'))
-        {
-            break;
-        }
+    return;
+}
 
-        str1[i] = line[i];
-    }
-    str1[i+1] = '\0';
 
-    /* Write the latter part of the string, after where $$ ends, and null terminate the string. */
-    i = i+2;   // Add 2 to skip the $$.
+/**
+ * @brief editor_step() returns where the cursor would be one character to the left or right, never splitting the
+ *        bytes of a UTF-8 character.
+ * 
+ * @param ed 
+ * @param dir -1 for left, 1 for right
+ * @return size_t 
+ */
+size_t editor_step(struct line_editor * ed, int dir)
+{
+    size_t pos = ed->pos;
 
-    for ( k = i; k < slen; k++ )
+    if ((dir < 0) && (pos > 0))
+    {
+        do
+        {
+            pos--;
+        } while ((pos > 0) && ((ed->buf[pos] & 0xC0) == 0x80));
+    }
+    else if ((dir > 0) && (pos < ed->len))
     {
-        str2[j] = line[k];
-        j++;
+        do
+        {
+            pos++;
+        } while ((pos < ed->len) && ((ed->buf[pos] & 0xC0) == 0x80));
     }
-    str2[j] = '\0';
 
-    /* Print out the first part of the string, the shellpid, and the second part of the string if it is not empty. */
-    printf("%s %d %s", str1, getpid(), str2);
-    return;
+    return pos;
 }
 
 
 /**
- * @brief redirect_output() redirects the output of a child process when the output redirection indicator is present
+ * @brief editor_browse() shows the history entry before or after the one shown, keeping the line being typed so
+ *        coming back down past the newest entry brings it back.
  * 
- * @param output 
+ * @param ed 
+ * @param step -1 for older, 1 for newer
  */
-void redirect_output(char * output) 
+void editor_browse(struct line_editor * ed, int step)
 {
-    int outfp;
-    int outdup;
-
-    /* Open or create the specified file, and handle errors. */
-    if ((outfp = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    if ((step < 0) ? (ed->browse == 0) : (ed->browse == history.count))
     {
-        printf("Output redirection error!\n");
-        fflush(stdout);
-        exit(1);
+        term_write("\a", 1);
+        return;
     }
-
-    /* Using dup2(), redirect output and handle any errors*/
-    if ((outdup = dup2(outfp, 1)) == -1)
+    if (ed->browse == history.count)
     {
-        printf("Dup2 Error!\n");
-        fflush(stdout);
-        exit(1);
+        free(ed->typed);
+        ed->typed = strndup(ed->buf, ed->len);
     }
+    ed->browse += step;
+    editor_set(ed, (ed->browse == history.count) ? ed->typed : history.texts[history.entries[ed->browse]]);
 
-    close(outfp);
     return;
 }
 
 
 /**
- * @brief redirect_input() redirects the input of a child process when the input redirection indicator is present
+ * @brief editor_list() prints the choices for a completion in columns under the line, asking first when there are
+ *        many, then draws the line again.
  * 
- * @param input 
+ * @param ed 
+ * @param choices 
  */
-void redirect_input(char * input) 
+void editor_list(struct line_editor * ed, struct wordvec * choices)
 {
-    int infp;
-    int indup;
+    struct winsize ws;
+    char * out;
+    char answer = 'y';
+    size_t width = 0;
+    size_t n = 0;
+    int cols = 80;
+    int per_row;
+    int i;
 
-    /* Open the specified file and handle errors. */
-    if((infp = open(input, O_RDONLY)) == -1)
+    if ((ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) && (ws.ws_col > 0))
     {
-        printf("Input redirection error!\n");
-        fflush(stdout);
-        exit(1);
+        cols = ws.ws_col;
+    }
+    if (choices->count > 100)
+    {
+        out = arena_alloc(64);
+        term_write(out, sprintf(out, "\nDisplay all %d possibilities? (y or n)", choices->count));
+        read(STDIN_FILENO, &answer, 1);
     }
 
-    /* Set the redirected file to close when this process or one of its children calls exec. -- Line from Module 5, Exploration Processes and I/O, Subsection "Close File Descriptor On Exec" */
-    fcntl(infp, F_SETFD, FD_CLOEXEC);
+    if (answer == 'y')
+    {
+        for (i = 0; i < choices->count; i++)
+        {
+            width = (strlen(choices->words[i]) > width) ? strlen(choices->words[i]) : width;
+        }
+        width += 2;
+        per_row = ((int) width < cols) ? cols / (int) width : 1;
 
-    /* Use dup2() to redirect the input, and handle errors. */
-    if((indup = dup2(infp, 1)) == -1)
+        out = arena_alloc((width + 1) * choices->count + 2);
+        out[n++] = '\n';
+        for (i = 0; i < choices->count; i++)
+        {
+            n += sprintf(out + n, "%-*s", ((i + 1) % per_row == 0) ? 0 : (int) width, choices->words[i]);
+            if (((i + 1) % per_row == 0) || (i + 1 == choices->count))
+            {
+                out[n++] = '\n';
+            }
+        }
+        term_write(out, n);
+    }
+    else
     {
-        printf("Dup2 Error!\n");
-        fflush(stdout);
-        exit(1);
+        term_write("\n", 1);
     }
+    ed->shown_len = 0;
+    ed->cursor = 0;
+    editor_render(ed);
 
-    close(infp);
     return;
 }
 
 
 /**
- * @brief background_process handles forking and child processes that are meant to be processed in the background when & is present and tstp is false.
+ * @brief editor_complete() completes the word before the cursor. A word in command position is completed from the
+ *        built ins and the PATH index, anything else as a path. One choice is filled in whole, several as far as they
+ *        agree, and a second Tab lists them. Characters the parser treats specially are escaped as they go in.
  * 
- * @param arguments 
- * @param argc 
- * @param shellpid 
+ * @param ed 
  */
-void background_process(char ** arguments, int argc) // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - TO DO - - - |||
+void editor_complete(struct line_editor * ed)
 {
-    /* local variables */
-    int wstatus;          // child exit status
-    int i = 0;
-
-    char * command = arguments[0];
-
-    /* Call fork and create a child process. */
-    int spawn_pid;
-    spawn_pid = fork();
+    const char * breaks = " \t|;&<>(";
+    struct wordvec choices;
+    char * word;
+    char * base;
+    char * add;
+    size_t start = ed->pos;
+    size_t base_len;
+    size_t common;
+    size_t word_len = 0;
+    size_t k;
+    bool command;
+    int i;
 
-    switch(spawn_pid)
+    while ((start > 0) && ((strchr(breaks, ed->buf[start - 1]) == NULL) || ((start > 1) && (ed->buf[start - 2] == '\\'))))
     {
-        case -1: // Fork Failed. 
-            printf("Fork() failed.\n");
-            fflush(stdout);
-            exit(1);
-            break;
-
-        case 0: // Child process. Ignores SIGINT and SIGTSTP.
-            /* Ignore SIGINT */
-            signal(SIGINT, SIG_IGN);
-
-            /* Ignore SIGTSTP */
-            signal(SIGTSTP, SIG_IGN);
-
-            /* Let the parent get underway */
-            sleep(10);
-
-            /* My approach to flushing is "Do it as often as possible" with this program. I know it's probably bad style, but I haven't crashed my laptop yet, so I'll take it */
-            fflush(stdin);
-
-            /* Print the background pid */
-            printf("background pid is %d\n", getpid());
-            fflush(stdout);
+        start--;
+    }
+    for (k = start; (k > 0) && ((ed->buf[k - 1] == ' ') || (ed->buf[k - 1] == '\t')); k--)
+    {
+    }
+    command = (k == 0) || (strchr("|;&(", ed->buf[k - 1]) != NULL);
 
-            /* Check each arguments for input and output redirection indicators. */
-            for (i = 0; i < argc; i++)
-            {
-                /* If argument i is an indicator, then i+1 will be the file. */
-                if (strcmp(arguments[i], "<") == 0)
-                {
-                    redirect_input(arguments[i + 1]);  // The next argument is where we want to redirect from.
-                }
+    /* The word is matched the way it will be read, without its escapes. */
+    word = arena_alloc(ed->pos - start + 1);
+    for (k = start; k < ed->pos; k++)
+    {
+        k += (ed->buf[k] == '\\') && (k + 1 < ed->pos);
+        word[word_len++] = ed->buf[k];
+    }
+    word[word_len] = '\0';
 
-                /* Do output redirection. */
-                else if (strcmp(arguments[i], ">") == 0)
-                {
-                    redirect_output(arguments[i + 1]); // The next argument is where we want to redirect to.
-                }
-            }
+    memset(&choices, 0, sizeof(choices));
+    if (command && (strchr(word, '/') == NULL))
+    {
+        complete_command(word, &choices);
+        base = word;
+    }
+    else
+    {
+        complete_path(word, &choices);
+        base = (strrchr(word, '/') != NULL) ? strrchr(word, '/') + 1 : word;
+    }
+    base_len = strlen(base);
 
-            /* Call Exec */
-            if(execvp(command, arguments) == -1 )
+    if (choices.count == 0)
+    {
+        term_write("\a", 1);
+        return;
+    }
+    if (choices.count > 1)
+    {
+        qsort(choices.words, choices.count, sizeof(char *), compare_words);
+        for (i = 1, k = 1; i < choices.count; i++)
+        {
+            if (strcmp(choices.words[i], choices.words[k - 1]) != 0)
             {
-                /* Print an error, if you get here, since execvp returns on success */
-                printf("Exec failed!\n");
-                fflush(stdout);
-                exit(2);
+                choices.words[k++] = choices.words[i];
             }
-            break;
-
-        default: // Parent Process. Ignores SIGINT, handles SIGTSTP // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - TO DO - - - |||
-            /* Ignore SIGINT */
-            signal(SIGINT, SIG_IGN);
-            signal(SIGTSTP, handle_SIGTSTP);
+        }
+        choices.count = k;
+    }
 
-            /* Add the spawnpid to the bchildrenarray */
-            bchildren[num_bchildren] = spawn_pid;
-            num_bchildren++;
-            
-            /* Do not block the parent process, run child in the background */
-            spawn_pid = waitpid(spawn_pid, &wstatus, WNOHANG);
+    /* Fill in what all the choices share past the word. */
+    common = strlen(choices.words[0]);
+    for (i = 1; i < choices.count; i++)
+    {
+        for (k = 0; (k < common) && (choices.words[i][k] == choices.words[0][k]); k++)
+        {
+        }
+        common = k;
+    }
 
-            break;
+    if ((choices.count > 1) && (common == base_len))
+    {
+        if (ed->tabbed)
+        {
+            editor_list(ed, &choices);
+        }
+        else
+        {
+            term_write("\a", 1);
+        }
+        ed->tabbed = true;
+        return;
+    }
 
+    add = arena_alloc((common - base_len) * 2 + 2);
+    for (k = base_len, word_len = 0; k < common; k++)
+    {
+        if (strchr(" \t'\"\\$`|&;<>()*?[]{}#!~", choices.words[0][k]) != NULL)
+        {
+            add[word_len++] = '\\';
+        }
+        add[word_len++] = choices.words[0][k];
+    }
+    if ((choices.count == 1) && (choices.words[0][common - 1] != '/'))
+    {
+        add[word_len++] = ' ';
     }
+    editor_insert(ed, add, word_len);
+    editor_render(ed);
+    ed->tabbed = (choices.count > 1);
 
     return;
 }
 
 
 /**
- * @brief foreground_process() runs the forking for a foreground child process 
+ * @brief edit_line() reads a line from the terminal in raw mode, with the cursor keys, Home and End, Ctrl-A, Ctrl-E,
+ *        Ctrl-U, Ctrl-K, Backspace and Delete for editing, Tab for completion, Up and Down for the history and Ctrl-R
+ *        to search it. Right or End at the end of the line takes the suggestion shown after it. The line is left in
+ *        line with a newline, the way getline() leaves it, and added to the history unless it is blank. Returns its
+ *        length, or -1 for Ctrl-D on an empty line.
  * 
- * @param command 
- * @param arguments 
- * @param argc 
- * @param shellpid 
+ * @param prompt 
+ * @param line 
+ * @param cap 
+ * @return ssize_t 
  */
-void foreground_process(char ** arguments, int argc) // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - TO DO - - - |||
+ssize_t edit_line(const char * prompt, char ** line, size_t * cap)
 {
-    /* local variables */
-    int wstatus;  // child exit status
-    int i = 0;    // iterator
-    int w = 0;    // value of waitpid, for parent processing
+    struct line_editor ed;
+    struct termios raw;
+    char seq[4];
+    char c;
+    ssize_t n;
+    size_t k;
+    int found;
 
-    char * command = arguments[0];
+    memset(&ed, 0, sizeof(ed));
+    ed.buf = *line;
+    ed.cap = (*line != NULL) ? *cap : 0;   // like getline(), a NULL line means no buffer whatever cap says
+    ed.prompt = prompt;
+    sync_history();
+    ed.browse = history.count;
+    ed.match = -1;
+    editor_insert(&ed, "", 0);
 
-    /* Call fork and create a child process. */
-    int spawn_pid;
-    spawn_pid = fork();
+    /* Signals stay on, so Ctrl-Z still switches foreground-only mode the way it always has. */
+    tcgetattr(STDIN_FILENO, &saved_termios);
+    raw = saved_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
 
-    switch(spawn_pid)
-    {
-        case -1: // Fork Failed. 
-            printf("Fork() failed.\n");
-            fflush(stdout);
-            exit(1);
-            break;
+    editor_render(&ed);
 
-        case 0: // Child process. Is killed by SIGINT. Ignores SIGTSTP.
-            /* Ignore SIGTSTP */
-            signal(SIGTSTP, SIG_IGN);
+    while (1)
+    {
+        if ((n = read(STDIN_FILENO, &c, 1)) <= 0)
+        {
+            if ((n == -1) && (errno == EINTR))
+            {
+                continue;
+            }
+            c = 4;
+            ed.len = 0;
+            ed.searching = false;
+        }
 
-            fflush(stdin);
-            fflush(stdout);
+        if (c != '\t')
+        {
+            ed.tabbed = false;
+        }
 
-            /* Check for input and output redirection, and handle it with calls. */
-            for (i = 0; i < argc; i++)
+        /* While searching, Ctrl-R looks further back, Ctrl-G gives up, and typing or Backspace searches again from
+           the newest entry. Any other key takes the match into the line and then does what it always does. */
+        if (ed.searching)
+        {
+            if (c == 7)
+            {
+                ed.searching = false;
+                editor_render(&ed);
+                continue;
+            }
+            if ((c == 18) || (c == 127) || (c == 8) || ((unsigned char) c >= 32))
             {
-                /* Do input redirection. */
-                if (strcmp(arguments[i], "<") == 0)
+                if ((c == 127) || (c == 8))
                 {
-                    redirect_input(arguments[i + 1]);  // The next argument is where we want to redirect from.
+                    while ((ed.search_len > 0) && ((ed.search[--ed.search_len] & 0xC0) == 0x80))
+                    {
+                    }
                 }
-
-                /* Do output redirection. */
-                else if (strcmp(arguments[i], ">") == 0)
+                else if ((c != 18) && (ed.search_len < sizeof(ed.search)))
+                {
+                    ed.search[ed.search_len++] = c;
+                }
+                found = history_search(ed.search, ed.search_len, ((c == 18) && (ed.match >= 0)) ? (uint32_t) ed.match : history.count);
+                if ((found >= 0) || (ed.search_len == 0))
                 {
-                    redirect_output(arguments[i+ 1]); // The next argument is where we want to redirect to.
+                    ed.match = found;
                 }
+                else
+                {
+                    term_write("\a", 1);
+                }
+                editor_render(&ed);
+                continue;
+            }
+            ed.searching = false;
+            if (ed.match >= 0)
+            {
+                editor_set(&ed, history.texts[history.entries[ed.match]]);
             }
+        }
 
-            /* Call Exec */
-            execvp(command, arguments);
+        switch (c)
+        {
+            case '\r':
+            case '\n':
+                ed.finished = true;
+                editor_render(&ed);
+                term_write("\n", 1);
+                ed.buf[ed.len] = '\0';
+                if (ed.buf[strspn(ed.buf, " \t")] != '\0')
+                {
+                    save_history(ed.buf);
+                }
+                ed.buf[ed.len++] = '\n';
+                ed.buf[ed.len] = '\0';
+                tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+                free(ed.shown);
+                free(ed.shown_attr);
+                free(ed.typed);
+                *line = ed.buf;
+                *cap = ed.cap;
+                return ed.len;
 
-            /* Print an error if you get here, since execvp returns on success. */
-            printf("Exec failed!\n");
-            fflush(stdout);
-            exit(2);
-            break;
+            case 4:     // Ctrl-D ends the input on an empty line and deletes under the cursor otherwise
+                if (ed.len == 0)
+                {
+                    term_write("\n", 1);
+                    tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+                    free(ed.shown);
+                    free(ed.shown_attr);
+                    free(ed.typed);
+                    *line = ed.buf;
+                    *cap = ed.cap;
+                    return -1;
+                }
+                k = editor_step(&ed, 1);
+                memmove(ed.buf + ed.pos, ed.buf + k, ed.len - k);
+                ed.len -= k - ed.pos;
+                break;
 
-        default: // Parent Process. Ignores SIGINT, handles SIGTSTP // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - TO DO - - - |||
-            /* Parent process ignore SIGINT and handle SIGTSTP */
-            signal(SIGINT, SIG_IGN);
-            signal(SIGTSTP, handle_SIGTSTP);
+            case '\t':
+                editor_complete(&ed);
+                continue;
 
-            /* Block Parent until child or children are done */
-            do 
-            {
-                w = waitpid(spawn_pid, &wstatus, 0);
+            case 18:    // Ctrl-R
+                ed.searching = true;
+                ed.search_len = 0;
+                ed.match = -1;
+                break;
 
-                if (w == -1) 
-                {
-                    printf("waitpid()\n");
-                    fflush(stdout);
-                    exit(EXIT_FAILURE);
-                } 
-                /* If the process exited, we want to get the child's exit status and cast it to our status variable. */
-                if (WIFEXITED(wstatus))
+            case 127:   // Backspace
+            case 8:
+                k = editor_step(&ed, -1);
+                memmove(ed.buf + k, ed.buf + ed.pos, ed.len - ed.pos);
+                ed.len -= ed.pos - k;
+                ed.pos = k;
+                break;
+
+            case 1:     // Ctrl-A
+                ed.pos = 0;
+                break;
+
+            case 5:     // Ctrl-E
+                if ((ed.pos == ed.len) && (ed.suggestion != NULL))
                 {
-                    status = WEXITSTATUS(wstatus);
+                    editor_insert(&ed, ed.suggestion + ed.len, strlen(ed.suggestion) - ed.len);
                 }
+                ed.pos = ed.len;
+                break;
 
-                /* Else, if the process was terminated, write the signal that killed the child to our status buffer */
-                else if (WIFSIGNALED(wstatus))
+            case 11:    // Ctrl-K
+                ed.len = ed.pos;
+                break;
+
+            case 21:    // Ctrl-U
+                memmove(ed.buf, ed.buf + ed.pos, ed.len - ed.pos);
+                ed.len -= ed.pos;
+                ed.pos = 0;
+                break;
+
+            case 27:    // escape sequences of the cursor keys, Home, End and Delete
+                if ((read(STDIN_FILENO, seq, 1) != 1) || (read(STDIN_FILENO, seq + 1, 1) != 1))
                 {
-                    printf("killed by signal %d\n", WTERMSIG(wstatus));
-                    fflush(stdout);
+                    break;
                 }
-                
-                /* Else, if the process was stopped, write the stop signal */
-                else if (WIFSTOPPED(wstatus)) 
+                if ((seq[0] == '[') && (seq[1] >= '0') && (seq[1] <= '9'))
                 {
-                    printf("stopped by signal %d\n", WSTOPSIG(wstatus));
-                    fflush(stdout);
-                } 
-                
-                /* Else, if continued, write that it was continued */
-                else if (WIFCONTINUED(wstatus)) 
+                    if ((read(STDIN_FILENO, seq + 2, 1) != 1) || (seq[2] != '~'))
+                    {
+                        break;
+                    }
+                    if (seq[1] == '3')
+                    {
+                        k = editor_step(&ed, 1);
+                        memmove(ed.buf + ed.pos, ed.buf + k, ed.len - k);
+                        ed.len -= k - ed.pos;
+                    }
+                    ed.pos = ((seq[1] == '1') || (seq[1] == '7')) ? 0 : ((seq[1] == '4') || (seq[1] == '8')) ? ed.len : ed.pos;
+                }
+                else if (((seq[0] == '[') || (seq[0] == 'O')) && ((seq[1] == 'A') || (seq[1] == 'B')))
                 {
-                    printf("continued\n");
-                    fflush(stdout);
+                    editor_browse(&ed, (seq[1] == 'A') ? -1 : 1);
                 }
-            }
-            while (!WIFEXITED(wstatus) && !WIFSIGNALED(wstatus));
-
-            break;
-
-    }
-
-    return;
-}
-
-
-/**
- * @brief prep() determines if a program should be run in the foreground or background, and calls the respective function to run the command.
- * 
- * @param line 
- * @param argv 
- * @param argc 
- * @param shellpid 
- * @param try_bg 
- */
-void prep(char ** argv, int argc, bool try_bg)
-{
-    /* If the last argument is an ampersand, and tstp is off, remove the ampersand and run the process in the background. */
-    if ((try_bg) && (!tstp))
-    {
-        background_process(argv, argc); 
-    }
+                else if (((seq[0] == '[') || (seq[0] == 'O')) && ((seq[1] == 'C') || (seq[1] == 'F')) &&
+                         (ed.pos == ed.len) && (ed.suggestion != NULL))
+                {
+                    editor_insert(&ed, ed.suggestion + ed.len, strlen(ed.suggestion) - ed.len);
+                }
+                else if ((seq[0] == '[') || (seq[0] == 'O'))
+                {
+                    ed.pos = (seq[1] == 'D') ? editor_step(&ed, -1) : (seq[1] == 'C') ? editor_step(&ed, 1) :
+                             (seq[1] == 'H') ? 0 : (seq[1] == 'F') ? ed.len : ed.pos;
+                }
+                break;
 
-    /* Otherwise, run it in the foreground. */
-    else 
-    {
-        foreground_process(argv, argc);
+            default:
+                if ((unsigned char) c >= 32)
+                {
+                    /* The rest of a UTF-8 character is read with its first byte, so it is never drawn in halves. */
+                    seq[0] = c;
+                    k = ((c & 0xE0) == 0xC0) ? 1 : ((c & 0xF0) == 0xE0) ? 2 : ((c & 0xF8) == 0xF0) ? 3 : 0;
+                    for (n = 0; ((size_t) n < k) && (read(STDIN_FILENO, seq + 1 + n, 1) == 1); n++)
+                    {
+                    }
+                    editor_insert(&ed, seq, 1 + n);
+                }
+                break;
+        }
+        editor_render(&ed);
     }
-    return;
 }
 
 
 /**
- * @brief parse() takes the user input in from command_loop() and splits the string into separate words, storing these words as
- *        commands and arguments. It also looks among the arguments for '<' which handles input redirection, '>' which handles
- *        output redirection, and '&' which indicates that a process should be run in the background if tstp is false. 
+ * @brief read_command() prompts for and reads the next command line, leaving it in line with its newline the way
+ *        getline() does. A terminal gets the line editor; anything else is read as it is. Returns the length of the
+ *        line, 0 if nothing could be read but there may be more, or -1 at the end of the input.
  * 
+ * @param prompt 
  * @param line 
+ * @param cap 
+ * @return ssize_t 
  */
-void parse(char * line)
+ssize_t read_command(const char * prompt, char ** line, size_t * cap)
 {
-    /* local variables */
-    /* local variables */
-    int argc = 0; 
-    int i = 0;
-    bool try_bg = false;
-    char * argv[max_args]; 
-
-    char * token = strtok(line, " "); 
-
-    /* If "exit", then run exit_process to kill all processes */
-    if (strcmp(line, "exit") == 0)
-    {
-        exit_process();
-    }
+    ssize_t nread;
 
-    /* Break the line into words. The first word will be the command. */
-    while (token != NULL)
+    if (isatty(STDIN_FILENO))
     {
-        argv[i++] = token;
-        token = strtok(NULL, " ");
-        argc++; 
+        return edit_line(prompt, line, cap);
     }
-    argv[argc] = NULL;
 
-    /* Identify cd for changing directory. If cd failed, the result will be -1. On success the result will be 0. */
-    if (strcmp(argv[0], "cd") == 0)
+    out_add(prompt, strlen(prompt));
+    out_flush(STDOUT_FILENO);
+    if ((nread = getline(line, cap, stdin)) == -1)
     {
-        if (argc == 1)
-        {
-            char * home = getenv("HOME");
-            chdir(home);
-        }
-        else
+        if (feof(stdin))
         {
-            change_directory(argv[1]);
+            return -1;
         }
-        return;
-    }
-
-    /* Return status of last run process. */
-    else if (strcmp(argv[0], "status") == 0) 
-    {
-        check_status();
+        clearerr(stdin);
+        return 0;
     }
 
-    /* If the last argument is &, remove it, decrement argc, and set try_bg to true, then go to prep */
-    else if (strcmp(argv[argc-1],"&") == 0)
-    {
-        try_bg = true;
-        argv[argc-1] = NULL;
-        argc--;
-        prep(argv, argc, try_bg); 
-    } 
-
-    /* The command will be run by exec functions. */
-    else
-    {
-        prep(argv, argc, try_bg);    
-    }
-
-    return;
+    return nread;
 }
 
 
@@ -653,18 +11995,24 @@ void command_loop()
     /* command loop */
     while(1)
     {
-        /* Print the prompt character, ";" and empty stdout so command prompts don't overfill. */
-        printf(": ");
-        fflush(stdout);
-
-        /* Read input from the prompt. */
-        nread = getline(&line, &input_size, stdin);
+        /* Print the prompt character, ":" and read input from the prompt. The trace is written out first, since the
+           shell may wait here for a long time, and the metrics too when they are due. */
+        metrics_write(false);
+        trace_begin("read", NULL);
+        trace_flush();
+        nread = read_command(": ", &line, &input_size);
+        trace_end("read");
 
-        /* If there was an error, clear the error */
+        /* At the end of the input there is nothing left to run, so exit the way the exit command does. Otherwise, if
+           there was an error, prompt again. */
         if (nread == -1)
         {
-            clearerr(stdin);
-            fflush(stdin);
+            reap();
+            exit_process();
+        }
+        if (nread == 0)
+        {
+            continue;
         }
         
         if(strcmp(line, "exit\n") == 0)
@@ -678,42 +12026,31 @@ void command_loop()
         if ((line[0] == '\n') || (line[0] == '#'))
         {
             reap();
-            fflush(stdin);
             continue;
         }
 
         /* if the input was too long, print a warning and continue. */
         else if (nread > max_line_length)
         {
-            printf("Line is too long.\n");
+            shell_printf("Line is too long.\n");
             reap();
-            fflush(stdin);
-            fflush(stdout);
             continue;
         }
 
-        /* Search the input for "$$" and expand pid if needed. */
-        else if (strstr(line, "$$") != 0)
-        {
-            pid_expansion(line);
-            reap();
-            fflush(stdout);
-            fflush(stdin);
-            free(line);
-            line = NULL;
-            continue;
-        }
-        
         /* Then, if there is input, remove the newline character and null terminate the string, then call parse() to parse the input */
         else if((line != NULL))
         {
-            line[strlen(line) - 1] = '\0';
+            if (line[nread - 1] == '\n')
+            {
+                line[nread - 1] = '\0';
+            }
+            trace_begin("command", line);
             parse(line);
+            trace_end("command");
         }
 
-        /* flush stdin so an overfull buffer does not negatively impact future line reading */
+        arena_reset();
         reap();
-        fflush(stdin);
         free(line);
         line = NULL;
     }
@@ -725,6 +12062,22 @@ void command_loop()
 // ----------------------------------------------------------- MAIN CODE ------------------------------------------------------------- //
 int main()
 {
+    shell_pid = getpid();
+    atexit(out_flush_at_exit);
+    trace_open();
+    metrics_open();
+    open_hists();
+    if ((metrics_file != NULL) || hists_on)
+    {
+        watch_children();
+    }
+    init_variables();
+    load_path_index();
+    if (isatty(STDIN_FILENO))
+    {
+        start_path_index();
+        open_history();
+    }
     command_loop();
     exit(exit_status);
 }
@@ -0,0 +1,116 @@
+#!/bin/sh
+# Counts the forks smallsh takes running a script of built ins with redirections, which should be none, and checks
+# the count against a script that runs one external command. fork() is counted by a preloaded wrapper that appends
+# a byte to a file each time a fork succeeds, so forks in any child are counted too. What the built ins wrote is
+# checked as well, so a script whose built ins all failed cannot pass.
+#
+# usage: tests/fork_count.sh [path to smallsh]    (builds smallsh_v20.c with $CC if no path is given)
+
+CC=${CC:-cc}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+here=$(cd "$(dirname "$0")" && pwd)
+shell=$1
+if [ -z "$shell" ]; then
+    shell=$dir/smallsh
+    $CC -std=c99 -pthread -o "$shell" "$here/../smallsh_v20.c" || exit 1
+fi
+
+cat > "$dir/forks.c" <<'SHIM'
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+pid_t fork(void)
+{
+    pid_t (*real_fork)(void) = (pid_t (*)(void)) dlsym(RTLD_NEXT, "fork");
+    const char * log = getenv("FORK_LOG");
+    pid_t pid = real_fork();
+    int fd;
+
+    if ((pid > 0) && (log != NULL) && ((fd = open(log, O_WRONLY | O_APPEND | O_CREAT, 0600)) != -1))
+    {
+        write(fd, "f", 1);
+        close(fd);
+    }
+
+    return pid;
+}
+SHIM
+$CC -shared -fPIC -o "$dir/forks.so" "$dir/forks.c" -ldl || exit 1
+
+# forks: runs the script in $dir/script.sh under smallsh, its output going to $dir/output, and prints the number of
+# forks it took.
+forks()
+{
+    rm -f "$dir/forks.log"
+    cd "$dir" && cat script.sh | FORK_LOG="$dir/forks.log" LD_PRELOAD="$dir/forks.so" "$shell" > output 2>&1
+    if [ -f "$dir/forks.log" ]; then
+        wc -c < "$dir/forks.log" | tr -d ' '
+    else
+        echo 0
+    fi
+}
+
+mkdir "$dir/sub"
+cat > "$dir/script.sh" <<'SCRIPT'
+echo one two three > out
+cat out > copy
+cat < copy
+cp copy copy2
+printf "%s-%s\n" a b > fmt
+read first rest < out
+echo read $first / $rest
+export NAME=value
+echo $NAME > name
+unset NAME
+false
+status > saved
+test -f saved
+[ -s copy2 ]
+true
+: nothing
+cd sub
+echo moved > here
+exit
+SCRIPT
+builtins=$(forks)
+
+# expect file text: fails unless $dir/file holds text, give or take a final newline.
+expect()
+{
+    if [ "$(cat "$dir/$1" 2>/dev/null)" != "$2" ]; then
+        echo "FAIL: $1 holds \"$(cat "$dir/$1" 2>/dev/null)\", not \"$2\""
+        exit 1
+    fi
+}
+
+expect out "one two three"
+expect copy "one two three"
+expect copy2 "one two three"
+expect fmt "a-b"
+expect name "value"
+expect saved "exit status 1"
+expect sub/here "moved"
+if ! grep -q "one two three" "$dir/output" || ! grep -q "read one / two three" "$dir/output"; then
+    echo "FAIL: cat < copy or read printed the wrong thing:"
+    cat "$dir/output"
+    exit 1
+fi
+
+printf '/bin/true\nexit\n' > "$dir/script.sh"
+external=$(forks)
+
+echo "forks for built ins: $builtins, for one external command: $external"
+if [ "$external" != 1 ]; then
+    echo "FAIL: the fork counter did not see the external command"
+    exit 1
+fi
+if [ "$builtins" != 0 ]; then
+    echo "FAIL: built ins forked"
+    exit 1
+fi
+echo "PASS"
@@ -0,0 +1,85 @@
+/*
+ * Times fork() + _exit() + waitpid() in the shell process as its history grows and its directory cache fills, to
+ * check that fork latency stays flat however big the shell's private caches get. It is built together with the shell:
+ *
+ *     cc -std=c99 -pthread -DSMALLSH_SOURCE='"../smallsh_v20.c"' -o fork_latency tests/fork_latency.c
+ *
+ * usage: fork_latency dir    (a scratch directory it fills with files for the directory cache)
+ *
+ * It prints the microseconds per fork, averaged over 300 forks, after each step.
+ */
+#define main smallsh_main
+#include SMALLSH_SOURCE
+#undef main
+
+#define FORKS 300
+#define FILES 100000
+
+
+/**
+ * @brief fork_us() returns the average time in microseconds of FORKS rounds of fork(), _exit() in the child and
+ *        waitpid() in the parent.
+ * 
+ * @return double 
+ */
+double fork_us()
+{
+    struct timespec start;
+    struct timespec end;
+    pid_t pid;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < FORKS; i++)
+    {
+        if ((pid = fork()) == 0)
+        {
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / FORKS / 1000.0;
+}
+
+
+int main(int argc, char ** argv)
+{
+    char line[128];
+    uint32_t target;
+    uint32_t i = 0;
+    int fd;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: fork_latency dir\n");
+        return 2;
+    }
+
+    init_variables();
+    printf("%-16s %s\n", "history entries", "us per fork");
+    printf("%-16u %.1f\n", 0, fork_us());
+    for (target = 10000; target <= 1250000; target *= 5)
+    {
+        for (; i < target; i++)
+        {
+            sprintf(line, "git commit -m 'change number %u' --author someone%u", i * 2654435761u, i);
+            history_add(line);
+        }
+        printf("%-16u %.1f\n", target, fork_us());
+    }
+
+    for (i = 0; i < FILES; i++)
+    {
+        snprintf(line, sizeof(line), "%s/file-%06u", argv[1], i);
+        if ((fd = open(line, O_WRONLY | O_CREAT, 0644)) != -1)
+        {
+            close(fd);
+        }
+    }
+    read_listing(argv[1]);
+    printf("%-16s %.1f\n", "+ dir listing", fork_us());
+
+    return 0;
+}
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Builds tests/fork_latency.c against smallsh_v20.c and against the version from before the shell's caches were kept
+# out of fork(), found in git by the [user-046] commit, and runs both. It fails if, on the current tree, a fork with
+# the caches full takes more than twice as long as one with them empty.
+#
+# usage: tests/fork_latency.sh
+
+CC=${CC:-cc}
+here=$(cd "$(dirname "$0")" && pwd)
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+commit=$(cd "$here/.." && git log --format=%H --grep='^\[user-046\]' -- smallsh_v20.c | tail -n 1)
+(cd "$here/.." && git show "$commit^:smallsh_v20.c") > "$dir/before.c" || exit 1
+cp "$here/../smallsh_v20.c" "$dir/after.c"
+
+for tree in before after; do
+    $CC -std=c99 -pthread -DSMALLSH_SOURCE="\"$dir/$tree.c\"" -o "$dir/$tree" "$here/fork_latency.c" || exit 1
+    mkdir "$dir/$tree.files"
+    echo "$tree:"
+    "$dir/$tree" "$dir/$tree.files" | tee "$dir/$tree.out"
+    rm -rf "$dir/$tree.files"
+done
+
+# The first row is the empty shell; every later one must stay within twice its time.
+if ! awk 'NR == 2 { base = $NF } NR > 2 && $NF > 2 * base { bad = 1 } END { exit bad }' "$dir/after.out"; then
+    echo "FAIL: fork latency grows with the shell's caches"
+    exit 1
+fi
+echo "PASS"
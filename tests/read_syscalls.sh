@@ -0,0 +1,57 @@
+#!/bin/sh
+# Runs a while read loop over a million-line file in smallsh and checks that read keeps to a few syscalls per line:
+# it should read the file in large blocks, once, rather than a block or a byte per line. The shell reads its own
+# syscr and rchar from /proc/$$/io, with the cat built in, before and after the loop. /proc does not count lseek(),
+# which read also makes twice per line. The loop counts the lines too, to check that none were lost.
+#
+# usage: tests/read_syscalls.sh [path to smallsh]    (builds smallsh_v20.c with $CC if no path is given)
+#        LINES=n sets the length of the file
+
+CC=${CC:-cc}
+LINES=${LINES:-1000000}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+here=$(cd "$(dirname "$0")" && pwd)
+shell=$1
+if [ -z "$shell" ]; then
+    shell=$dir/smallsh
+    $CC -std=c99 -pthread -o "$shell" "$here/../smallsh_v20.c" || exit 1
+fi
+
+seq 1 "$LINES" | sed 's/^/line /' > "$dir/input"
+size=$(wc -c < "$dir/input" | tr -d ' ')
+
+cat > "$dir/script.sh" <<'SCRIPT'
+cat /proc/$$/io > before
+n=0
+while read word number; do n=$((n + 1)); done < input
+echo $n > count
+cat /proc/$$/io > after
+exit
+SCRIPT
+(cd "$dir" && cat script.sh | "$shell" > /dev/null 2>&1)
+
+field()
+{
+    sed -n "s/^$1: //p" "$dir/$2"
+}
+
+count=$(cat "$dir/count" 2>/dev/null)
+reads=$(( $(field syscr after) - $(field syscr before) ))
+bytes=$(( $(field rchar after) - $(field rchar before) ))
+echo "$count lines of $LINES, $reads read calls, $bytes bytes read for a $size byte file"
+
+if [ "$count" != "$LINES" ]; then
+    echo "FAIL: the loop did not see every line"
+    exit 1
+fi
+if [ $((reads * 100)) -gt "$LINES" ]; then
+    echo "FAIL: more than one read call per 100 lines"
+    exit 1
+fi
+if [ "$bytes" -gt $((size * 2)) ]; then
+    echo "FAIL: the file was read more than twice over"
+    exit 1
+fi
+echo "PASS"
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+# Times smallsh running a script made of the commands scripts use most for conditions and output: test and [, echo,
+# printf, true and false. Each shell is run a few times on the script piped to its stdin, and the best time is kept.
+#
+# usage: tests/throughput.py [smallsh ...]
+#        LINES=n sets the length of the script (default 3000)
+#
+# With no shells given, it builds smallsh_v20.c and the version from before those commands became built ins, found in
+# git by the [user-030] commit, prints the two side by side and fails unless the current one is faster.
+
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+BODY = [
+    "test -f /etc/passwd",
+    "[ 1 -lt 2 ]",
+    "echo line of output",
+    "printf '%s %d\\n' count 3",
+    "test -n something",
+    "true",
+    "false",
+    "[ abc = abc ]",
+]
+RUNS = 3
+
+
+def run(shell, script):
+    best = None
+    for _ in range(RUNS):
+        with open(script, "rb") as f:
+            text = f.read()
+        started = time.monotonic()
+        subprocess.run([shell], input=text, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        elapsed = time.monotonic() - started
+        best = elapsed if (best is None) or (elapsed < best) else best
+    return best
+
+
+def build(source, binary):
+    subprocess.check_call(["cc", "-std=c99", "-pthread", "-o", binary, source])
+
+
+def main():
+    shells = sys.argv[1:]
+    compare = not shells
+    lines = int(os.environ.get("LINES", "3000"))
+    tmp = tempfile.TemporaryDirectory()
+    if compare:
+        here = os.path.dirname(os.path.abspath(__file__))
+        root = os.path.dirname(here)
+        commit = subprocess.check_output(["git", "log", "--format=%H", "--grep=^\\[user-030\\]", "--", "smallsh_v20.c"],
+                                         cwd=root, text=True).split()[-1]
+        before = os.path.join(tmp.name, "before.c")
+        with open(before, "w") as f:
+            f.write(subprocess.check_output(["git", "show", commit + "^:smallsh_v20.c"], cwd=root, text=True))
+        build(before, os.path.join(tmp.name, "before"))
+        build(os.path.join(root, "smallsh_v20.c"), os.path.join(tmp.name, "after"))
+        shells = [os.path.join(tmp.name, "before"), os.path.join(tmp.name, "after")]
+
+    script = os.path.join(tmp.name, "script.sh")
+    with open(script, "w") as f:
+        for i in range(lines):
+            f.write(BODY[i % len(BODY)] + "\n")
+        f.write("exit\n")
+
+    times = [run(shell, script) for shell in shells]
+    for shell, elapsed in zip(shells, times):
+        print("%-10s %8.3f s  %10.0f lines/s" % (os.path.basename(shell), elapsed, lines / elapsed))
+    if compare:
+        print("speedup    %8.1fx" % (times[0] / times[1]))
+        if times[1] >= times[0]:
+            print("FAIL: the built ins are not faster")
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
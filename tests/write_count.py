@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+# Counts the write(2) and writev(2) calls smallsh makes for each command typed at an interactive prompt, reading the
+# shell's syscw from /proc/<pid>/task/<pid>/io. The line is sent first and the writes that echo it are counted apart
+# from those that run it once Enter is sent: its messages and the next prompt. Writes by children are not counted.
+#
+# usage: tests/write_count.py [smallsh ...]
+#
+# With no shells given, it builds smallsh_v20.c and the version from before the batched output layer, found in git
+# by the [user-047] commit, and prints the two side by side. Given two or more, the first is taken as the before and
+# the last as the after. It fails unless the after makes fewer writes running the commands than the before, and no
+# more for any one command.
+
+import os
+import pty
+import select
+import subprocess
+import sys
+import tempfile
+import time
+
+COMMANDS = [
+    "",
+    "status",
+    "cd /nonexistent",
+    "status",
+    "echo hi",
+    "printf '%s\\n' one two three",
+    "false",
+    "status",
+    "true",
+    "cd /",
+    "cd /nonexistent",
+    "echo done > /dev/null",
+]
+
+
+def syscw(pid):
+    with open("/proc/%d/task/%d/io" % (pid, pid)) as f:
+        for line in f:
+            if line.startswith("syscw:"):
+                return int(line.split()[1])
+    return 0
+
+
+def drain(fd, prompt, timeout=5.0):
+    """Reads the terminal until it has been quiet for a moment, and if prompt is set, shows the prompt."""
+    seen = b""
+    end = time.time() + timeout
+    while time.time() < end:
+        ready, _, _ = select.select([fd], [], [], 0.1)
+        if ready:
+            try:
+                seen += os.read(fd, 65536)
+            except OSError:
+                break
+        elif not prompt or seen.rstrip(b"\x1b[K").endswith(b": "):
+            break
+    return seen
+
+
+def count(shell):
+    pid, fd = pty.fork()
+    if pid == 0:
+        os.chdir("/tmp")
+        os.execv(shell, [shell])
+    drain(fd, True)
+    counts = []
+    for command in COMMANDS:
+        before = syscw(pid)
+        os.write(fd, command.encode())
+        drain(fd, False)
+        typed = syscw(pid)
+        os.write(fd, b"\r")
+        drain(fd, True)
+        counts.append((typed - before, syscw(pid) - typed))
+    os.write(fd, b"exit\r")
+    os.waitpid(pid, 0)
+    return counts
+
+
+def build(source, binary):
+    subprocess.check_call(["cc", "-std=c99", "-pthread", "-o", binary, source])
+
+
+def main():
+    shells = sys.argv[1:]
+    tmp = tempfile.TemporaryDirectory()
+    if not shells:
+        here = os.path.dirname(os.path.abspath(__file__))
+        root = os.path.dirname(here)
+        commit = subprocess.check_output(["git", "log", "--format=%H", "--grep=^\\[user-047\\]", "--", "smallsh_v20.c"],
+                                         cwd=root, text=True).split()[-1]
+        before = os.path.join(tmp.name, "before.c")
+        with open(before, "w") as f:
+            f.write(subprocess.check_output(["git", "show", commit + "^:smallsh_v20.c"], cwd=root, text=True))
+        build(before, os.path.join(tmp.name, "before"))
+        build(os.path.join(root, "smallsh_v20.c"), os.path.join(tmp.name, "after"))
+        shells = [os.path.join(tmp.name, "before"), os.path.join(tmp.name, "after")]
+
+    results = [count(shell) for shell in shells]
+    names = [os.path.basename(shell) for shell in shells]
+    print("%-32s" % "writes for typing / running" + "".join("%16s" % name for name in names))
+    for i, command in enumerate(COMMANDS):
+        print("%-32s" % (command or "(empty line)") + "".join("%10d /%4d" % r[i] for r in results))
+    print("%-32s" % "total" + "".join("%10d /%4d" % (sum(c[0] for c in r), sum(c[1] for c in r)) for r in results))
+
+    if len(results) > 1:
+        before, after = results[0], results[-1]
+        if sum(c[1] for c in after) >= sum(c[1] for c in before):
+            print("FAIL: running the commands takes no fewer writes than before")
+            sys.exit(1)
+        for i, command in enumerate(COMMANDS):
+            if after[i][1] > before[i][1]:
+                print("FAIL: %s takes more writes than before" % (command or "an empty line"))
+                sys.exit(1)
+        print("PASS")
+
+
+if __name__ == "__main__":
+    main()